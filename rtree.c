@@ -2,8 +2,41 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include <limits.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#else
+#include <unistd.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define HAVE_EPOLL 1
+#endif
 #include <SDL2/SDL.h>
 #define m 2
 #define M 4
@@ -13,6 +46,22 @@
 #define NODE_RADIUS 20
 #define MAX_OBJECTS 1000
 #define K_NEAREST_NEIGHBORS 5
+#define LOD_PIXELS 64             // Subtrees of more than M objects whose MBR covers fewer pixels are drawn as one shaded rectangle
+#define LOD_THIN 4                // So are those whose MBR is thinner than this
+#define LOD_SHADES 8
+#define DIRTY_SMALL 32            // Changed entries up to this many pixels wide or high are redrawn whole, larger ones along their outlines
+#define DISK_PAGE_SIZE 4096       // Size of a page of the disk-resident R-Tree
+#define DISK_MIN_FRAMES 16
+#define DISK_READ_DEPTH 32       // Page reads a query keeps in flight
+#define DISK_READ_THREADS 4      // Reader threads used when io_uring is unavailable
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+#ifndef QR_BITS
+#define QR_BITS 16               // Bits per quantised coordinate in compact internal nodes, 8 or 16
+#endif
 //******************************************************************************************************************************************************************
 // Defining various struct
 
@@ -24,9 +73,21 @@ struct object
     int x;
     int y;
     char type[MAX_TYPE_LEN];
+    int type_id;                 // Interned id of type, see intern_type
 };
 typedef struct object * OBJ;
 
+#define HISTOGRAM_TYPES 8        // Types tracked individually by a node histogram
+
+// Stores the number of objects of each type below a node, for its HISTOGRAM_TYPES most frequent types
+struct type_histogram
+{
+    int num_types;
+    int type_ids[HISTOGRAM_TYPES];
+    int counts[HISTOGRAM_TYPES];
+    int other;                   // Objects of the remaining types; the histogram is exact only while this is 0
+};
+
 // Stores the bounding rectangles of nodes.
 struct rectangle
 {
@@ -38,6 +99,14 @@ struct rectangle
 typedef struct rectangle * RECT;
 
 
+// Stores the state a node of a concurrent tree needs (an R-link tree), allocated by create_concurrent_r_tree
+struct node_link
+{
+    pthread_rwlock_t latch;      // Latches the node while it is read or modified
+    struct node * right_link;    // Stores the right sibling at the node's level
+    unsigned long long nsn;      // Stores the node sequence number given by the last split of the node
+};
+
 // Stores the details of a node of R-Tree.
 struct node
 {
@@ -48,7 +117,12 @@ struct node
     RECT regions[M];             // Stores the bounding box of children or object
     struct node * children[M];   // Stores the children of node if it is a internal node
     OBJ objects[M];              // Stores the objects stored if it is a leaf node
+    int counts[M];               // Stores the number of objects below each entry (1 for the entries of a leaf)
+    struct type_histogram * histogram; // Stores the types of the objects below the node, NULL unless the tree keeps histograms
     char name[50];               // New field for node name
+    int ref_count;               // Stores the number of versions or parents sharing the node (versioned trees only)
+    int epoch;                   // Stores the version that created the node, which alone may modify it (versioned trees only)
+    struct node_link * link;     // Stores the latch, right link and NSN of the node (concurrent trees only, NULL otherwise)
 
 };
 typedef struct node * NODE;
@@ -62,9 +136,432 @@ struct r_tree
 };
 typedef struct r_tree * R_TREE;
 
+#define DIRTY_MAX_REGIONS 1024   // Changes recorded between two redraws before the viewer redraws everything
+
+// Stores an entry of a tree whose rectangle or object count changed, so the viewer can redraw just the area around it
+struct dirty_region
+{
+    struct rectangle before;     // Rectangle of the entry before the change, if has_before
+    struct rectangle after;      // Rectangle of the entry after the change, if has_after
+    bool has_before;
+    bool has_after;
+    int count;                   // Number of objects below the entry after the change
+};
+
+// Stores the changes made to the tree since the viewer last redrew it
+struct dirty_list
+{
+    struct dirty_region regions[DIRTY_MAX_REGIONS];
+    int num_regions;
+    bool overflowed;             // Set when more changes were made than fit, so that everything must be redrawn
+};
+
+// Stores an entry of the best-first queue used by the nearest neighbour iterator.
+struct nn_entry
+{
+    double distance;             // MINDIST to the node, or distance to the object
+    NODE node;                   // Node still to be expanded, NULL if entry is an object
+    OBJ object;                  // Object to be reported, NULL if entry is a node
+};
+
+// Stores the state of an incremental (distance browsing) nearest neighbour search.
+struct nn_iterator
+{
+    int user_x;
+    int user_y;
+    int size;                    // Number of entries in the heap
+    int capacity;                // Number of entries the heap can hold before growing
+    struct nn_entry * heap;      // Min-heap of nodes and objects ordered by distance
+};
+typedef struct nn_iterator * NN_ITER;
+
+// Predicates supported by the spatial join of two R-Trees
+enum join_predicate
+{
+    JOIN_INTERSECTS,             // Pairs whose rectangles intersect
+    JOIN_WITHIN_DISTANCE         // Pairs whose rectangles are at most a given distance apart
+};
+
+// Stores one coordinate of a quantised MBR
+#if QR_BITS == 8
+typedef unsigned char QCOORD;
+#else
+typedef unsigned short QCOORD;
+#endif
+#define QR_LEVELS ((1 << QR_BITS) - 1)
+
+// Stores a child MBR quantised relative to the MBR of its parent, rounded outward.
+struct qr_rect
+{
+    QCOORD min_x;
+    QCOORD min_y;
+    QCOORD max_x;
+    QCOORD max_y;
+};
+
+// Stores a leaf of the compact tree. Entries are sorted by min_x and their exact rectangles are varint encoded as
+// (min_x - previous min_x, min_y - leaf min_y, width, height), so a point usually takes 4 bytes instead of a 16-byte rectangle.
+// The object array sits right after the header and the encoded bytes follow it.
+struct qr_leaf
+{
+    unsigned char count;
+    bool short_values;           // Stores whether every encoded value fits in one byte
+    unsigned short size;         // Stores the number of encoded bytes
+    int min_x;                   // Stores the corner of the leaf MBR, the base of the deltas
+    int min_y;
+    OBJ objects[];               // Objects sorted by min_x, followed by the encoded rectangles
+};
+
+// Stores an internal node of the compact tree.
+struct qr_node
+{
+    unsigned char count;         // Stores the count of children
+    struct qr_rect regions[M];   // Stores the quantised bounding boxes of the children
+    void * children[M];          // Stores the children of node
+};
+
+// Stores a read-only R-Tree whose internal nodes hold quantised child MBRs (QR-tree).
+struct qr_tree
+{
+    int height;
+    struct rectangle rect;       // Exact MBR of the whole tree, the frame of the root
+    void * root;                 // struct qr_leaf if height is 0, struct qr_node otherwise
+};
+typedef struct qr_tree * QR_TREE;
+
+// Stores one node of a frozen R-Tree, with its children (or objects) stored consecutively from index first
+struct frozen_node
+{
+    unsigned short is_leaf;
+    unsigned short count;
+    unsigned int first;          // Index of the first child in nodes, or of the first object in objects for a leaf
+    struct rectangle regions[M];
+};
+
+// Stores a frozen R-Tree: a read-only, pointer-free copy in one contiguous block holding the nodes in breadth-first order
+// followed by copies of the objects.
+struct frozen_r_tree
+{
+    int num_nodes;
+    int num_objects;
+    struct frozen_node * nodes;  // nodes[0] is the root
+    struct object * objects;
+    void * block;                // Allocation holding nodes and objects, written out as is by save_frozen_r_tree
+    size_t block_size;
+};
+typedef struct frozen_r_tree * FROZEN_R_TREE;
+
+#define POLYGON_GRID_VERTICES 32 // Polygons with more vertices get an edge grid for their exact tests
+
+// Stores a simple polygon used as a query region. Polygons with many vertices also keep an edge grid: the polygon's MBR is cut
+// into horizontal slabs of equal height and each slab lists the edges whose y-extent overlaps it.
+struct polygon
+{
+    int num_vertices;
+    int * xs;
+    int * ys;                    // Vertex i is (xs[i], ys[i]); edge i joins vertex i to vertex i + 1 (mod num_vertices)
+    struct rectangle mbr;
+    int num_slabs;               // 0 when the polygon has no edge grid
+    double slab_height;
+    int * slab_start;            // Edges of slab k are slab_edges[slab_start[k]] .. slab_edges[slab_start[k + 1] - 1]
+    int * slab_edges;
+};
+typedef struct polygon * POLYGON;
+
+#define CONCURRENT_MAX_HEIGHT 32 // Levels a concurrent tree can grow to; with at least m entries per node 2^32 objects fit
+
+// Stores an R-Tree shared by concurrent inserting and querying threads (an R-link tree)
+struct concurrent_r_tree
+{
+    R_TREE r_tree;
+    pthread_rwlock_t root_latch; // Guards the root, the height and level_heads, and stands in for the parent of the root
+    unsigned long long nsn_counter; // Global counter handing out node sequence numbers to splits
+    NODE level_heads[CONCURRENT_MAX_HEIGHT]; // Leftmost node of each level, leaves being level 0
+};
+typedef struct concurrent_r_tree * CONCURRENT_R_TREE;
+
+#define MAX_SHARDS 64
+#define SHARD_QUEUE_LIMIT 65536  // Inserts a shard queues before producers wait for its writer
+
+// Stores an insert waiting in the queue of a shard
+struct shard_insert
+{
+    OBJ object;
+    RECT rect;
+};
+
+// Stores one shard of a sharded R-Tree: the part of space routed to it, its tree and the writer thread applying its inserts
+struct shard
+{
+    struct rectangle region;     // Objects whose rectangle centre lies here are routed to the shard
+    struct rectangle bounds;     // MBR of the objects in the tree, valid once num_objects > 0
+    long long num_objects;
+    R_TREE r_tree;
+    pthread_rwlock_t tree_latch; // Held shared by queries and exclusively by the writer while it applies a batch
+    pthread_t writer;
+    pthread_mutex_t lock;        // Guards the queue and the counters below
+    pthread_cond_t queued;       // Signalled when inserts are queued or the writer is to stop
+    pthread_cond_t applied;      // Signalled when the writer has applied a batch
+    struct shard_insert * queue;
+    int queue_size;
+    int queue_capacity;
+    long long num_queued;        // Inserts ever queued, and applied to the tree, to tell when the shard is drained
+    long long num_applied;
+    bool stopping;
+};
+
+// Stores an index partitioned in space into shards, each with its own R-Tree and writer thread
+struct sharded_r_tree
+{
+    int num_shards;
+    struct shard * shards;
+};
+typedef struct sharded_r_tree * SHARDED_R_TREE;
+
+// Kinds of queries kept in the query result cache
+enum cached_query_kind
+{
+    CACHED_WINDOW,
+    CACHED_RADIUS,
+    CACHED_KNN
+};
+
+// Stores one cached query result.
+struct cache_entry
+{
+    struct object anchor;        // Entry of the invalidation index, must stay first so that the index's OBJ can be cast back
+    enum cached_query_kind kind;
+    int params[4];               // Quantised query parameters, the key together with kind and option
+    int option;                  // Window predicate or K
+    bool global;                 // Result may change anywhere e.g. kNN with fewer than K objects; not indexed
+    struct rectangle region;     // Area in which a change may alter the result
+    OBJ * results;
+    int num_results;
+    struct cache_entry * lru_prev;   // Towards the most recently used entry
+    struct cache_entry * lru_next;   // Towards the least recently used entry
+    struct cache_entry * hash_next;
+};
+
+// Stores an LRU cache of query results in front of an R-Tree, invalidated by the regions touched by updates.
+struct query_cache
+{
+    R_TREE r_tree;               // Tree whose queries are cached
+    R_TREE index;                // Regions of the cached queries, used to find the entries a change invalidates
+    int capacity;                // Maximum number of cached results
+    int size;
+    int quantum;                 // Grid the query parameters are snapped to, 1 keeps them exact
+    int num_global;              // Number of cached results that any change invalidates
+    int num_buckets;
+    struct cache_entry ** buckets;
+    struct cache_entry * lru_head;
+    struct cache_entry * lru_tail;
+    OBJ * scratch;               // Buffer for invalidation lookups, capacity entries
+    long long hits;
+    long long misses;
+    long long invalidations;
+};
+typedef struct query_cache * QUERY_CACHE;
+
+// Operations recorded in the write-ahead log
+enum wal_op
+{
+    WAL_INSERT = 1,
+    WAL_DELETE = 2,
+    WAL_UPDATE = 3
+};
+
+// Stores the write-ahead log of changes made to an R-Tree. Records are appended to an in-memory buffer under a short lock and
+// written out by group commit: the first committer to find no flush running writes and fsyncs everything appended so far on
+// behalf of all waiting committers. The tree itself is never locked by the log.
+struct wal
+{
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;      // Signalled whenever a group commit finishes
+    unsigned char * buffer;      // Records appended but not yet written
+    size_t used;
+    size_t capacity;
+    unsigned long long next_lsn;     // LSN of the next record
+    unsigned long long durable_lsn;  // Every record up to this LSN is on disk
+    bool flushing;               // A committer is writing the buffer
+    long long fsyncs;            // Number of fsyncs i.e. group commits so far
+    long long failures;          // Number of group commits that failed so far
+    long durable_size;           // Length of the valid prefix of the log file
+    bool broken;                 // A failed write could not be truncated away, so nothing more can be made durable
+};
+typedef struct wal * WAL;
+
+// Stores one committed, immutable version of a versioned R-Tree.
+struct r_tree_version
+{
+    long long id;
+    time_t committed_at;
+    int height;
+    NODE root;                   // Nodes are shared with other versions through reference counts
+    int ref_count;               // Held by the version list while retained and by every reader
+    struct r_tree_version * older;
+};
+typedef struct r_tree_version * VERSION;
+
+// Stores an R-Tree in which every committed batch creates a new version by path copying.
+struct versioned_r_tree
+{
+    pthread_mutex_t lock;        // Serialises commits and protects the version list
+    VERSION latest;              // Newest version, the list continues through older
+    long long next_id;
+    int retain;                  // Number of versions kept in the list
+};
+typedef struct versioned_r_tree * VERSIONED_R_TREE;
+
+// Stores one entry of a disk page: a child page of an internal page, or an object of a leaf page.
+struct disk_entry
+{
+    struct rectangle region;
+    unsigned int child;          // Page id of the child (internal pages only)
+    int x;                       // Object fields (leaf pages only)
+    int y;
+    char type[MAX_TYPE_LEN];
+};
+
+#define DISK_PAGE_HEADER 8
+#define DISK_MAX_ENTRIES ((DISK_PAGE_SIZE - DISK_PAGE_HEADER) / (int)sizeof(struct disk_entry))
+#define DISK_MIN_ENTRIES (DISK_MAX_ENTRIES * 2 / 5)
+
+// Stores the layout of a node page of the disk-resident R-Tree
+struct disk_page
+{
+    unsigned short is_leaf;
+    unsigned short count;
+    unsigned int reserved;
+    struct disk_entry entries[DISK_MAX_ENTRIES];
+};
+
+// Stores the layout of page 0 of the disk-resident R-Tree
+struct disk_header
+{
+    char magic[8];
+    unsigned int page_size;
+    unsigned int root;           // Page id of the root
+    unsigned int num_pages;      // Pages allocated so far, including the header
+    int height;
+    long long count;             // Number of objects
+};
+
+// Stores one frame of the buffer pool
+struct buffer_frame
+{
+    unsigned int page_id;
+    int pin_count;               // Frames with pinned pages are never evicted
+    bool valid;                  // Frame holds a page
+    bool dirty;                  // Page was modified since it was read
+    bool referenced;             // Second chance bit of the CLOCK replacement
+    bool loading;                // An asynchronous read into the frame has not completed yet
+    bool failed;                 // The asynchronous read failed, the frame is dropped once unpinned
+    bool types_interned;         // type_ids holds the interned types of the entries, see frame_type_ids
+    int next;                    // Next frame of the same hash bucket, -1 at the end
+    unsigned char * data;
+    int * type_ids;
+};
+
+// Stores the asynchronous page reader of a disk-resident R-Tree. Reads are submitted through io_uring where the kernel supports
+// it and otherwise handed to a small pool of threads issuing pread; either way completions are reaped in arrival order.
+struct page_reader
+{
+    int fd;
+    int depth;                   // Maximum number of reads in flight
+    int in_flight;               // Reads submitted and not reaped yet
+    int unsubmitted;             // Reads queued but not taken by the kernel or the threads yet
+    unsigned int * page_ids;     // Page read into each frame, indexed by frame
+    unsigned char ** buffers;    // Buffer of each frame, indexed by frame
+#ifdef HAVE_IO_URING
+    int ring_fd;                 // -1 if io_uring is unavailable
+    unsigned char * sq_ring;
+    unsigned char * cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+    unsigned sq_local_tail;      // Tail past the last entry written, published to the kernel by page_reader_flush
+    unsigned * cq_head, * cq_tail, * cq_mask;
+    struct io_uring_cqe * cqes;
+#endif
+    int num_threads;             // 0 if io_uring is used or reads are done inline
+    pthread_t * threads;
+    pthread_mutex_t lock;
+    pthread_cond_t requested;    // Signalled when reads are queued or the reader stops
+    pthread_cond_t completed;    // Signalled when a read completes
+    int * requests;              // Ring of frames waiting for a thread
+    int request_head, request_count;
+    int * completions;           // Ring of frames whose read finished, with the result
+    bool * results;
+    int completion_head, completion_count;
+    bool stopping;
+};
+
+// Stores a disk-resident R-Tree and the buffer pool caching its pages. Not thread safe.
+struct disk_r_tree
+{
+    int fd;
+    struct disk_header header;
+    bool header_dirty;
+    int num_frames;
+    struct buffer_frame * frames;
+    unsigned char * memory;      // Page buffers of all frames
+    int * type_ids;              // Interned entry types of all frames, DISK_MAX_ENTRIES per frame
+    int * buckets;               // Hash of page id to frame, chained through next
+    int num_buckets;
+    int hand;                    // Position of the CLOCK hand
+    long long hits;
+    long long misses;
+    long long writes;
+    struct page_reader * reader; // Asynchronous reads used by window, radius and nearest neighbour queries
+};
+typedef struct disk_r_tree * DISK_R_TREE;
+
+// Predicates supported by window queries, comparing an object's rectangle with the query window
+enum window_predicate
+{
+    WINDOW_INTERSECTS,           // Object shares at least one point with the window
+    WINDOW_CONTAINS,             // Object contains the whole window
+    WINDOW_WITHIN                // Object lies completely inside the window
+};
+
+// Called once for every pair of objects satisfying the join predicate
+typedef void (*JOIN_CALLBACK)(OBJ object_a, OBJ object_b, void* user_data);
+
+// Called once for every object of the query tree with its K nearest objects (closest first) in the data tree
+typedef void (*KNN_JOIN_CALLBACK)(OBJ query, OBJ neighbors[], double distances[], int found, void* user_data);
+
+// Stores the parameters shared by all levels of a spatial join
+struct join_context
+{
+    enum join_predicate predicate;
+    double distance;
+    JOIN_CALLBACK callback;
+    void* user_data;
+};
+
+// N-dimensional variants of the R-Tree: 3D for indoor positioning (x, y, floor) and 4D for space-time event data. The 2D
+// instantiation is not used instead of the tree above, which the rest of this file builds on; --bench compares the two.
+// Further variants can be generated by including rtree_nd.h with another RTREE_ND_DIMS.
+#define RTREE_ND_DIMS 2
+#include "rtree_nd.h"
+#define RTREE_ND_DIMS 3
+#include "rtree_nd.h"
+#define RTREE_ND_DIMS 4
+#include "rtree_nd.h"
+
 // SDL variables
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
+
+// Whether in-memory traversals prefetch the children they are about to visit; --bench clears it for the baseline
+bool software_prefetch = true;
+
+// Whether inserts record the entries they change in dirty_list; only the viewer sets it, so it applies to single-threaded trees
+bool track_dirty_regions = false;
+struct dirty_list dirty_list;
 /*
 // Priority queue node for storing objects and their distances
 typedef struct {
@@ -89,29 +586,127 @@ typedef struct {
 NODE create_new_leaf_node();
 NODE create_new_internal_node();
 R_TREE create_new_r_tree();
+void free_r_tree(R_TREE r_tree);
 RECT create_new_rect(int min_x, int min_y, int max_x, int max_y);
 OBJ create_new_object(int x, int y, const char* type_name);
 void insert_object_into_node(NODE node, OBJ object, RECT rect);
 void insert_region_into_node(NODE parent_node, NODE child_node, RECT region);
+void insert_entry_into_node(NODE parent_node, NODE child_node, RECT region, int count);
 long long area_rect(RECT rect);
 long long increase_in_area(RECT rect1, RECT rect2);
-NODE choose_leaf(NODE node, OBJ object);
+int choose_subtree(NODE node, RECT obj_rect);
+NODE choose_leaf(NODE node, RECT obj_rect);
 RECT bounding_box(NODE node);
+int subtree_count(NODE node);
+int intern_type(const char* type_name);
+int num_interned_types(void);
+const char* interned_type_name(int type_id);
+void attach_histogram(NODE node);
+void update_histogram(NODE node);
+void enable_type_histograms(R_TREE r_tree);
+void disable_type_histograms(R_TREE r_tree);
 int * pick_seeds(NODE node, RECT rect);
 bool search_in_node(NODE node, RECT rect);
 int pick_next(NODE node1, NODE node2, NODE node, RECT rect);
-NODE * quadratic_split_leaf_node(NODE node, OBJ object);
+NODE * quadratic_split_leaf_node(NODE node, OBJ object, RECT obj_rect);
 void adjust_tree(R_TREE r_tree, NODE node1, NODE node2, NODE node);
+void record_dirty(RECT before, RECT after, int count);
 NODE * quadratic_split_internal_node(NODE node, RECT rect, NODE child);
 void insert_in_r_tree(R_TREE r_tree, OBJ object);
+void insert_rect_in_r_tree(R_TREE r_tree, OBJ object, RECT obj_rect);
+int load_objects_file(R_TREE r_tree, const char* path);
+R_TREE load_r_tree(const char* path);
+NODE find_leaf(NODE node, OBJ object, int* index);
+bool delete_from_r_tree(R_TREE r_tree, OBJ object);
+bool update_in_r_tree(R_TREE r_tree, OBJ object, int new_x, int new_y);
 void pre_order_traversal(NODE node, int depth);
 double euclidean_distance(int x1, int y1, int x2, int y2);
 bool rect_intersects(RECT rect1, RECT rect2);
-void search_in_r_tree(NODE node, RECT rect, int user_x, int user_y, double radius, OBJ found_objects[], int* num_found);
+bool rect_contains(RECT outer, RECT inner);
+void search_window(NODE node, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found);
+int count_in_rect(NODE node, RECT window);
+void count_types_in_rect(NODE node, RECT window, int counts[]);
+void search_in_r_tree(NODE node, RECT rect, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found);
 OBJ search_nearest_neighbor(NODE node, RECT rect, int user_x, int user_y, OBJ nearest_neighbor, double* min_distance);
 double euclidean_distance(int x1, int y1, int x2, int y2);
 int assign_internal_node_names(struct node *node, int region_counter);
 void find_k_nearest_neighbors(NODE root, int user_x, int user_y, int K, OBJ* neighbors);
+int run_benchmark(int num_objects, int num_queries);
+int run_selftest(int num_objects, int num_writers);
+int run_server(const char* address, const char* data_path);
+int run_loadgen(const char* address, double rate, double seconds, int connections, const char* mix_text, const char* summary_path);
+int render_r_tree_to_file(R_TREE r_tree, const char* path, int user_x, int user_y, double radius);
+int run_render_out(const char* image_path, const char* data_path, int user_x, int user_y, double radius);
+double min_distance_to_rect(RECT rect, int user_x, int user_y);
+NN_ITER nn_iter_open(R_TREE r_tree, int user_x, int user_y);
+OBJ nn_iter_next(NN_ITER iter, double* distance);
+void nn_iter_close(NN_ITER iter);
+double min_distance_between_rects(RECT rect1, RECT rect2);
+void r_tree_join(R_TREE a, R_TREE b, enum join_predicate predicate, double distance, JOIN_CALLBACK callback, void* user_data);
+void knn_join(R_TREE a, R_TREE b, int K, KNN_JOIN_CALLBACK callback, void* user_data);
+QR_TREE build_qr_tree(R_TREE r_tree);
+void free_qr_tree(QR_TREE qr_tree);
+long long qr_tree_memory(QR_TREE qr_tree);
+void qr_search_window(QR_TREE qr_tree, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found);
+int qr_find_k_nearest_neighbors(QR_TREE qr_tree, int user_x, int user_y, int K, OBJ neighbors[], double distances[]);
+FROZEN_R_TREE r_tree_freeze(R_TREE r_tree);
+void free_frozen_r_tree(FROZEN_R_TREE frozen);
+void frozen_search_window(FROZEN_R_TREE frozen, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found);
+void frozen_search_radius(FROZEN_R_TREE frozen, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found);
+int frozen_find_k_nearest_neighbors(FROZEN_R_TREE frozen, int user_x, int user_y, int K, OBJ neighbors[], double distances[]);
+bool save_frozen_r_tree(FROZEN_R_TREE frozen, const char* path);
+FROZEN_R_TREE load_frozen_r_tree(const char* path);
+QUERY_CACHE create_query_cache(R_TREE r_tree, int capacity, int quantum);
+void free_query_cache(QUERY_CACHE cache);
+int cached_search_window(QUERY_CACHE cache, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found);
+int cached_search_radius(QUERY_CACHE cache, int user_x, int user_y, double radius, OBJ found_objects[], int max_found);
+int cached_find_k_nearest_neighbors(QUERY_CACHE cache, int user_x, int user_y, int K, OBJ neighbors[]);
+void query_cache_invalidate(QUERY_CACHE cache, RECT rect);
+void cached_insert(QUERY_CACHE cache, OBJ object);
+void insert_batch_in_r_tree(R_TREE r_tree, OBJ objects[], RECT regions[], int count);
+bool save_snapshot(R_TREE r_tree, const char* path, unsigned long long lsn);
+R_TREE load_snapshot(const char* path, unsigned long long* lsn);
+R_TREE wal_recover(const char* snapshot_path, const char* wal_path, WAL* wal_out);
+unsigned long long wal_log_insert(WAL wal, OBJ object, RECT obj_rect);
+unsigned long long wal_log_delete(WAL wal, OBJ object);
+unsigned long long wal_log_update(WAL wal, OBJ object, int new_x, int new_y);
+bool wal_commit(WAL wal, unsigned long long lsn);
+bool wal_checkpoint(WAL wal, R_TREE r_tree, const char* snapshot_path);
+bool wal_close(WAL wal);
+VERSIONED_R_TREE create_versioned_r_tree(int retain);
+long long commit_batch(VERSIONED_R_TREE versioned, OBJ objects[], RECT regions[], int count);
+VERSION acquire_version(VERSIONED_R_TREE versioned, time_t at);
+void release_version(VERSION version);
+struct r_tree version_view(VERSION version);
+void cached_insert_rect(QUERY_CACHE cache, OBJ object, RECT obj_rect);
+DISK_R_TREE disk_r_tree_open(const char* path, size_t memory_budget);
+bool disk_r_tree_flush(DISK_R_TREE tree);
+bool disk_r_tree_close(DISK_R_TREE tree);
+bool disk_insert_in_r_tree(DISK_R_TREE tree, OBJ object);
+bool disk_insert_rect_in_r_tree(DISK_R_TREE tree, OBJ object, RECT obj_rect);
+bool disk_search_window(DISK_R_TREE tree, RECT window, enum window_predicate predicate, struct object found_objects[], int max_found, int* num_found);
+bool disk_search_radius(DISK_R_TREE tree, int user_x, int user_y, double radius, struct object found_objects[], int max_found, int* num_found);
+int disk_find_k_nearest_neighbors(DISK_R_TREE tree, int user_x, int user_y, int K, struct object neighbors[], double distances[]);
+bool cached_delete(QUERY_CACHE cache, OBJ object);
+bool cached_update(QUERY_CACHE cache, OBJ object, int new_x, int new_y);
+POLYGON create_polygon(const int xs[], const int ys[], int num_vertices);
+void free_polygon(POLYGON polygon);
+bool point_in_polygon(POLYGON polygon, int x, int y);
+void search_in_polygon(NODE node, POLYGON polygon, OBJ found_objects[], int max_found, int* num_found);
+CONCURRENT_R_TREE create_concurrent_r_tree(R_TREE r_tree);
+R_TREE release_concurrent_r_tree(CONCURRENT_R_TREE tree);
+void concurrent_insert(CONCURRENT_R_TREE tree, OBJ object);
+void concurrent_insert_rect(CONCURRENT_R_TREE tree, OBJ object, RECT obj_rect);
+void concurrent_search_window(CONCURRENT_R_TREE tree, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found);
+void concurrent_search_radius(CONCURRENT_R_TREE tree, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found);
+int concurrent_find_k_nearest_neighbors(CONCURRENT_R_TREE tree, int user_x, int user_y, int K, OBJ neighbors[], double distances[]);
+SHARDED_R_TREE create_sharded_r_tree(OBJ sample[], int sample_size, int num_shards);
+void sharded_insert(SHARDED_R_TREE sharded, OBJ object);
+void sharded_insert_rect(SHARDED_R_TREE sharded, OBJ object, RECT obj_rect);
+void sharded_flush(SHARDED_R_TREE sharded);
+void sharded_search_window(SHARDED_R_TREE sharded, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found);
+int sharded_find_k_nearest_neighbors(SHARDED_R_TREE sharded, int user_x, int user_y, int K, OBJ neighbors[], double distances[]);
+void close_sharded_r_tree(SHARDED_R_TREE sharded);
 
 //******************************************************************************************************************************************************************
 
@@ -128,11 +723,16 @@ NODE create_new_leaf_node()
     new_leaf -> is_leaf = true;
     new_leaf -> count = 0;
     new_leaf -> parent = NULL;
+    new_leaf -> ref_count = 1;
+    new_leaf -> epoch = 0;
+    new_leaf -> histogram = NULL;
+    new_leaf -> link = NULL;
     for(int i = 0; i < M; ++i)
     {
         (new_leaf -> regions)[i] = NULL;
         (new_leaf -> children)[i] = NULL;
         (new_leaf -> objects)[i]  = NULL;
+        (new_leaf -> counts)[i] = 0;
     }
     return new_leaf;
 }
@@ -144,11 +744,16 @@ NODE create_new_internal_node()
     new_internal -> is_leaf = false;
     new_internal -> count = 0;
     new_internal -> parent = NULL;
+    new_internal -> ref_count = 1;
+    new_internal -> epoch = 0;
+    new_internal -> histogram = NULL;
+    new_internal -> link = NULL;
     for(int i = 0; i < M; ++i)
     {
         (new_internal -> regions)[i] = NULL;
         (new_internal -> children)[i] = NULL;
         (new_internal -> objects)[i]  = NULL;
+        (new_internal -> counts)[i] = 0;
     }
     return new_internal;
 }
@@ -163,6 +768,27 @@ R_TREE create_new_r_tree()
     return new_r_tree;
 }
 
+// Frees the nodes of a subtree and their rectangles
+static void free_subtree(NODE node)
+{
+    for(int i = 0; i < node -> count; ++i)
+    {
+        if(!node -> is_leaf)
+            free_subtree((node -> children)[i]);
+        free((node -> regions)[i]);
+    }
+    free(node -> histogram);
+    free(node);
+}
+
+// Frees an R-Tree and its nodes; the objects stay with the caller
+void free_r_tree(R_TREE r_tree)
+{
+    free_subtree(r_tree -> root);
+    free(r_tree -> rect);
+    free(r_tree);
+}
+
 // Creates new bounding rectangle
 RECT create_new_rect(int min_x, int min_y, int max_x, int max_y )
 {
@@ -181,6 +807,7 @@ OBJ create_new_object(int x, int y, const char* type_name)
     new_object->x = x;
     new_object->y = y;
     strcpy(new_object->type, type_name); // Set the type name for the object
+    new_object->type_id = intern_type(type_name);
     return new_object;
 }
 
@@ -192,19 +819,38 @@ void insert_object_into_node(NODE node, OBJ object, RECT rect)
         ++i;
     (node -> objects)[i] = object;
     (node -> regions)[i] = rect;
+    (node -> counts)[i] = 1;
     node -> count += 1;
+    update_histogram(node);
 }
 
 // Inserts bounding rectangle and the regions contained in it as children in internal node
 void insert_region_into_node(NODE parent_node, NODE child_node, RECT region)
+{
+    insert_entry_into_node(parent_node, child_node, region, subtree_count(child_node));
+}
+
+// Inserts a child in internal node with an already known object count, e.g. when moving an entry between nodes
+void insert_entry_into_node(NODE parent_node, NODE child_node, RECT region, int count)
 {
     int i = 0;
     while((parent_node -> children)[i] != NULL)
         ++i;
     (parent_node -> regions)[i] = region;
     (parent_node -> children)[i] = child_node;
+    (parent_node -> counts)[i] = count;
     parent_node -> count += 1;
     child_node -> parent = parent_node;
+    update_histogram(parent_node);
+}
+
+// Calculates the number of objects stored below the node
+int subtree_count(NODE node)
+{
+    int total = 0;
+    for(int i = 0; i < node -> count; ++i)
+        total += (node -> counts)[i];
+    return total;
 }
 
 // Calculates the area of the bounding rectangle.
@@ -266,16 +912,10 @@ bool search_in_node(NODE node, RECT rect)
 //******************************************************************************************************************************************************************
 // Hepler functions for Insertions
 
-// Selects a leaf node to place a new entry i.e. object.
-NODE choose_leaf(NODE node, OBJ object)
+// Selects the subtree of an internal node which requires minimum enlargement to contain obj_rect.
+int choose_subtree(NODE node, RECT obj_rect)
 {
-    //CL2: If node  is leaf, return the node.
-    if(node -> is_leaf)
-        return node;
-
-    // CL3: If the node is not a leaf node, select the subtree which requires minimum enlargement.
     long long  min_enlargement = LLONG_MAX;
-    RECT obj_rect = create_new_rect(object -> x, object -> y, object -> x, object -> y);
     // Index stores which subtree will get choosen finally.
     int index = -1;
     // Iterating over all subtrees of a node
@@ -293,20 +933,34 @@ NODE choose_leaf(NODE node, OBJ object)
             index = area_rect((node -> regions)[index]) <= area_rect((node -> regions)[i]) ? index : i;
         }
     }
-    free(obj_rect);
+    return index;
+}
+
+// Selects a leaf node to place a new entry i.e. object with bounding rectangle obj_rect.
+NODE choose_leaf(NODE node, RECT obj_rect)
+{
+    //CL2: If node  is leaf, return the node.
+    if(node -> is_leaf)
+        return node;
+
+    // CL3: If the node is not a leaf node, select the subtree which requires minimum enlargement.
+    int index = choose_subtree(node, obj_rect);
 
     //CL4: Descend until a leaf node is choosen
-    return choose_leaf((node -> children)[index], object);
+    return choose_leaf((node -> children)[index], obj_rect);
 }
 
-// Splits the leaf node into two nodes
-NODE * quadratic_split_leaf_node(NODE node, OBJ object)
+// Splits the leaf node into two nodes while inserting object with bounding rectangle obj_rect
+NODE * quadratic_split_leaf_node(NODE node, OBJ object, RECT obj_rect)
 {
     // Creating the two leaf nodes after split
     NODE node1 = create_new_leaf_node();
     NODE node2 = create_new_leaf_node();
-
-    RECT obj_rect = create_new_rect(object -> x, object -> y, object -> x, object -> y);
+    if(node -> histogram != NULL)
+    {
+        attach_histogram(node1);
+        attach_histogram(node2);
+    }
 
     // QS1: Call pick_seed function to get first entries of splitted nodes and insert those enteries in the nodes
     int * pair = pick_seeds(node, obj_rect);
@@ -392,14 +1046,19 @@ NODE * quadratic_split_internal_node(NODE node, RECT rect, NODE child)
     // Creating the two internal nodes after split
     NODE node1 = create_new_internal_node();
     NODE node2 = create_new_internal_node();
+    if(node -> histogram != NULL)
+    {
+        attach_histogram(node1);
+        attach_histogram(node2);
+    }
 
     // QS1: Call pick_seed function to get first entries of splitted nodes and insert those enteries in the nodes
     int * pair = pick_seeds(node, rect);
-    insert_region_into_node(node1, (node -> children)[pair[0]], (node -> regions)[pair[0]]);
+    insert_entry_into_node(node1, (node -> children)[pair[0]], (node -> regions)[pair[0]], (node -> counts)[pair[0]]);
     if(pair[1] == M)
         insert_region_into_node(node2, child, rect);
     else
-        insert_region_into_node(node2, (node -> children)[pair[1]],(node -> regions)[pair[1]]);
+        insert_entry_into_node(node2, (node -> children)[pair[1]],(node -> regions)[pair[1]], (node -> counts)[pair[1]]);
 
     int index = -1;
 
@@ -460,7 +1119,7 @@ NODE * quadratic_split_internal_node(NODE node, RECT rect, NODE child)
 
         // Insert the entries into respective nodes.
         if(index != M)
-            insert_region_into_node(final_node, (node -> children)[index], (node -> regions)[index]);
+            insert_entry_into_node(final_node, (node -> children)[index], (node -> regions)[index], (node -> counts)[index]);
         else
             insert_region_into_node(final_node, child, rect);
 
@@ -471,6 +1130,26 @@ NODE * quadratic_split_internal_node(NODE node, RECT rect, NODE child)
     return splitted_nodes;
 }
 
+// Records a changed entry in dirty_list if track_dirty_regions is set; before is NULL for new entries and after for removed ones
+void record_dirty(RECT before, RECT after, int count)
+{
+    if(!track_dirty_regions)
+        return;
+    if(dirty_list.num_regions == DIRTY_MAX_REGIONS)
+    {
+        dirty_list.overflowed = true;
+        return;
+    }
+    struct dirty_region * region = &(dirty_list.regions)[dirty_list.num_regions++];
+    region -> has_before = before != NULL;
+    region -> has_after = after != NULL;
+    if(before != NULL)
+        region -> before = *before;
+    if(after != NULL)
+        region -> after = *after;
+    region -> count = count;
+}
+
 // Propagates changes made to leaf upwards in the tree by updating MBR and splits if required
 void adjust_tree(R_TREE r_tree, NODE node1, NODE node2, NODE node)
 {
@@ -489,14 +1168,19 @@ void adjust_tree(R_TREE r_tree, NODE node1, NODE node2, NODE node)
         {
             // Create a new root node
             NODE new_root = create_new_internal_node();
+            if(node1 -> histogram != NULL)
+                attach_histogram(new_root);
             // Insert the splitted root nodes as children of new root
             insert_region_into_node(new_root, node1, bounding_box(node1));
             insert_region_into_node(new_root, node2, bounding_box(node2));
+            record_dirty(NULL, (new_root -> regions)[0], (new_root -> counts)[0]);
+            record_dirty(NULL, (new_root -> regions)[1], (new_root -> counts)[1]);
 
             r_tree -> height  = r_tree -> height + 1;
             r_tree -> root = new_root;
             free(r_tree -> rect);
             r_tree -> rect = bounding_box(new_root);
+            free(node -> histogram);
             free(node);
         }
     else
@@ -513,9 +1197,13 @@ void adjust_tree(R_TREE r_tree, NODE node1, NODE node2, NODE node)
         // If  node does not require to be splitted
         if(node1 == NULL && node2 == NULL)
         {
-            free((parent -> regions)[i]);
-            //AT3: Adjust the bounding box of node in its parent
+            RECT old_region = (parent -> regions)[i];
+            //AT3: Adjust the bounding box and the object count of node in its parent
             (parent -> regions)[i] = bounding_box(node);
+            (parent -> counts)[i] = subtree_count(node);
+            record_dirty(old_region, (parent -> regions)[i], (parent -> counts)[i]);
+            free(old_region);
+            update_histogram(parent);
 
             //AT5: Propagate the change upwards
             adjust_tree(r_tree, NULL, NULL, parent);
@@ -525,9 +1213,16 @@ void adjust_tree(R_TREE r_tree, NODE node1, NODE node2, NODE node)
         {
             (parent -> children)[i] = node1;
             node1 -> parent = parent;
+            free(node -> histogram);
             free(node);
+            RECT node2_region = bounding_box(node2);
+            record_dirty((parent -> regions)[i], NULL, subtree_count(node1) + subtree_count(node2));
             free((parent -> regions)[i]);
             (parent -> regions)[i] = bounding_box(node1);
+            (parent -> counts)[i] = subtree_count(node1);
+            record_dirty(NULL, (parent -> regions)[i], (parent -> counts)[i]);
+            record_dirty(NULL, node2_region, subtree_count(node2));
+            free(node2_region);
 
             // If the parent need to be splitted
             if(parent -> count == M)
@@ -676,17 +1371,39 @@ int pick_next(NODE node1, NODE node2, NODE node, RECT rect)
 
 //******************************************************************************************************************************************************************
 
-// Inserts a new object in the R-Tree
+// Inserts a new point object in the R-Tree
 void insert_in_r_tree(R_TREE r_tree, OBJ object)
 {
+    insert_rect_in_r_tree(r_tree, object, create_new_rect(object -> x, object -> y, object -> x, object -> y));
+}
+
+// Inserts a new object covering obj_rect in the R-Tree; the rectangle is owned by the tree afterwards.
+// The extent is kept only in the leaf entry, so point objects cost no more than before.
+// A rectangle given with its corners reversed is normalised first.
+void insert_rect_in_r_tree(R_TREE r_tree, OBJ object, RECT obj_rect)
+{
+    if(obj_rect -> min_x > obj_rect -> max_x)
+    {
+        int swap = obj_rect -> min_x;
+        obj_rect -> min_x = obj_rect -> max_x;
+        obj_rect -> max_x = swap;
+    }
+    if(obj_rect -> min_y > obj_rect -> max_y)
+    {
+        int swap = obj_rect -> min_y;
+        obj_rect -> min_y = obj_rect -> max_y;
+        obj_rect -> max_y = swap;
+    }
+
     // I1: Call the choose_leaf function to get the leaf node where object needs to be placed
-    NODE node = choose_leaf(r_tree -> root, object);
+    NODE node = choose_leaf(r_tree -> root, obj_rect);
+    record_dirty(NULL, obj_rect, 1);
 
     // If leaf node is already full
     if(node -> count == M)
     {
         // I2.1: Call split node function to get the splitted nodes
-        NODE * nodes = quadratic_split_leaf_node(node,object);
+        NODE * nodes = quadratic_split_leaf_node(node, object, obj_rect);
 
         //I3: Propagate the change upwards in the tree.
         adjust_tree(r_tree, nodes[0],nodes[1],node);
@@ -696,110 +1413,617 @@ void insert_in_r_tree(R_TREE r_tree, OBJ object)
     else
     {
         // I2.2: Insert the object into the leaf node
-        insert_object_into_node(node, object, create_new_rect(object -> x, object -> y, object -> x, object -> y));
+        insert_object_into_node(node, object, obj_rect);
 
         //I3: Propagate the change upwards in the tree.
         adjust_tree(r_tree, NULL, NULL, node);
     }
 }
 
+// Inserts the objects of a data file in the R-Tree and returns how many were read, or -1 if the file cannot be opened.
+// Each line holds either a point "x y name" or a rectangle "min_x min_y max_x max_y name".
+int load_objects_file(R_TREE r_tree, const char* path)
+{
+    FILE *objects_file = fopen(path, "r");
+    if (objects_file == NULL)
+        return -1;
+    int x, y, max_x, max_y, loaded = 0;
+    char name[MAX_TYPE_LEN];
+    char line[256];
+    while (fgets(line, sizeof(line), objects_file) != NULL)
+    {
+        if (sscanf(line, "%d %d %d %d %49s", &x, &y, &max_x, &max_y, name) == 5)
+        {
+            // Reversed corners are normalised by insert_rect_in_r_tree; the centre is the same either way
+            OBJ object = create_new_object((int)(((long long)x + max_x) / 2), (int)(((long long)y + max_y) / 2), name);
+            insert_rect_in_r_tree(r_tree, object, create_new_rect(x, y, max_x, max_y));
+        }
+        else if (sscanf(line, "%d %d %49s", &x, &y, name) == 3)
+            insert_in_r_tree(r_tree, create_new_object(x, y, name));
+        else
+            continue;
+        ++loaded;
+    }
+    fclose(objects_file);
+    return loaded;
+}
+
+// Loads a tree from a snapshot, or else from a file of objects; returns NULL if path holds neither
+R_TREE load_r_tree(const char* path)
+{
+    unsigned long long lsn;
+    R_TREE r_tree = load_snapshot(path, &lsn);
+    if (r_tree != NULL)
+        return r_tree;
+    r_tree = create_new_r_tree();
+    if (load_objects_file(r_tree, path) < 0)
+        return NULL;
+    return r_tree;
+}
+
 //******************************************************************************************************************************************************************
 
 
 
 
 //******************************************************************************************************************************************************************
-void pre_order_traversal(NODE node, int depth)
-{
-    // If node is null, then return
-    if (node == NULL)
-        return;
-
-    for(int i =0; i < depth; ++i )
-        printf("  ");
+// Deletion
 
+// Stores the objects of eliminated nodes until they are reinserted
+struct orphan_list
+{
+    OBJ * objects;
+    RECT * regions;
+    int count;
+    int capacity;
+};
 
-    //  If the node is a leaf node
-    if (node -> is_leaf)
+// Removes entry index of a node, shifting the following entries down so that the used slots stay contiguous
+static void remove_entry_from_node(NODE node, int index)
+{
+    for(int i = index; i < node -> count - 1; ++i)
     {
-        printf("Leaf Node: ");
-        int i =0;
+        (node -> regions)[i] = (node -> regions)[i + 1];
+        (node -> children)[i] = (node -> children)[i + 1];
+        (node -> objects)[i] = (node -> objects)[i + 1];
+        (node -> counts)[i] = (node -> counts)[i + 1];
+    }
+    node -> count -= 1;
+    (node -> regions)[node -> count] = NULL;
+    (node -> children)[node -> count] = NULL;
+    (node -> objects)[node -> count] = NULL;
+    (node -> counts)[node -> count] = 0;
+    update_histogram(node);
+}
 
-        // Print the objects contained within the leaf node
-        while(i < M && (node -> regions)[i] != NULL)
+// Selects the leaf holding object, descending only into subtrees whose bounding box contains the object's (x, y)
+NODE find_leaf(NODE node, OBJ object, int* index)
+{
+    for(int i = 0; i < node -> count; ++i)
+    {
+        RECT region = (node -> regions)[i];
+        // FL2: If node is a leaf, check each entry for the object
+        if(node -> is_leaf)
         {
-            printf("[(%d, %d) - %s]", node -> objects[i] -> x, node -> objects[i] -> y , node -> objects[i] -> type);
-            if (i < node -> count - 1)
-                printf(", ");
-            ++i;
+            if((node -> objects)[i] == object)
+            {
+                *index = i;
+                return node;
+            }
+        }
+        // FL1: If node is internal, search every subtree that may contain the object
+        else if(region -> min_x <= object -> x && object -> x <= region -> max_x && region -> min_y <= object -> y && object -> y <= region -> max_y)
+        {
+            NODE leaf = find_leaf((node -> children)[i], object, index);
+            if(leaf != NULL)
+                return leaf;
         }
-        printf("\n");
     }
-    // If the node is internal node
-    else
-    {
-        printf("Internal Node (%s): ", node->name);
-        RECT rect = bounding_box(node);
+    return NULL;
+}
 
-        // Print the bounding box of the internal node
-        printf("[(%d, %d), (%d, %d)]", rect -> min_x, rect -> min_y, rect -> max_x, rect -> max_y);
-        printf("\n");
-        free(rect);
-        /*
-        //To print bounding boxes of the children uncomment this section
-        int i = 0;
-        while(i < M && (node -> regions)[i] != NULL)
+// Moves the objects of an eliminated subtree to the orphan list and frees its nodes
+static void collect_orphans(NODE node, struct orphan_list* orphans)
+{
+    for(int i = 0; i < node -> count; ++i)
+    {
+        if(node -> is_leaf)
         {
-            printf("[(%d, %d), (%d, %d)]", node->regions[i]->min_x, node->regions[i]->min_y, node->regions[i]->max_x, node->regions[i]->max_y);
-            if (i < node -> count - 1)
-                printf(", ");
-            ++i;
+            if(orphans -> count == orphans -> capacity)
+            {
+                orphans -> capacity = orphans -> capacity == 0 ? 4 * M : 2 * orphans -> capacity;
+                orphans -> objects = (OBJ *) realloc(orphans -> objects, sizeof(OBJ) * orphans -> capacity);
+                orphans -> regions = (RECT *) realloc(orphans -> regions, sizeof(RECT) * orphans -> capacity);
+            }
+            orphans -> objects[orphans -> count] = (node -> objects)[i];
+            orphans -> regions[orphans -> count] = (node -> regions)[i];
+            orphans -> count += 1;
         }
-        printf("\n");
-        */
-
-        // Recursive Call the function to print the subtree of the node one by one
-        int i = 0;
-        while(i < M && (node -> regions)[i] != NULL)
+        else
         {
-            pre_order_traversal(node -> children[i], depth + 1);
-            ++i;
+            collect_orphans((node -> children)[i], orphans);
+            free((node -> regions)[i]);
         }
-
     }
+    free(node -> histogram);
+    free(node);
 }
 
+// Propagates a deletion from the leaf upwards: under-full nodes are eliminated and their objects reinserted, other MBRs are tightened
+static void condense_tree(R_TREE r_tree, NODE node)
+{
+    struct orphan_list orphans = {NULL, NULL, 0, 0};
 
+    // CT2: Walk up until the root is reached
+    while(node != r_tree -> root)
+    {
+        NODE parent = node -> parent;
+        int i = 0;
+        while((parent -> children)[i] != node)
+            ++i;
 
+        free((parent -> regions)[i]);
+        // CT3: Eliminate an under-full node, keeping its objects for reinsertion
+        if(node -> count < m)
+        {
+            remove_entry_from_node(parent, i);
+            collect_orphans(node, &orphans);
+        }
+        // CT4: Otherwise adjust its bounding box and object count in the parent
+        else
+        {
+            (parent -> regions)[i] = bounding_box(node);
+            (parent -> counts)[i] = subtree_count(node);
+            update_histogram(parent);
+        }
+        node = parent;
+    }
 
-// Search for objects within a specified bounding rectangle
-void search_in_r_tree(NODE node, RECT rect, int user_x, int user_y, double radius, OBJ found_objects[], int* num_found) {
+    // D4: Shorten the tree while the root has a single child
+    while(!(r_tree -> root -> is_leaf) && r_tree -> root -> count == 1)
+    {
+        NODE old_root = r_tree -> root;
+        r_tree -> root = (old_root -> children)[0];
+        r_tree -> root -> parent = NULL;
+        r_tree -> height -= 1;
+        free((old_root -> regions)[0]);
+        free(old_root -> histogram);
+        free(old_root);
+    }
+    // Every child of the root was eliminated
+    if(!(r_tree -> root -> is_leaf) && r_tree -> root -> count == 0)
+    {
+        bool histograms = r_tree -> root -> histogram != NULL;
+        free(r_tree -> root -> histogram);
+        free(r_tree -> root);
+        r_tree -> root = create_new_leaf_node();
+        r_tree -> height = 0;
+        if(histograms)
+            attach_histogram(r_tree -> root);
+    }
+    free(r_tree -> rect);
+    r_tree -> rect = bounding_box(r_tree -> root);
+
+    // CT6: Reinsert the objects of eliminated nodes
+    for(int i = 0; i < orphans.count; ++i)
+        insert_rect_in_r_tree(r_tree, orphans.objects[i], orphans.regions[i]);
+    free(orphans.objects);
+    free(orphans.regions);
+}
+
+// Removes object from the R-Tree, returns false if it is not stored in it.
+// The object is located through its (x, y), which must lie inside its rectangle. The object itself is not freed.
+bool delete_from_r_tree(R_TREE r_tree, OBJ object)
+{
+    // D1: Find the leaf holding the object
+    int index;
+    NODE leaf = find_leaf(r_tree -> root, object, &index);
+    if(leaf == NULL)
+        return false;
+
+    // D2: Remove the entry from the leaf
+    free((leaf -> regions)[index]);
+    remove_entry_from_node(leaf, index);
+
+    // D3: Propagate the change upwards
+    condense_tree(r_tree, leaf);
+    return true;
+}
+
+// Moves a point object to (new_x, new_y), returns false if it is not stored in the R-Tree
+bool update_in_r_tree(R_TREE r_tree, OBJ object, int new_x, int new_y)
+{
+    if(!delete_from_r_tree(r_tree, object))
+        return false;
+    object -> x = new_x;
+    object -> y = new_y;
+    insert_in_r_tree(r_tree, object);
+    return true;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Type interning and histograms
+//
+// Object types are interned once into small integer ids so that grouping never compares type strings. A tree may keep a
+// histogram of the types below every node, letting grouped counts add up whole subtrees covered by a query window. A histogram
+// tracks the HISTOGRAM_TYPES most frequent types of its subtree and folds the rest into an "other" bucket; grouped counts
+// descend into subtrees whose histogram has overflowed.
+
+#define TYPE_CHUNK 256          // Type names per allocation
+
+// Stores the interned type names and a hash index over them. Names are kept in chunks that are never moved or freed, so a name
+// returned by interned_type_name stays valid while other threads intern new types.
+static char (** type_chunks)[MAX_TYPE_LEN] = NULL;
+static int num_types = 0;
+static int * type_index = NULL;  // Open addressing table of type ids, -1 for empty slots
+static int type_index_size = 0;
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Calculates the FNV-1a hash of a type name
+static unsigned int type_hash(const char* type_name)
+{
+    unsigned int hash = 2166136261u;
+    for(int i = 0; i < MAX_TYPE_LEN && type_name[i] != '\0'; ++i)
+        hash = (hash ^ (unsigned char)type_name[i]) * 16777619u;
+    return hash;
+}
+
+// Returns the storage of an interned type name; called with type_lock held
+static char* type_name_slot(int type_id)
+{
+    return type_chunks[type_id / TYPE_CHUNK][type_id % TYPE_CHUNK];
+}
+
+// Returns the id of a type name, assigning the next free id to a name seen for the first time
+int intern_type(const char* type_name)
+{
+    pthread_mutex_lock(&type_lock);
+    // Keep the table at most half full
+    if(2 * (num_types + 1) > type_index_size)
+    {
+        type_index_size = type_index_size == 0 ? 64 : 2 * type_index_size;
+        free(type_index);
+        type_index = (int *) malloc(sizeof(int) * type_index_size);
+        for(int i = 0; i < type_index_size; ++i)
+            type_index[i] = -1;
+        for(int id = 0; id < num_types; ++id)
+        {
+            unsigned int slot = type_hash(type_name_slot(id)) & (type_index_size - 1);
+            while(type_index[slot] != -1)
+                slot = (slot + 1) & (type_index_size - 1);
+            type_index[slot] = id;
+        }
+        type_chunks = realloc(type_chunks, sizeof(*type_chunks) * ((type_index_size / 2 + TYPE_CHUNK - 1) / TYPE_CHUNK));
+    }
+
+    unsigned int slot = type_hash(type_name) & (type_index_size - 1);
+    while(type_index[slot] != -1 && strncmp(type_name_slot(type_index[slot]), type_name, MAX_TYPE_LEN) != 0)
+        slot = (slot + 1) & (type_index_size - 1);
+    if(type_index[slot] == -1)
+    {
+        if(num_types % TYPE_CHUNK == 0)
+            type_chunks[num_types / TYPE_CHUNK] = malloc(sizeof(**type_chunks) * TYPE_CHUNK);
+        char* name = type_name_slot(num_types);
+        strncpy(name, type_name, MAX_TYPE_LEN - 1);
+        name[MAX_TYPE_LEN - 1] = '\0';
+        type_index[slot] = num_types++;
+    }
+    int id = type_index[slot];
+    pthread_mutex_unlock(&type_lock);
+    return id;
+}
+
+// Returns the number of types interned so far, i.e. one more than the largest type id
+int num_interned_types(void)
+{
+    pthread_mutex_lock(&type_lock);
+    int count = num_types;
+    pthread_mutex_unlock(&type_lock);
+    return count;
+}
+
+// Returns the name of an interned type, or NULL for an unknown id. The name is never moved or freed.
+const char* interned_type_name(int type_id)
+{
+    pthread_mutex_lock(&type_lock);
+    const char* name = type_id >= 0 && type_id < num_types ? type_name_slot(type_id) : NULL;
+    pthread_mutex_unlock(&type_lock);
+    return name;
+}
+
+// Adds count objects of a type to a list of (type, count) pairs
+static void add_type_count(int ids[], int counts[], int* num, int type_id, int count)
+{
+    for(int i = 0; i < *num; ++i)
+    {
+        if(ids[i] == type_id)
+        {
+            counts[i] += count;
+            return;
+        }
+    }
+    ids[*num] = type_id;
+    counts[*num] = count;
+    *num += 1;
+}
+
+// Recomputes the histogram of a node from its objects or from the histograms of its children
+void update_histogram(NODE node)
+{
+    struct type_histogram * histogram = node -> histogram;
+    if(histogram == NULL)
+        return;
+
+    int ids[M * HISTOGRAM_TYPES];
+    int counts[M * HISTOGRAM_TYPES];
+    int num = 0, other = 0;
+    for(int i = 0; i < node -> count; ++i)
+    {
+        if(node -> is_leaf)
+        {
+            add_type_count(ids, counts, &num, (node -> objects)[i] -> type_id, 1);
+            continue;
+        }
+        struct type_histogram * child = (node -> children)[i] -> histogram;
+        for(int t = 0; t < child -> num_types; ++t)
+            add_type_count(ids, counts, &num, child -> type_ids[t], child -> counts[t]);
+        other += child -> other;
+    }
+
+    // Keep the most frequent types, folding the rest into other
+    for(int i = 1; i < num; ++i)
+    {
+        int id = ids[i], count = counts[i], j = i;
+        for(; j > 0 && counts[j - 1] < count; --j)
+        {
+            ids[j] = ids[j - 1];
+            counts[j] = counts[j - 1];
+        }
+        ids[j] = id;
+        counts[j] = count;
+    }
+    histogram -> num_types = num < HISTOGRAM_TYPES ? num : HISTOGRAM_TYPES;
+    for(int i = 0; i < num; ++i)
+    {
+        if(i < HISTOGRAM_TYPES)
+        {
+            histogram -> type_ids[i] = ids[i];
+            histogram -> counts[i] = counts[i];
+        }
+        else
+            other += counts[i];
+    }
+    histogram -> other = other;
+}
+
+// Gives a node a histogram computed from its current entries; the children of an internal node must already have one
+void attach_histogram(NODE node)
+{
+    if(node -> histogram == NULL)
+        node -> histogram = (struct type_histogram *) calloc(1, sizeof(struct type_histogram));
+    update_histogram(node);
+}
+
+// Builds histograms bottom-up for a subtree
+static void attach_histograms(NODE node)
+{
+    if(!(node -> is_leaf))
+        for(int i = 0; i < node -> count; ++i)
+            attach_histograms((node -> children)[i]);
+    attach_histogram(node);
+}
+
+// Makes the tree keep a type histogram in every node from now on
+void enable_type_histograms(R_TREE r_tree)
+{
+    attach_histograms(r_tree -> root);
+}
+
+// Frees the histograms of a subtree
+static void detach_histograms(NODE node)
+{
+    if(!(node -> is_leaf))
+        for(int i = 0; i < node -> count; ++i)
+            detach_histograms((node -> children)[i]);
+    free(node -> histogram);
+    node -> histogram = NULL;
+}
+
+// Stops keeping type histograms in the tree and frees them
+void disable_type_histograms(R_TREE r_tree)
+{
+    detach_histograms(r_tree -> root);
+}
+
+// Adds to counts[type id] the number of objects of each type whose rectangles intersect the window. counts must hold
+// num_interned_types() entries. Subtrees inside the window are added from their histograms when these are exact.
+void count_types_in_rect(NODE node, RECT window, int counts[])
+{
+    if(node == NULL)
+        return;
+    for(int i = 0; i < node -> count; ++i)
+    {
+        RECT region = (node -> regions)[i];
+        if(!rect_intersects(region, window))
+            continue;
+        if(node -> is_leaf)
+        {
+            counts[(node -> objects)[i] -> type_id] += 1;
+            continue;
+        }
+        struct type_histogram * histogram = (node -> children)[i] -> histogram;
+        if(histogram != NULL && histogram -> other == 0 && rect_contains(window, region))
+        {
+            for(int t = 0; t < histogram -> num_types; ++t)
+                counts[histogram -> type_ids[t]] += histogram -> counts[t];
+        }
+        else
+            count_types_in_rect((node -> children)[i], window, counts);
+    }
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+void pre_order_traversal(NODE node, int depth)
+{
+    // If node is null, then return
+    if (node == NULL)
+        return;
+
+    for(int i =0; i < depth; ++i )
+        printf("  ");
+
+
+    //  If the node is a leaf node
+    if (node -> is_leaf)
+    {
+        printf("Leaf Node: ");
+        int i =0;
+
+        // Print the objects contained within the leaf node
+        while(i < M && (node -> regions)[i] != NULL)
+        {
+            RECT region = (node -> regions)[i];
+            if(region -> min_x == region -> max_x && region -> min_y == region -> max_y)
+                printf("[(%d, %d) - %s]", node -> objects[i] -> x, node -> objects[i] -> y , node -> objects[i] -> type);
+            else
+                printf("[(%d, %d), (%d, %d) - %s]", region -> min_x, region -> min_y, region -> max_x, region -> max_y, node -> objects[i] -> type);
+            if (i < node -> count - 1)
+                printf(", ");
+            ++i;
+        }
+        printf("\n");
+    }
+    // If the node is internal node
+    else
+    {
+        printf("Internal Node (%s): ", node->name);
+        RECT rect = bounding_box(node);
+
+        // Print the bounding box of the internal node
+        printf("[(%d, %d), (%d, %d)]", rect -> min_x, rect -> min_y, rect -> max_x, rect -> max_y);
+        printf("\n");
+        free(rect);
+        /*
+        //To print bounding boxes of the children uncomment this section
+        int i = 0;
+        while(i < M && (node -> regions)[i] != NULL)
+        {
+            printf("[(%d, %d), (%d, %d)]", node->regions[i]->min_x, node->regions[i]->min_y, node->regions[i]->max_x, node->regions[i]->max_y);
+            if (i < node -> count - 1)
+                printf(", ");
+            ++i;
+        }
+        printf("\n");
+        */
+
+        // Recursive Call the function to print the subtree of the node one by one
+        int i = 0;
+        while(i < M && (node -> regions)[i] != NULL)
+        {
+            pre_order_traversal(node -> children[i], depth + 1);
+            ++i;
+        }
+
+    }
+}
+
+
+
+
+// Prefetches the parts of a node read by traversals: its count, region pointers and children or objects
+static inline void prefetch_node(NODE node) {
+    if (!software_prefetch)
+        return;
+    PREFETCH(node);
+    PREFETCH((char *)node + 64);
+    PREFETCH((char *)(node->objects + M) - 1);
+}
+
+// Prefetches the rectangles of a node's entries; the node itself should already be cached or prefetched
+static inline void prefetch_regions(NODE node) {
+    if (!software_prefetch)
+        return;
+    for (int i = 0; i < node->count; ++i)
+        PREFETCH(node->regions[i]);
+}
+
+#define SEARCH_FRONTIER 256    // Nodes of a level kept on the stack by search_in_r_tree before it moves to the heap
+
+// Search for objects within a specified bounding rectangle, storing at most max_found of them.
+// The tree is searched one level at a time: the nodes of a level are all known before any of them is read, so their cache misses
+// (and those on their rectangles) are started together by prefetching instead of being taken one after another down each path.
+void search_in_r_tree(NODE node, RECT rect, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
     // If the node is null, return
     if (node == NULL)
         return;
 
-    // If the node is a leaf node
-    if (node->is_leaf) {
-        // Iterate through the objects in the leaf node
-        for (int i = 0; i < M && (node->objects)[i] != NULL; ++i) {
-            int obj_x = (node->objects)[i]->x;
-            int obj_y = (node->objects)[i]->y;
-            double distance = euclidean_distance(user_x, user_y, obj_x, obj_y);
-            // Check if the object is within the specified radius
-            if (distance <= radius) {
-                printf("Object at (%d, %d) is within the radius (%.2f) from the user.\n", obj_x, obj_y, radius);
-                found_objects[(*num_found)++] = (node->objects)[i]; // Add the found object to the array
+    // Levels of up to SEARCH_FRONTIER nodes, which covers most queries, need no allocation
+    NODE level_buffer[SEARCH_FRONTIER], next_buffer[SEARCH_FRONTIER];
+    NODE* level = level_buffer;
+    NODE* next_level = next_buffer;
+    int capacity = SEARCH_FRONTIER, num_level = 1;
+    bool on_heap = false;
+    level[0] = node;
+    while (num_level > 0 && *num_found < max_found) {
+        // The nodes of this level were prefetched when they were found, start fetching all of their rectangles
+        for (int n = 0; n < num_level; ++n)
+            prefetch_regions(level[n]);
+
+        int num_next = 0;
+        for (int n = 0; n < num_level && *num_found < max_found; ++n) {
+            NODE current = level[n];
+            // If the node is a leaf node
+            if (current->is_leaf) {
+                // Iterate through the objects in the leaf node
+                for (int i = 0; i < M && (current->objects)[i] != NULL && *num_found < max_found; ++i) {
+                    double distance = min_distance_to_rect((current->regions)[i], user_x, user_y);
+                    // Check if the object is within the specified radius
+                    if (distance <= radius)
+                        found_objects[(*num_found)++] = (current->objects)[i]; // Add the found object to the array
+                }
+                continue;
             }
-        }
-    } else {
-        // If the node is an internal node
-        // Check if the bounding rectangle of the node intersects with the specified rectangle
-        if (rect_intersects(rect, bounding_box(node))) {
-            // Recursively search the child nodes
-            for (int i = 0; i < M && (node->children)[i] != NULL; ++i) {
-                search_in_r_tree((node->children)[i], rect, user_x, user_y, radius, found_objects, num_found);
+            // If the node is an internal node, queue the children whose bounding rectangles intersect the specified rectangle
+            for (int i = 0; i < M && (current->children)[i] != NULL; ++i) {
+                if (!rect_intersects(rect, (current->regions)[i]))
+                    continue;
+                if (num_next == capacity) {
+                    capacity *= 2;
+                    if (on_heap) {
+                        level = (NODE *)realloc(level, sizeof(NODE) * capacity);
+                        next_level = (NODE *)realloc(next_level, sizeof(NODE) * capacity);
+                    } else {
+                        NODE* heap_level = (NODE *)malloc(sizeof(NODE) * capacity);
+                        NODE* heap_next = (NODE *)malloc(sizeof(NODE) * capacity);
+                        memcpy(heap_level, level, sizeof(NODE) * num_level);
+                        memcpy(heap_next, next_level, sizeof(NODE) * num_next);
+                        level = heap_level;
+                        next_level = heap_next;
+                        on_heap = true;
+                    }
+                }
+                next_level[num_next++] = (current->children)[i];
+                prefetch_node((current->children)[i]);
             }
         }
+        NODE* swap = level;
+        level = next_level;
+        next_level = swap;
+        num_level = num_next;
+    }
+    if (on_heap) {
+        free(level);
+        free(next_level);
     }
 }
 
@@ -813,9 +2037,7 @@ OBJ search_nearest_neighbor(NODE node, RECT rect, int user_x, int user_y, OBJ ne
     if (node->is_leaf) {
         // Iterate through the objects in the leaf node
         for (int i = 0; i < M && (node->objects)[i] != NULL; ++i) {
-            int obj_x = (node->objects)[i]->x;
-            int obj_y = (node->objects)[i]->y;
-            double distance = euclidean_distance(user_x, user_y, obj_x, obj_y);
+            double distance = min_distance_to_rect((node->regions)[i], user_x, user_y);
             // Check if the object is closer than the current nearest neighbor
             if (distance < *min_distance) {
                 *min_distance = distance;
@@ -824,12 +2046,29 @@ OBJ search_nearest_neighbor(NODE node, RECT rect, int user_x, int user_y, OBJ ne
         }
     } else {
         // If the node is an internal node
-        // Check if the bounding rectangle of the node intersects with the specified rectangle
-        if (rect_intersects(rect, bounding_box(node))) {
-            // Recursively search the child nodes
-            for (int i = 0; i < M && (node->children)[i] != NULL; ++i) {
-                nearest_neighbor = search_nearest_neighbor((node->children)[i], rect, user_x, user_y, nearest_neighbor, min_distance);
+        // Order the children intersecting the specified rectangle by MINDIST, prefetching them while their rectangles are read
+        NODE qualifying[M];
+        double distances[M];
+        int num_qualifying = 0;
+        for (int i = 0; i < M && (node->children)[i] != NULL; ++i)
+            prefetch_node((node->children)[i]);
+        for (int i = 0; i < M && (node->children)[i] != NULL; ++i) {
+            if (!rect_intersects(rect, (node->regions)[i]))
+                continue;
+            double distance = min_distance_to_rect((node->regions)[i], user_x, user_y);
+            int j = num_qualifying++;
+            for (; j > 0 && distances[j - 1] > distance; --j) {
+                qualifying[j] = qualifying[j - 1];
+                distances[j] = distances[j - 1];
             }
+            qualifying[j] = (node->children)[i];
+            distances[j] = distance;
+        }
+        // Recursively search the child nodes, skipping those which cannot hold a closer object
+        for (int i = 0; i < num_qualifying && distances[i] < *min_distance; ++i) {
+            if (i + 1 < num_qualifying)
+                prefetch_regions(qualifying[i + 1]);
+            nearest_neighbor = search_nearest_neighbor(qualifying[i], rect, user_x, user_y, nearest_neighbor, min_distance);
         }
     }
     return nearest_neighbor;
@@ -842,6 +2081,59 @@ bool rect_intersects(RECT rect1, RECT rect2) {
              rect2->min_y > rect1->max_y || rect2->max_y < rect1->min_y);
 }
 
+// Check if the outer rectangle completely contains the inner one
+bool rect_contains(RECT outer, RECT inner) {
+    return outer->min_x <= inner->min_x && inner->max_x <= outer->max_x &&
+           outer->min_y <= inner->min_y && inner->max_y <= outer->max_y;
+}
+
+// Checks whether an object's rectangle satisfies the window predicate
+static bool window_matches(RECT region, RECT window, enum window_predicate predicate) {
+    switch (predicate) {
+        case WINDOW_CONTAINS:
+            return rect_contains(region, window);
+        case WINDOW_WITHIN:
+            return rect_contains(window, region);
+        default:
+            return rect_intersects(region, window);
+    }
+}
+
+// Search for objects whose rectangles satisfy the predicate against the window, storing at most max_found of them
+void search_window(NODE node, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    if (node == NULL)
+        return;
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        RECT region = node->regions[i];
+        if (node->is_leaf) {
+            if (window_matches(region, window, predicate))
+                found_objects[(*num_found)++] = node->objects[i];
+        }
+        // A subtree can only hold objects containing the window if its MBR contains the window too
+        else if (predicate == WINDOW_CONTAINS ? rect_contains(region, window) : rect_intersects(region, window)) {
+            search_window(node->children[i], window, predicate, found_objects, max_found, num_found);
+        }
+    }
+}
+
+// Counts the objects whose rectangles intersect the window. Subtrees whose MBR lies inside the window are added up from
+// their stored counts without being visited.
+int count_in_rect(NODE node, RECT window) {
+    if (node == NULL)
+        return 0;
+    int total = 0;
+    for (int i = 0; i < node->count; ++i) {
+        RECT region = node->regions[i];
+        if (rect_contains(window, region))
+            total += node->counts[i];
+        else if (!node->is_leaf && rect_intersects(region, window))
+            total += count_in_rect(node->children[i], window);
+        else if (node->is_leaf && rect_intersects(region, window))
+            total += 1;
+    }
+    return total;
+}
+
 double euclidean_distance(int x1, int y1, int x2, int y2) {
     return sqrt(pow(x2 - x1, 2) + pow(y2 - y1, 2));
 }
@@ -892,311 +2184,5633 @@ bool init_sdl()
 }
 
 
-// Renders the R-Tree node
-// Renders the R-Tree node with minimum bounding rectangles around points
-void render_r_tree_node(NODE node, int x, int y, int width, int height) {
-    SDL_Rect rect = {x, y, width, height};
-    SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF);
-    SDL_RenderDrawRect(renderer, &rect);
-    if (!node->is_leaf) {
-        for (int i = 0; i < node->count; ++i) {
-            RECT region = node->regions[i];
-            render_r_tree_node(node->children[i], region->min_x - 5, region->min_y - 5, region->max_x - region->min_x + 10, region->max_y - region->min_y + 10);
+// Stores shapes gathered during a traversal so that each kind is submitted to SDL in one call per frame
+struct render_batch
+{
+    SDL_Rect* node_rects;
+    int num_node_rects;
+    int node_capacity;
+    SDL_Rect* object_rects;
+    int num_object_rects;
+    int object_capacity;
+    SDL_Point* points;
+    int num_points;
+    int point_capacity;
+    SDL_Rect* density_rects[LOD_SHADES]; // Subtrees too small to descend into, by shade
+    int num_density_rects[LOD_SHADES];
+    int density_capacity[LOD_SHADES];
+};
+
+// Kept between frames so that rendering does not allocate once the arrays have grown to the size of the tree
+static struct render_batch render_batch;
+
+static void batch_rect(SDL_Rect** rects, int* num_rects, int* capacity, SDL_Rect rect) {
+    if (*num_rects == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 1024;
+        *rects = (SDL_Rect *)realloc(*rects, sizeof(SDL_Rect) * *capacity);
+    }
+    (*rects)[(*num_rects)++] = rect;
+}
+
+static void batch_point(struct render_batch* batch, int x, int y) {
+    if (batch->num_points == batch->point_capacity) {
+        batch->point_capacity = batch->point_capacity > 0 ? batch->point_capacity * 2 : 1024;
+        batch->points = (SDL_Point *)realloc(batch->points, sizeof(SDL_Point) * batch->point_capacity);
+    }
+    batch->points[batch->num_points].x = x;
+    batch->points[batch->num_points].y = y;
+    batch->num_points += 1;
+}
+
+// Returns whether an outline of the given size at (x, y) shows in the viewport
+static bool rect_visible(const SDL_Rect* viewport, int x, int y, int width, int height) {
+    return x < viewport->x + viewport->w && x + width > viewport->x && y < viewport->y + viewport->h && y + height > viewport->y;
+}
+
+// Returns whether a subtree with an MBR of the given size in pixels is too small or thin to show its structure. Subtrees of at
+// most M objects are always drawn in full, as they hold too few objects to clutter the view.
+static bool lod_collapsed(int width, int height, int count) {
+    return count > M && ((long long)width * height < LOD_PIXELS || width < LOD_THIN || height < LOD_THIN);
+}
+
+// Returns the shade of a subtree, which doubles with each doubling of its objects per pixel
+static int density_shade(int count, int width, int height) {
+    double density = (double)count / ((double)width * height);
+    int shade = density < 1.0 ? 0 : 1 + (int)log2(density);
+    return shade < LOD_SHADES ? shade : LOD_SHADES - 1;
+}
+
+// Returns the green and blue level of a shade, from dark to full cyan
+static Uint8 density_level(int shade) {
+    return (Uint8)(0x40 + shade * (0xFF - 0x40) / (LOD_SHADES - 1));
+}
+
+// Gathers the outlines of a node and its visible descendants; subtrees whose outline misses the viewport are skipped, and
+// subtrees too small or thin to show their structure are gathered as a density rectangle instead of descended into, so that
+// the work of a frame depends on the pixels on screen rather than on the size of the tree
+static void batch_r_tree_node(struct render_batch* batch, const SDL_Rect* viewport, NODE node, int x, int y, int width, int height) {
+    SDL_Rect rect = {x, y, width, height};
+    batch_rect(&batch->node_rects, &batch->num_node_rects, &batch->node_capacity, rect);
+    if (!node->is_leaf) {
+        for (int i = 0; i < node->count; ++i) {
+            RECT region = node->regions[i];
+            int extent_width = region->max_x - region->min_x + 1, extent_height = region->max_y - region->min_y + 1;
+            if (lod_collapsed(extent_width, extent_height, node->counts[i])) {
+                SDL_Rect extentRect = {region->min_x, region->min_y, extent_width, extent_height};
+                int shade = density_shade(node->counts[i], extent_width, extent_height);
+                if (rect_visible(viewport, extentRect.x, extentRect.y, extentRect.w, extentRect.h))
+                    batch_rect(&batch->density_rects[shade], &batch->num_density_rects[shade], &batch->density_capacity[shade], extentRect);
+                continue;
+            }
+            int child_x = region->min_x - 5, child_y = region->min_y - 5;
+            int child_width = region->max_x - region->min_x + 10, child_height = region->max_y - region->min_y + 10;
+            if (rect_visible(viewport, child_x, child_y, child_width, child_height))
+                batch_r_tree_node(batch, viewport, node->children[i], child_x, child_y, child_width, child_height);
+        }
+    } else {
+        int rectSize = 5; // Size of bounding rectangle around points
+        for (int i = 0; i < node->count; ++i) {
+            OBJ object = node->objects[i];
+            RECT region = node->regions[i];
+            // Draw the extent of rectangle objects
+            if (region->min_x != region->max_x || region->min_y != region->max_y) {
+                SDL_Rect extentRect = {region->min_x, region->min_y, region->max_x - region->min_x + 1, region->max_y - region->min_y + 1};
+                if (rect_visible(viewport, extentRect.x, extentRect.y, extentRect.w, extentRect.h))
+                    batch_rect(&batch->object_rects, &batch->num_object_rects, &batch->object_capacity, extentRect);
+                continue;
+            }
+            // Draw bounding rectangle around point
+            SDL_Rect pointRect = {object->x - rectSize/2, object->y - rectSize/2, rectSize, rectSize};
+            if (rect_visible(viewport, pointRect.x, pointRect.y, pointRect.w, pointRect.h)) {
+                batch_rect(&batch->object_rects, &batch->num_object_rects, &batch->object_capacity, pointRect);
+                batch_point(batch, object->x, object->y);
+            }
+        }
+    }
+}
+
+// Renders the part of the R-Tree node inside viewport, without presenting
+static void render_r_tree_view(NODE node, int x, int y, int width, int height, const SDL_Rect* viewport) {
+    struct render_batch* batch = &render_batch;
+    batch->num_node_rects = batch->num_object_rects = batch->num_points = 0;
+    memset(batch->num_density_rects, 0, sizeof(batch->num_density_rects));
+    batch_r_tree_node(batch, viewport, node, x, y, width, height);
+
+    SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF);
+    SDL_RenderDrawRects(renderer, batch->node_rects, batch->num_node_rects);
+    SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0xFF, 0xFF);
+    SDL_RenderDrawRects(renderer, batch->object_rects, batch->num_object_rects);
+    SDL_RenderDrawPoints(renderer, batch->points, batch->num_points);
+    for (int shade = 0; shade < LOD_SHADES; ++shade) {
+        Uint8 level = density_level(shade);
+        SDL_SetRenderDrawColor(renderer, 0x00, level, level, 0xFF);
+        SDL_RenderFillRects(renderer, batch->density_rects[shade], batch->num_density_rects[shade]);
+    }
+}
+
+// Renders the R-Tree node
+// Renders the R-Tree node with minimum bounding rectangles around points, without presenting
+void render_r_tree_node(NODE node, int x, int y, int width, int height) {
+    SDL_Rect viewport = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    render_r_tree_view(node, x, y, width, height, &viewport);
+}
+
+// Screen areas to redraw for the changes in dirty_list, kept between frames like render_batch
+static SDL_Rect* dirty_rects;
+static int num_dirty_rects;
+static int dirty_capacity;
+
+// Adds the screen areas that batch_r_tree_node draws for an entry with the given rectangle: the whole area around small or
+// collapsed entries, and only the rows and columns of the outlines of larger ones, whose inside does not change with them
+static void add_dirty_rects(const struct rectangle* rect, int count) {
+    int width = rect->max_x - rect->min_x, height = rect->max_y - rect->min_y;
+    if (width + 10 <= DIRTY_SMALL || height + 10 <= DIRTY_SMALL || lod_collapsed(width + 1, height + 1, count)) {
+        SDL_Rect area = {rect->min_x - 5, rect->min_y - 5, width + 10, height + 10};
+        batch_rect(&dirty_rects, &num_dirty_rects, &dirty_capacity, area);
+        return;
+    }
+    // The outline of the subtree is drawn 5 pixels outside its MBR, and extents and density rectangles on the MBR itself
+    int rows[4] = {rect->min_y - 5, rect->min_y, rect->max_y, rect->max_y + 4};
+    int columns[4] = {rect->min_x - 5, rect->min_x, rect->max_x, rect->max_x + 4};
+    for (int i = 0; i < 4; ++i) {
+        SDL_Rect row = {rect->min_x - 5, rows[i], width + 10, 1};
+        SDL_Rect column = {columns[i], rect->min_y - 5, 1, height + 10};
+        batch_rect(&dirty_rects, &num_dirty_rects, &dirty_capacity, row);
+        batch_rect(&dirty_rects, &num_dirty_rects, &dirty_capacity, column);
+    }
+}
+
+// Turns dirty_list into screen areas in dirty_rects and empties it; returns false if everything must be redrawn
+static bool collect_dirty_rects(void) {
+    bool complete = !dirty_list.overflowed;
+    num_dirty_rects = 0;
+    for (int i = 0; complete && i < dirty_list.num_regions; ++i) {
+        struct dirty_region* region = &dirty_list.regions[i];
+        // Ancestors whose MBR did not change are recorded too, as their density shade may have
+        if (region->has_before && region->has_after && memcmp(&region->before, &region->after, sizeof(struct rectangle)) == 0 &&
+            !lod_collapsed(region->after.max_x - region->after.min_x + 1, region->after.max_y - region->after.min_y + 1, region->count))
+            continue;
+        if (region->has_before)
+            add_dirty_rects(&region->before, region->count);
+        if (region->has_after)
+            add_dirty_rects(&region->after, region->count);
+    }
+    dirty_list.num_regions = 0;
+    dirty_list.overflowed = false;
+    return complete;
+}
+
+// Target texture holding the rendered tree between frames, valid unless it was lost or not drawn yet
+static SDL_Texture* tree_texture = NULL;
+static bool tree_texture_valid = false;
+
+// Redraws the areas of the tree changed since the last call into tree_texture and copies it to the screen, without presenting.
+// Without render target support the whole tree is drawn to the screen instead.
+void render_r_tree_dirty(R_TREE r_tree) {
+    if (tree_texture == NULL)
+        tree_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+    bool partial = collect_dirty_rects() && tree_texture_valid;
+    if (tree_texture == NULL || SDL_SetRenderTarget(renderer, tree_texture) < 0) {
+        SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
+        SDL_RenderClear(renderer);
+        render_r_tree_node(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+        return;
+    }
+    if (partial) {
+        for (int i = 0; i < num_dirty_rects; ++i) {
+            SDL_Rect area = dirty_rects[i];
+            SDL_RenderSetClipRect(renderer, &area);
+            SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
+            SDL_RenderFillRect(renderer, &area);
+            render_r_tree_view(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, &area);
+        }
+        SDL_RenderSetClipRect(renderer, NULL);
+    } else {
+        SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
+        SDL_RenderClear(renderer);
+        render_r_tree_node(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+        tree_texture_valid = true;
+    }
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_RenderCopy(renderer, tree_texture, NULL, NULL);
+}
+
+// Renders yellow boxes around points within the specified radius
+void render_points_within_radius(int user_x , int user_y , OBJ found_objects[], int num_found, double radius) {
+    struct render_batch* batch = &render_batch;
+    batch->num_object_rects = batch->num_points = 0;
+    int rectSize = 10; // Size of the yellow box
+    batch_point(batch, user_x, user_y);
+    for (int i = 0; i < num_found; ++i) {
+        OBJ object = found_objects[i];
+        SDL_Rect rect = {object->x - rectSize/2, object->y - rectSize/2, rectSize, rectSize};
+        batch_rect(&batch->object_rects, &batch->num_object_rects, &batch->object_capacity, rect);
+        // The lines to the objects form one polyline that returns to the user after each object
+        batch_point(batch, object->x, object->y);
+        batch_point(batch, user_x, user_y);
+    }
+    SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF); // Yellow color
+    SDL_RenderDrawRects(renderer, batch->object_rects, batch->num_object_rects);
+    if (batch->num_points > 1)
+        SDL_RenderDrawLines(renderer, batch->points, batch->num_points);
+    SDL_RenderPresent(renderer);
+}
+
+
+// Renders the R-Tree
+void render_r_tree(R_TREE r_tree)
+{
+    SDL_RenderClear(renderer);
+    render_r_tree_node(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    SDL_RenderPresent(renderer);
+}
+
+//******************************************************************************************************************************************************************
+// Initialize the priority queue
+/*PriorityQueue* init_priority_queue(int capacity) {
+    PriorityQueue* pq = (PriorityQueue*)malloc(sizeof(PriorityQueue));
+    pq->heap = (PriorityNode*)malloc(capacity * sizeof(PriorityNode));
+    pq->size = 0;
+    pq->capacity = capacity;
+    return pq;
+}
+
+// Insert a node into the priority queue
+void insert_into_priority_queue(PriorityQueue* pq, OBJ object, double distance) {
+    // Check if the object is already in the priority queue
+    for (int i = 0; i < pq->size; ++i) {
+        if (pq->heap[i].object->x == object->x &&
+            pq->heap[i].object->y == object->y &&
+            strcmp(pq->heap[i].object->type, object->type) == 0) {
+            // If the object is already present, skip the insertion
+            return;
+        }
+    }
+
+    // If the object is not already present, insert it into the priority queue
+    if (pq->size == pq->capacity)
+        return; // Queue is full
+
+    // Create a new priority node
+    PriorityNode newNode;
+    newNode.object = object;
+    newNode.distance = distance;
+
+    // Add the node to the end of the queue
+    pq->heap[pq->size++] = newNode;
+
+    // Perform heapify up to maintain heap property
+    int i = pq->size - 1;
+    while (i > 0 && pq->heap[(i - 1) / 2].distance > pq->heap[i].distance) {
+        // Swap parent and child
+        PriorityNode temp = pq->heap[(i - 1) / 2];
+        pq->heap[(i - 1) / 2] = pq->heap[i];
+        pq->heap[i] = temp;
+        // Move up to parent
+        i = (i - 1) / 2;
+    }
+}
+
+
+// Extract the minimum node from the priority queue
+PriorityNode extract_min_from_priority_queue(PriorityQueue* pq) {
+    PriorityNode minNode = pq->heap[0];
+    // Replace the root with the last node
+    pq->heap[0] = pq->heap[pq->size - 1];
+    pq->size--;
+    // Perform heapify down to maintain heap property
+    int i = 0;
+    while (true) {
+        int leftChild = 2 * i + 1;
+        int rightChild = 2 * i + 2;
+        int smallest = i;
+        if (leftChild < pq->size && pq->heap[leftChild].distance < pq->heap[smallest].distance)
+            smallest = leftChild;
+        if (rightChild < pq->size && pq->heap[rightChild].distance < pq->heap[smallest].distance)
+            smallest = rightChild;
+        if (smallest != i) {
+            // Swap parent and smallest child
+            PriorityNode temp = pq->heap[i];
+            pq->heap[i] = pq->heap[smallest];
+            pq->heap[smallest] = temp;
+            i = smallest; // Update the index
+        } else {
+            break;
+        }
+    }
+    return minNode;
+}
+
+
+// Free the memory allocated for the priority queue
+void free_priority_queue(PriorityQueue* pq) {
+    free(pq->heap);
+    free(pq);
+}
+
+void search_k_nearest_neighbors(NODE node, RECT rect, int user_x, int user_y, PriorityQueue* pq) {
+    // If the node is null, return
+    if (node == NULL)
+        return;
+
+    // If the node is a leaf node
+    if (node->is_leaf) {
+        // Iterate through the objects in the leaf node
+        for (int i = 0; i < M && (node->objects)[i] != NULL; ++i) {
+            int obj_x = (node->objects)[i]->x;
+            int obj_y = (node->objects)[i]->y;
+            double distance = euclidean_distance(user_x, user_y, obj_x, obj_y);
+
+            // Check if the priority queue is not full or the distance is less than the maximum distance in the queue
+            if (pq->size < K_NEAREST_NEIGHBORS || distance < pq->heap[0].distance) {
+                // Check if the object is already in the priority queue
+                bool found = false;
+                for (int j = 0; j < pq->size; ++j) {
+                    if (pq->heap[j].object == (node->objects)[i]) {
+                        found = true;
+                        break;
+                    }
+                }
+                // If the object is not already present, insert it into the priority queue
+                if (!found) {
+                    insert_into_priority_queue(pq, (node->objects)[i], distance);
+                    // If the priority queue size exceeds K_NEAREST_NEIGHBORS, remove the farthest object
+                    if (pq->size > K_NEAREST_NEIGHBORS) {
+                        extract_min_from_priority_queue(pq);
+                    }
+                }
+            }
+        }
+    } else {
+        // If the node is an internal node
+        // Calculate the minimum distance between the user and the bounding box of the node
+        RECT node_rect = bounding_box(node);
+        double min_dist = INFINITY;
+        double max_dist = 0.0;
+        for (int i = 0; i < node->count; ++i) {
+            RECT child_rect = node->regions[i];
+            double dist_to_rect = euclidean_distance(user_x, user_y, (child_rect->min_x + child_rect->max_x) / 2, (child_rect->min_y + child_rect->max_y) / 2);
+            min_dist = fmin(min_dist, dist_to_rect);
+            max_dist = fmax(max_dist, dist_to_rect);
+        }
+
+        // If the minimum distance is greater than the maximum distance in the priority queue, we can prune this node
+        if (min_dist > pq->heap[0].distance) {
+            free(node_rect);
+            return;
+        }
+
+        // If the maximum distance is less than or equal to the minimum distance in the priority queue, we can insert all objects in this node
+        if (max_dist <= pq->heap[0].distance) {
+            for (int i = 0; i < node->count; ++i) {
+                NODE child_node = node->children[i];
+                if (child_node->is_leaf) {
+                    for (int j = 0; j < child_node->count; ++j) {
+                        OBJ obj = child_node->objects[j];
+                        double dist = euclidean_distance(user_x, user_y, obj->x, obj->y);
+                        insert_into_priority_queue(pq, obj, dist);
+                        if (pq->size > K_NEAREST_NEIGHBORS) {
+                            extract_min_from_priority_queue(pq);
+                        }
+                    }
+                }
+            }
+            free(node_rect);
+            return;
+        }
+
+        // Otherwise, recursively search the child nodes
+        if (rect_intersects(rect, node_rect)) {
+            for (int i = 0; i < M && (node->children)[i] != NULL; ++i) {
+                search_k_nearest_neighbors((node->children)[i], (node->regions)[i], user_x, user_y, pq);
+            }
+        }
+        free(node_rect);
+    }
+}*/
+//********************************************************************************************************************************************************
+
+OBJ find_nearest_neighbor(NODE root, int user_x, int user_y) {
+    OBJ nearest_neighbor = NULL;
+    double min_distance = INFINITY;
+
+    // Traverse the R-Tree and find the nearest neighbor
+    nearest_neighbor = search_nearest_neighbor(root, bounding_box(root), user_x, user_y, nearest_neighbor, &min_distance);
+
+    return nearest_neighbor;
+
+}
+
+//******************************************************************************************************************************************************************
+// Incremental nearest neighbour search (distance browsing)
+
+// Calculates MINDIST i.e. the smallest distance from the user to any point of the rectangle
+double min_distance_to_rect(RECT rect, int user_x, int user_y) {
+    double dx = 0.0, dy = 0.0;
+    if (user_x < rect->min_x)
+        dx = (double)rect->min_x - user_x;
+    else if (user_x > rect->max_x)
+        dx = (double)user_x - rect->max_x;
+    if (user_y < rect->min_y)
+        dy = (double)rect->min_y - user_y;
+    else if (user_y > rect->max_y)
+        dy = (double)user_y - rect->max_y;
+    return sqrt(dx * dx + dy * dy);
+}
+
+// Orders heap entries by distance; at equal distance objects come before nodes so they are reported without further expansion
+static bool nn_entry_less(struct nn_entry* a, struct nn_entry* b) {
+    if (a->distance != b->distance)
+        return a->distance < b->distance;
+    return a->node == NULL && b->node != NULL;
+}
+
+// Pushes a node or an object into the iterator's min-heap
+static void nn_heap_push(NN_ITER iter, NODE node, OBJ object, double distance) {
+    if (iter->size == iter->capacity) {
+        iter->capacity *= 2;
+        iter->heap = (struct nn_entry *)realloc(iter->heap, sizeof(struct nn_entry) * iter->capacity);
+    }
+    int i = iter->size++;
+    iter->heap[i].distance = distance;
+    iter->heap[i].node = node;
+    iter->heap[i].object = object;
+
+    // Heapify up
+    while (i > 0 && nn_entry_less(&iter->heap[i], &iter->heap[(i - 1) / 2])) {
+        struct nn_entry temp = iter->heap[(i - 1) / 2];
+        iter->heap[(i - 1) / 2] = iter->heap[i];
+        iter->heap[i] = temp;
+        i = (i - 1) / 2;
+    }
+}
+
+// Removes the closest entry from the iterator's min-heap
+static struct nn_entry nn_heap_pop(NN_ITER iter) {
+    struct nn_entry top = iter->heap[0];
+    iter->heap[0] = iter->heap[--iter->size];
+
+    // Heapify down
+    int i = 0;
+    while (true) {
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        int smallest = i;
+        if (left < iter->size && nn_entry_less(&iter->heap[left], &iter->heap[smallest]))
+            smallest = left;
+        if (right < iter->size && nn_entry_less(&iter->heap[right], &iter->heap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        struct nn_entry temp = iter->heap[i];
+        iter->heap[i] = iter->heap[smallest];
+        iter->heap[smallest] = temp;
+        i = smallest;
+    }
+    return top;
+}
+
+// Starts a nearest neighbour search around the user; neighbours are produced lazily by nn_iter_next
+NN_ITER nn_iter_open(R_TREE r_tree, int user_x, int user_y) {
+    NN_ITER iter = (NN_ITER)malloc(sizeof(struct nn_iterator));
+    iter->user_x = user_x;
+    iter->user_y = user_y;
+    iter->size = 0;
+    iter->capacity = 4 * M;
+    iter->heap = (struct nn_entry *)malloc(sizeof(struct nn_entry) * iter->capacity);
+    if (r_tree->root != NULL && r_tree->root->count > 0)
+        nn_heap_push(iter, r_tree->root, NULL, 0.0);
+    return iter;
+}
+
+// Returns the next closest object (and its distance if requested), or NULL once the tree is exhausted
+OBJ nn_iter_next(NN_ITER iter, double* distance) {
+    while (iter->size > 0) {
+        struct nn_entry entry = nn_heap_pop(iter);
+
+        // An object at the head of the queue is closer than everything not yet expanded
+        if (entry.node == NULL) {
+            if (distance != NULL)
+                *distance = entry.distance;
+            return entry.object;
+        }
+
+        // Expand the node by queueing its objects or children with their distances, prefetching the children since the
+        // closest of them are expanded next
+        NODE node = entry.node;
+        for (int i = 0; i < node->count; ++i) {
+            double d = min_distance_to_rect(node->regions[i], iter->user_x, iter->user_y);
+            if (node->is_leaf) {
+                nn_heap_push(iter, NULL, node->objects[i], d);
+            } else {
+                prefetch_node(node->children[i]);
+                nn_heap_push(iter, node->children[i], NULL, d);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Frees the state of a nearest neighbour search
+void nn_iter_close(NN_ITER iter) {
+    if (iter == NULL)
+        return;
+    free(iter->heap);
+    free(iter);
+}
+
+// Finds the K nearest neighbors of the user; slots beyond the number of objects in the tree are set to NULL
+void find_k_nearest_neighbors(NODE root, int user_x, int user_y, int K, OBJ* neighbors) {
+    struct r_tree view = {0, NULL, root};
+    NN_ITER iter = nn_iter_open(&view, user_x, user_y);
+    for (int i = 0; i < K; ++i)
+        neighbors[i] = nn_iter_next(iter, NULL);
+    nn_iter_close(iter);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Spatial join of two R-Trees
+
+// Calculates the smallest distance between any two points of the rectangles
+double min_distance_between_rects(RECT rect1, RECT rect2) {
+    double dx = 0.0, dy = 0.0;
+    if (rect2->max_x < rect1->min_x)
+        dx = (double)rect1->min_x - rect2->max_x;
+    else if (rect1->max_x < rect2->min_x)
+        dx = (double)rect2->min_x - rect1->max_x;
+    if (rect2->max_y < rect1->min_y)
+        dy = (double)rect1->min_y - rect2->max_y;
+    else if (rect1->max_y < rect2->min_y)
+        dy = (double)rect2->min_y - rect1->max_y;
+    return sqrt(dx * dx + dy * dy);
+}
+
+// Checks whether two rectangles satisfy the join predicate
+static bool join_qualifies(RECT rect1, RECT rect2, struct join_context* ctx) {
+    if (ctx->predicate == JOIN_INTERSECTS)
+        return rect_intersects(rect1, rect2);
+    return min_distance_between_rects(rect1, rect2) <= ctx->distance;
+}
+
+static void join_nodes(NODE node_a, RECT rect_a, NODE node_b, RECT rect_b, struct join_context* ctx);
+
+// Collects the entries of a node that can pair with the other node's MBR, sorted by min_x for the plane sweep
+static int join_sweep_order(NODE node, RECT other, struct join_context* ctx, int order[]) {
+    int count = 0;
+    for (int i = 0; i < node->count; ++i) {
+        if (!join_qualifies(node->regions[i], other, ctx))
+            continue;
+        // Insertion sort, the node holds at most M entries
+        int j = count++;
+        while (j > 0 && node->regions[order[j - 1]]->min_x > node->regions[i]->min_x) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+    return count;
+}
+
+// Reports or descends into a pair of entries that passed the sweep
+static void join_entry_pair(NODE node_a, int i, NODE node_b, int j, struct join_context* ctx) {
+    if (!join_qualifies(node_a->regions[i], node_b->regions[j], ctx))
+        return;
+    if (node_a->is_leaf)
+        ctx->callback(node_a->objects[i], node_b->objects[j], ctx->user_data);
+    else
+        join_nodes(node_a->children[i], node_a->regions[i], node_b->children[j], node_b->regions[j], ctx);
+}
+
+// Plane sweep over the entries of two nodes at the same level; only pairs overlapping along x (widened by the distance) are tested
+static void join_plane_sweep(NODE node_a, RECT rect_a, NODE node_b, RECT rect_b, struct join_context* ctx) {
+    int order_a[M], order_b[M];
+    int count_a = join_sweep_order(node_a, rect_b, ctx, order_a);
+    int count_b = join_sweep_order(node_b, rect_a, ctx, order_b);
+    double reach = ctx->predicate == JOIN_WITHIN_DISTANCE ? ctx->distance : 0.0;
+
+    int i = 0, j = 0;
+    while (i < count_a && j < count_b) {
+        RECT region_a = node_a->regions[order_a[i]];
+        RECT region_b = node_b->regions[order_b[j]];
+        if (region_a->min_x <= region_b->min_x) {
+            // Pair the entry of A with every entry of B that starts before it ends
+            for (int k = j; k < count_b && node_b->regions[order_b[k]]->min_x <= region_a->max_x + reach; ++k)
+                join_entry_pair(node_a, order_a[i], node_b, order_b[k], ctx);
+            ++i;
+        } else {
+            // Pair the entry of B with every entry of A that starts before it ends
+            for (int k = i; k < count_a && node_a->regions[order_a[k]]->min_x <= region_b->max_x + reach; ++k)
+                join_entry_pair(node_a, order_a[k], node_b, order_b[j], ctx);
+            ++j;
+        }
+    }
+}
+
+// Synchronized depth-first traversal of a pair of nodes whose MBRs satisfy the predicate
+static void join_nodes(NODE node_a, RECT rect_a, NODE node_b, RECT rect_b, struct join_context* ctx) {
+    // Both nodes at the same level
+    if (node_a->is_leaf == node_b->is_leaf) {
+        join_plane_sweep(node_a, rect_a, node_b, rect_b, ctx);
+        return;
+    }
+
+    // Trees of different heights: descend on the internal side only
+    if (node_a->is_leaf) {
+        for (int j = 0; j < node_b->count; ++j)
+            if (join_qualifies(rect_a, node_b->regions[j], ctx))
+                join_nodes(node_a, rect_a, node_b->children[j], node_b->regions[j], ctx);
+    } else {
+        for (int i = 0; i < node_a->count; ++i)
+            if (join_qualifies(node_a->regions[i], rect_b, ctx))
+                join_nodes(node_a->children[i], node_a->regions[i], node_b, rect_b, ctx);
+    }
+}
+
+// Reports every pair (object of a, object of b) satisfying the predicate; distance is only used by JOIN_WITHIN_DISTANCE
+void r_tree_join(R_TREE a, R_TREE b, enum join_predicate predicate, double distance, JOIN_CALLBACK callback, void* user_data) {
+    if (a->root == NULL || b->root == NULL || a->root->count == 0 || b->root->count == 0)
+        return;
+    struct join_context ctx = {predicate, distance, callback, user_data};
+    RECT rect_a = bounding_box(a->root);
+    RECT rect_b = bounding_box(b->root);
+    if (join_qualifies(rect_a, rect_b, &ctx))
+        join_nodes(a->root, rect_a, b->root, rect_b, &ctx);
+    free(rect_a);
+    free(rect_b);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// All-kNN join: K nearest objects of tree B for every object of tree A
+
+// Stores the K best candidates of every query point of one leaf of A
+struct knn_group
+{
+    int K;
+    int size;                    // Number of query points in the group
+    OBJ queries[M];              // Query objects i.e. the objects of the leaf of A
+    RECT query_regions[M];       // Rectangles of the query objects
+    int found[M];                // Number of candidates collected for each query
+    OBJ * neighbors;             // size x K candidates, sorted by distance for each query
+    double * distances;          // size x K candidate distances
+};
+
+// Returns the distance a candidate must beat to enter the result of query q
+static double knn_group_bound(struct knn_group* group, int q) {
+    if (group->found[q] < group->K)
+        return INFINITY;
+    return group->distances[q * group->K + group->K - 1];
+}
+
+// Offers an object of B to query q, keeping its K closest candidates sorted
+static void knn_group_offer(struct knn_group* group, int q, OBJ object, double distance) {
+    OBJ * neighbors = group->neighbors + q * group->K;
+    double * distances = group->distances + q * group->K;
+    int i = group->found[q] < group->K ? group->found[q]++ : group->K - 1;
+    while (i > 0 && distances[i - 1] > distance) {
+        neighbors[i] = neighbors[i - 1];
+        distances[i] = distances[i - 1];
+        --i;
+    }
+    neighbors[i] = object;
+    distances[i] = distance;
+}
+
+// Searches B once for all queries of the group; a node is skipped once it is further from the group MBR than every query's Kth candidate
+static void knn_join_group(struct knn_group* group, RECT group_rect, NODE root_b) {
+    struct nn_iterator queue;
+    queue.size = 0;
+    queue.capacity = 4 * M;
+    queue.heap = (struct nn_entry *)malloc(sizeof(struct nn_entry) * queue.capacity);
+    nn_heap_push(&queue, root_b, NULL, 0.0);
+
+    while (queue.size > 0) {
+        // Group-level pruning bound: the worst Kth distance among the queries
+        double bound = 0.0;
+        for (int q = 0; q < group->size; ++q)
+            bound = fmax(bound, knn_group_bound(group, q));
+
+        struct nn_entry entry = nn_heap_pop(&queue);
+        // Nodes come out in MINDIST order, so nothing left can improve any query
+        if (entry.distance > bound)
+            break;
+
+        NODE node = entry.node;
+        for (int i = 0; i < node->count; ++i) {
+            if (node->is_leaf) {
+                for (int q = 0; q < group->size; ++q) {
+                    double d = min_distance_between_rects(group->query_regions[q], node->regions[i]);
+                    if (d < knn_group_bound(group, q))
+                        knn_group_offer(group, q, node->objects[i], d);
+                }
+            } else {
+                double d = min_distance_between_rects(group_rect, node->regions[i]);
+                if (d <= bound)
+                    nn_heap_push(&queue, node->children[i], NULL, d);
+            }
+        }
+    }
+    free(queue.heap);
+}
+
+// Visits the leaves of A, each leaf forming one group of query points
+static void knn_join_leaves(NODE node_a, RECT rect_a, NODE root_b, struct knn_group* group, KNN_JOIN_CALLBACK callback, void* user_data) {
+    if (!node_a->is_leaf) {
+        for (int i = 0; i < node_a->count; ++i)
+            knn_join_leaves(node_a->children[i], node_a->regions[i], root_b, group, callback, user_data);
+        return;
+    }
+
+    group->size = node_a->count;
+    for (int q = 0; q < group->size; ++q) {
+        group->queries[q] = node_a->objects[q];
+        group->query_regions[q] = node_a->regions[q];
+        group->found[q] = 0;
+    }
+    knn_join_group(group, rect_a, root_b);
+
+    for (int q = 0; q < group->size; ++q)
+        callback(group->queries[q], group->neighbors + q * group->K, group->distances + q * group->K, group->found[q], user_data);
+}
+
+// Finds the K nearest objects of B for every object of A, sharing one traversal of B between all objects of a leaf of A
+void knn_join(R_TREE a, R_TREE b, int K, KNN_JOIN_CALLBACK callback, void* user_data) {
+    if (K <= 0 || a->root == NULL || a->root->count == 0 || b->root == NULL || b->root->count == 0)
+        return;
+    struct knn_group group;
+    group.K = K;
+    group.neighbors = (OBJ *)malloc(sizeof(OBJ) * M * K);
+    group.distances = (double *)malloc(sizeof(double) * M * K);
+
+    RECT rect_a = bounding_box(a->root);
+    knn_join_leaves(a->root, rect_a, b->root, &group, callback, user_data);
+    free(rect_a);
+
+    free(group.neighbors);
+    free(group.distances);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Compact read-only tree with quantised relative MBRs (QR-tree)
+//
+// Each internal entry stores its child's MBR in QR_BITS-bit coordinates relative to the MBR of the node holding it. Coordinates are
+// rounded outward so the decoded rectangle always contains the exact one, which keeps every query conservative. A child is quantised
+// against the decoded (not the exact) MBR of its parent, so the decoder reproduces exactly the frames used by the encoder.
+// Leaves keep exact coordinates, delta and varint encoded, so results are exact as well.
+
+// Quantises the low end of an interval, rounding down
+static QCOORD qr_quantise_low(int value, int frame_min, int frame_max) {
+    long long width = (long long)frame_max - frame_min;
+    if (width == 0)
+        return 0;
+    return (QCOORD)(((long long)value - frame_min) * QR_LEVELS / width);
+}
+
+// Quantises the high end of an interval, rounding up
+static QCOORD qr_quantise_high(int value, int frame_min, int frame_max) {
+    long long width = (long long)frame_max - frame_min;
+    if (width == 0)
+        return 0;
+    return (QCOORD)((((long long)value - frame_min) * QR_LEVELS + width - 1) / width);
+}
+
+// Decodes a quantised rectangle within the frame of its parent
+static struct rectangle qr_decode(const struct qr_rect* q, const struct rectangle* frame) {
+    long long width = (long long)frame->max_x - frame->min_x;
+    long long height = (long long)frame->max_y - frame->min_y;
+    struct rectangle rect;
+    rect.min_x = (int)(frame->min_x + q->min_x * width / QR_LEVELS);
+    rect.min_y = (int)(frame->min_y + q->min_y * height / QR_LEVELS);
+    rect.max_x = (int)(frame->min_x + (q->max_x * width + QR_LEVELS - 1) / QR_LEVELS);
+    rect.max_y = (int)(frame->min_y + (q->max_y * height + QR_LEVELS - 1) / QR_LEVELS);
+    return rect;
+}
+
+// Quantises rect within frame, rounding outward
+static struct qr_rect qr_encode(RECT rect, const struct rectangle* frame) {
+    struct qr_rect q;
+    q.min_x = qr_quantise_low(rect->min_x, frame->min_x, frame->max_x);
+    q.min_y = qr_quantise_low(rect->min_y, frame->min_y, frame->max_y);
+    q.max_x = qr_quantise_high(rect->max_x, frame->min_x, frame->max_x);
+    q.max_y = qr_quantise_high(rect->max_y, frame->min_y, frame->max_y);
+    return q;
+}
+
+// Appends value as a LEB128 varint, returns the number of bytes written
+static int varint_encode(unsigned int value, unsigned char* out) {
+    int bytes = 0;
+    while (value >= 0x80) {
+        out[bytes++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[bytes++] = (unsigned char)value;
+    return bytes;
+}
+
+// Reads a LEB128 varint and advances the cursor
+static unsigned int varint_decode(const unsigned char** cursor) {
+    const unsigned char* p = *cursor;
+    unsigned int value = *p & 0x7F;
+    int shift = 7;
+    while (*p++ & 0x80) {
+        value |= (unsigned int)(*p & 0x7F) << shift;
+        shift += 7;
+    }
+    *cursor = p;
+    return value;
+}
+
+// Returns the encoded bytes of a compact leaf
+static inline const unsigned char* qr_leaf_data(const struct qr_leaf* leaf) {
+    return (const unsigned char *)(leaf->objects + leaf->count);
+}
+
+// Packs a leaf of the pointer-based tree: entries sorted by min_x, rectangles delta encoded against the leaf MBR corner
+static struct qr_leaf* qr_pack_leaf(NODE node) {
+    int order[M];
+    int min_x = INT_MAX, min_y = INT_MAX;
+    for (int i = 0; i < node->count; ++i) {
+        min_x = node->regions[i]->min_x < min_x ? node->regions[i]->min_x : min_x;
+        min_y = node->regions[i]->min_y < min_y ? node->regions[i]->min_y : min_y;
+        int j = i;
+        while (j > 0 && node->regions[order[j - 1]]->min_x > node->regions[i]->min_x) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    // Each of the 4 values of an entry takes at most 5 bytes
+    unsigned char data[M * 4 * 5];
+    int size = 0;
+    bool short_values = true;
+    int previous_x = min_x;
+    for (int k = 0; k < node->count; ++k) {
+        RECT region = node->regions[order[k]];
+        unsigned int values[4] = {
+            (unsigned int)((long long)region->min_x - previous_x),
+            (unsigned int)((long long)region->min_y - min_y),
+            (unsigned int)((long long)region->max_x - region->min_x),
+            (unsigned int)((long long)region->max_y - region->min_y)
+        };
+        for (int v = 0; v < 4; ++v) {
+            short_values = short_values && values[v] < 0x80;
+            size += varint_encode(values[v], data + size);
+        }
+        previous_x = region->min_x;
+    }
+
+    struct qr_leaf* leaf = (struct qr_leaf *)malloc(sizeof(struct qr_leaf) + sizeof(OBJ) * node->count + size);
+    leaf->count = (unsigned char)node->count;
+    leaf->short_values = short_values;
+    leaf->size = (unsigned short)size;
+    leaf->min_x = min_x;
+    leaf->min_y = min_y;
+    for (int k = 0; k < node->count; ++k)
+        leaf->objects[k] = node->objects[order[k]];
+    memcpy((unsigned char *)(leaf->objects + leaf->count), data, size);
+    return leaf;
+}
+
+// Decodes the exact rectangles of a compact leaf, in the order of its objects
+static void qr_unpack_leaf(const struct qr_leaf* leaf, struct rectangle regions[]) {
+    const unsigned char* data = qr_leaf_data(leaf);
+    long long x = leaf->min_x;
+
+    // Every value is a single byte: fixed stride, no continuation bits to test
+    if (leaf->short_values) {
+        for (int k = 0; k < leaf->count; ++k) {
+            x += data[4 * k];
+            regions[k].min_x = (int)x;
+            regions[k].min_y = leaf->min_y + data[4 * k + 1];
+            regions[k].max_x = (int)(x + data[4 * k + 2]);
+            regions[k].max_y = regions[k].min_y + data[4 * k + 3];
+        }
+        return;
+    }
+
+    for (int k = 0; k < leaf->count; ++k) {
+        x += varint_decode(&data);
+        regions[k].min_x = (int)x;
+        regions[k].min_y = (int)((long long)leaf->min_y + varint_decode(&data));
+        regions[k].max_x = (int)(x + varint_decode(&data));
+        regions[k].max_y = (int)((long long)regions[k].min_y + varint_decode(&data));
+    }
+}
+
+// Copies a node of the pointer-based tree into the compact format; frame is the decoded MBR of the node
+static void * qr_build_node(NODE node, const struct rectangle* frame) {
+    if (node->is_leaf)
+        return qr_pack_leaf(node);
+
+    struct qr_node* qnode = (struct qr_node *)malloc(sizeof(struct qr_node));
+    qnode->count = (unsigned char)node->count;
+    for (int i = 0; i < node->count; ++i) {
+        qnode->regions[i] = qr_encode(node->regions[i], frame);
+        struct rectangle child_frame = qr_decode(&qnode->regions[i], frame);
+        qnode->children[i] = qr_build_node(node->children[i], &child_frame);
+    }
+    return qnode;
+}
+
+// Builds the compact read-only copy of an R-Tree; objects are shared with the source tree
+QR_TREE build_qr_tree(R_TREE r_tree) {
+    QR_TREE qr_tree = (QR_TREE)malloc(sizeof(struct qr_tree));
+    qr_tree->height = r_tree->height;
+    RECT rect = bounding_box(r_tree->root);
+    qr_tree->rect = *rect;
+    free(rect);
+    qr_tree->root = qr_build_node(r_tree->root, &qr_tree->rect);
+    return qr_tree;
+}
+
+// Frees a compact node and its subtree; height is the number of levels below it
+static void qr_free_node(void * node, int height) {
+    if (height > 0) {
+        struct qr_node* qnode = (struct qr_node *)node;
+        for (int i = 0; i < qnode->count; ++i)
+            qr_free_node(qnode->children[i], height - 1);
+    }
+    free(node);
+}
+
+// Frees the compact tree, objects belong to the source tree and are kept
+void free_qr_tree(QR_TREE qr_tree) {
+    qr_free_node(qr_tree->root, qr_tree->height);
+    free(qr_tree);
+}
+
+// Counts the bytes held by a compact node and its subtree
+static long long qr_node_memory(void * node, int height) {
+    if (height == 0) {
+        struct qr_leaf* leaf = (struct qr_leaf *)node;
+        return sizeof(struct qr_leaf) + sizeof(OBJ) * leaf->count + leaf->size;
+    }
+    struct qr_node* qnode = (struct qr_node *)node;
+    long long bytes = sizeof(struct qr_node);
+    for (int i = 0; i < qnode->count; ++i)
+        bytes += qr_node_memory(qnode->children[i], height - 1);
+    return bytes;
+}
+
+// Returns the memory used by the compact tree, excluding the shared objects
+long long qr_tree_memory(QR_TREE qr_tree) {
+    return sizeof(struct qr_tree) + qr_node_memory(qr_tree->root, qr_tree->height);
+}
+
+// Searches a compact node whose decoded MBR is frame
+static void qr_search_node(void * node, int height, const struct rectangle* frame, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    if (height == 0) {
+        struct qr_leaf* leaf = (struct qr_leaf *)node;
+        struct rectangle regions[M];
+        qr_unpack_leaf(leaf, regions);
+        for (int i = 0; i < leaf->count && *num_found < max_found; ++i)
+            if (window_matches(&regions[i], window, predicate))
+                found_objects[(*num_found)++] = leaf->objects[i];
+        return;
+    }
+    struct qr_node* qnode = (struct qr_node *)node;
+    for (int i = 0; i < qnode->count && *num_found < max_found; ++i) {
+        struct rectangle region = qr_decode(&qnode->regions[i], frame);
+        if (predicate == WINDOW_CONTAINS ? rect_contains(&region, window) : rect_intersects(&region, window))
+            qr_search_node(qnode->children[i], height - 1, &region, window, predicate, found_objects, max_found, num_found);
+    }
+}
+
+// Search for objects whose rectangles satisfy the predicate against the window, storing at most max_found of them
+void qr_search_window(QR_TREE qr_tree, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    qr_search_node(qr_tree->root, qr_tree->height, &qr_tree->rect, window, predicate, found_objects, max_found, num_found);
+}
+
+// Depth-first branch and bound kNN over a compact node; children are visited closest first and pruned against the Kth candidate
+static void qr_knn_node(void * node, int height, const struct rectangle* frame, int user_x, int user_y, int K, OBJ neighbors[], double distances[], int* found) {
+    if (height == 0) {
+        struct qr_leaf* leaf = (struct qr_leaf *)node;
+        struct rectangle leaf_regions[M];
+        qr_unpack_leaf(leaf, leaf_regions);
+        for (int i = 0; i < leaf->count; ++i) {
+            double d = min_distance_to_rect(&leaf_regions[i], user_x, user_y);
+            if (*found == K && d >= distances[K - 1])
+                continue;
+            int j = *found < K ? (*found)++ : K - 1;
+            while (j > 0 && distances[j - 1] > d) {
+                neighbors[j] = neighbors[j - 1];
+                distances[j] = distances[j - 1];
+                --j;
+            }
+            neighbors[j] = leaf->objects[i];
+            distances[j] = d;
+        }
+        return;
+    }
+
+    struct qr_node* qnode = (struct qr_node *)node;
+    struct rectangle regions[M];
+    double mindist[M];
+    int order[M];
+    for (int i = 0; i < qnode->count; ++i) {
+        regions[i] = qr_decode(&qnode->regions[i], frame);
+        mindist[i] = min_distance_to_rect(&regions[i], user_x, user_y);
+        int j = i;
+        while (j > 0 && mindist[order[j - 1]] > mindist[i]) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+    for (int k = 0; k < qnode->count; ++k) {
+        int i = order[k];
+        if (*found == K && mindist[i] >= distances[K - 1])
+            break;
+        qr_knn_node(qnode->children[i], height - 1, &regions[i], user_x, user_y, K, neighbors, distances, found);
+    }
+}
+
+// Finds the K nearest neighbours of the user in the compact tree, closest first; returns how many were found
+int qr_find_k_nearest_neighbors(QR_TREE qr_tree, int user_x, int user_y, int K, OBJ neighbors[], double distances[]) {
+    int found = 0;
+    if (K <= 0)
+        return 0;
+    double * best = distances != NULL ? distances : (double *)malloc(sizeof(double) * K);
+    qr_knn_node(qr_tree->root, qr_tree->height, &qr_tree->rect, user_x, user_y, K, neighbors, best, &found);
+    if (distances == NULL)
+        free(best);
+    return found;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Query result cache with spatial invalidation
+//
+// Window, radius and kNN results are kept in an LRU cache keyed on the query parameters snapped to a grid of `quantum` units; the
+// snapped query is the one executed, so quantum 1 gives exact results. Every entry records the region in which a change could alter
+// its result (the window, the square around the radius, or the square around the Kth neighbour) and these regions are themselves
+// indexed in an R-Tree. A change at a point then evicts only the entries whose region contains it.
+
+// Regions beyond this bound are treated as global so that areas in the invalidation index never overflow
+#define CACHE_COORD_LIMIT (1 << 29)
+// Results longer than this are not cached
+#define CACHE_MAX_RESULTS MAX_OBJECTS
+
+// Creates new query cache holding at most capacity results
+QUERY_CACHE create_query_cache(R_TREE r_tree, int capacity, int quantum) {
+    QUERY_CACHE cache = (QUERY_CACHE)calloc(1, sizeof(struct query_cache));
+    cache->r_tree = r_tree;
+    cache->index = create_new_r_tree();
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->quantum = quantum > 0 ? quantum : 1;
+    cache->num_buckets = 2 * cache->capacity + 1;
+    cache->buckets = (struct cache_entry **)calloc(cache->num_buckets, sizeof(struct cache_entry *));
+    cache->scratch = (OBJ *)malloc(sizeof(OBJ) * cache->capacity);
+    return cache;
+}
+
+// Rounds value down or up to a multiple of the cache quantum
+static int cache_snap(QUERY_CACHE cache, double value, bool round_up) {
+    double q = cache->quantum;
+    return (int)((round_up ? ceil(value / q) : floor(value / q)) * q);
+}
+
+// Hashes the key of a query
+static unsigned int cache_hash(enum cached_query_kind kind, const int params[4], int option) {
+    unsigned int hash = 2166136261u ^ (unsigned int)kind;
+    for (int i = 0; i < 4; ++i)
+        hash = (hash ^ (unsigned int)params[i]) * 16777619u;
+    return (hash ^ (unsigned int)option) * 16777619u;
+}
+
+// Returns the bucket of a query key
+static struct cache_entry ** cache_bucket(QUERY_CACHE cache, enum cached_query_kind kind, const int params[4], int option) {
+    return &cache->buckets[cache_hash(kind, params, option) % cache->num_buckets];
+}
+
+// Unlinks an entry from the LRU list
+static void cache_lru_unlink(QUERY_CACHE cache, struct cache_entry* entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+// Makes an entry the most recently used one
+static void cache_lru_push_front(QUERY_CACHE cache, struct cache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = entry;
+}
+
+// Removes an entry from the hash table, the LRU list and the invalidation index, then frees it
+static void cache_remove(QUERY_CACHE cache, struct cache_entry* entry) {
+    struct cache_entry ** link = cache_bucket(cache, entry->kind, entry->params, entry->option);
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    cache_lru_unlink(cache, entry);
+    if (entry->global)
+        cache->num_global -= 1;
+    else
+        delete_from_r_tree(cache->index, &entry->anchor);
+    cache->size -= 1;
+    free(entry->results);
+    free(entry);
+}
+
+// Looks up a query; a hit becomes the most recently used entry
+static struct cache_entry* cache_lookup(QUERY_CACHE cache, enum cached_query_kind kind, const int params[4], int option) {
+    struct cache_entry* entry = *cache_bucket(cache, kind, params, option);
+    while (entry != NULL) {
+        if (entry->kind == kind && entry->option == option && memcmp(entry->params, params, sizeof(entry->params)) == 0)
+            break;
+        entry = entry->hash_next;
+    }
+    if (entry == NULL) {
+        cache->misses += 1;
+        return NULL;
+    }
+    cache->hits += 1;
+    cache_lru_unlink(cache, entry);
+    cache_lru_push_front(cache, entry);
+    return entry;
+}
+
+// Stores a fresh result, evicting the least recently used entry if the cache is full
+static void cache_store(QUERY_CACHE cache, enum cached_query_kind kind, const int params[4], int option, double min_x, double min_y, double max_x, double max_y, OBJ results[], int num_results) {
+    if (num_results >= CACHE_MAX_RESULTS)
+        return;
+    if (cache->size == cache->capacity)
+        cache_remove(cache, cache->lru_tail);
+
+    struct cache_entry* entry = (struct cache_entry *)calloc(1, sizeof(struct cache_entry));
+    entry->kind = kind;
+    memcpy(entry->params, params, sizeof(entry->params));
+    entry->option = option;
+    entry->global = min_x < -CACHE_COORD_LIMIT || min_y < -CACHE_COORD_LIMIT || max_x > CACHE_COORD_LIMIT || max_y > CACHE_COORD_LIMIT;
+    entry->region.min_x = entry->global ? -CACHE_COORD_LIMIT : (int)floor(min_x);
+    entry->region.min_y = entry->global ? -CACHE_COORD_LIMIT : (int)floor(min_y);
+    entry->region.max_x = entry->global ? CACHE_COORD_LIMIT : (int)ceil(max_x);
+    entry->region.max_y = entry->global ? CACHE_COORD_LIMIT : (int)ceil(max_y);
+    entry->results = (OBJ *)malloc(sizeof(OBJ) * (num_results > 0 ? num_results : 1));
+    memcpy(entry->results, results, sizeof(OBJ) * num_results);
+    entry->num_results = num_results;
+
+    struct cache_entry ** bucket = cache_bucket(cache, kind, params, option);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_lru_push_front(cache, entry);
+    cache->size += 1;
+    cache->num_global += entry->global;
+
+    // The anchor point lies inside the region so that the entry can be found again for deletion
+    if (!entry->global) {
+        entry->anchor.x = entry->region.min_x;
+        entry->anchor.y = entry->region.min_y;
+        strcpy(entry->anchor.type, "query");
+        insert_rect_in_r_tree(cache->index, &entry->anchor, create_new_rect(entry->region.min_x, entry->region.min_y, entry->region.max_x, entry->region.max_y));
+    }
+}
+
+// Copies at most max_found cached results to the caller
+static int cache_copy_results(struct cache_entry* entry, OBJ found_objects[], int max_found) {
+    int count = entry->num_results < max_found ? entry->num_results : max_found;
+    memcpy(found_objects, entry->results, sizeof(OBJ) * count);
+    return count;
+}
+
+// Evicts every cached result that a change inside rect could alter
+void query_cache_invalidate(QUERY_CACHE cache, RECT rect) {
+    int num_found = 0;
+    search_window(cache->index->root, rect, WINDOW_INTERSECTS, cache->scratch, cache->capacity, &num_found);
+    for (int i = 0; i < num_found; ++i)
+        cache_remove(cache, (struct cache_entry *)cache->scratch[i]);
+    cache->invalidations += num_found;
+
+    // Global entries depend on the whole tree
+    struct cache_entry* entry = cache->num_global > 0 ? cache->lru_head : NULL;
+    while (entry != NULL) {
+        struct cache_entry* next = entry->lru_next;
+        if (entry->global) {
+            cache_remove(cache, entry);
+            cache->invalidations += 1;
+        }
+        entry = next;
+    }
+}
+
+// Search for objects satisfying the window predicate, through the cache
+int cached_search_window(QUERY_CACHE cache, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found) {
+    int params[4] = {cache_snap(cache, window->min_x, false), cache_snap(cache, window->min_y, false), cache_snap(cache, window->max_x, true), cache_snap(cache, window->max_y, true)};
+    struct cache_entry* entry = cache_lookup(cache, CACHED_WINDOW, params, predicate);
+    if (entry != NULL)
+        return cache_copy_results(entry, found_objects, max_found);
+
+    OBJ results[CACHE_MAX_RESULTS];
+    int num_found = 0;
+    struct rectangle snapped = {params[0], params[1], params[2], params[3]};
+    search_window(cache->r_tree->root, &snapped, predicate, results, CACHE_MAX_RESULTS, &num_found);
+    cache_store(cache, CACHED_WINDOW, params, predicate, params[0], params[1], params[2], params[3], results, num_found);
+    memcpy(found_objects, results, sizeof(OBJ) * (num_found < max_found ? num_found : max_found));
+    return num_found < max_found ? num_found : max_found;
+}
+
+// Search for objects within the radius of the user without printing them, storing at most max_found of them
+static void cache_search_radius(NODE node, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        if (min_distance_to_rect(node->regions[i], user_x, user_y) > radius)
+            continue;
+        if (node->is_leaf)
+            found_objects[(*num_found)++] = node->objects[i];
+        else
+            cache_search_radius(node->children[i], user_x, user_y, radius, found_objects, max_found, num_found);
+    }
+}
+
+// Search for objects within the radius of the user, through the cache
+int cached_search_radius(QUERY_CACHE cache, int user_x, int user_y, double radius, OBJ found_objects[], int max_found) {
+    int x = cache_snap(cache, user_x + cache->quantum / 2, false);
+    int y = cache_snap(cache, user_y + cache->quantum / 2, false);
+    int r = cache_snap(cache, radius, true);
+    int params[4] = {x, y, r, 0};
+    struct cache_entry* entry = cache_lookup(cache, CACHED_RADIUS, params, 0);
+    if (entry != NULL)
+        return cache_copy_results(entry, found_objects, max_found);
+
+    OBJ results[CACHE_MAX_RESULTS];
+    int num_found = 0;
+    cache_search_radius(cache->r_tree->root, x, y, r, results, CACHE_MAX_RESULTS, &num_found);
+    cache_store(cache, CACHED_RADIUS, params, 0, (double)x - r, (double)y - r, (double)x + r, (double)y + r, results, num_found);
+    memcpy(found_objects, results, sizeof(OBJ) * (num_found < max_found ? num_found : max_found));
+    return num_found < max_found ? num_found : max_found;
+}
+
+// Finds the K nearest neighbours of the user, through the cache; returns how many were found
+int cached_find_k_nearest_neighbors(QUERY_CACHE cache, int user_x, int user_y, int K, OBJ neighbors[]) {
+    int x = cache_snap(cache, user_x + cache->quantum / 2, false);
+    int y = cache_snap(cache, user_y + cache->quantum / 2, false);
+    int params[4] = {x, y, 0, 0};
+    struct cache_entry* entry = cache_lookup(cache, CACHED_KNN, params, K);
+    if (entry != NULL)
+        return cache_copy_results(entry, neighbors, K);
+
+    NN_ITER iter = nn_iter_open(cache->r_tree, x, y);
+    double distance = INFINITY;
+    int found = 0;
+    while (found < K && (neighbors[found] = nn_iter_next(iter, &distance)) != NULL)
+        ++found;
+    nn_iter_close(iter);
+
+    // Only a change closer than the Kth neighbour can alter the result
+    double reach = found == K ? distance : INFINITY;
+    cache_store(cache, CACHED_KNN, params, K, x - reach, y - reach, x + reach, y + reach, neighbors, found);
+    return found;
+}
+
+// Inserts a point object and evicts the results it may change
+void cached_insert(QUERY_CACHE cache, OBJ object) {
+    cached_insert_rect(cache, object, create_new_rect(object->x, object->y, object->x, object->y));
+}
+
+// Inserts an object covering obj_rect and evicts the results it may change
+void cached_insert_rect(QUERY_CACHE cache, OBJ object, RECT obj_rect) {
+    query_cache_invalidate(cache, obj_rect);
+    insert_rect_in_r_tree(cache->r_tree, object, obj_rect);
+}
+
+// Deletes an object and evicts the results it may change
+bool cached_delete(QUERY_CACHE cache, OBJ object) {
+    int index;
+    NODE leaf = find_leaf(cache->r_tree->root, object, &index);
+    if (leaf == NULL)
+        return false;
+    query_cache_invalidate(cache, leaf->regions[index]);
+    return delete_from_r_tree(cache->r_tree, object);
+}
+
+// Moves a point object and evicts the results affected at its old and new position
+bool cached_update(QUERY_CACHE cache, OBJ object, int new_x, int new_y) {
+    int index;
+    NODE leaf = find_leaf(cache->r_tree->root, object, &index);
+    if (leaf == NULL)
+        return false;
+    struct rectangle destination = {new_x, new_y, new_x, new_y};
+    query_cache_invalidate(cache, leaf->regions[index]);
+    query_cache_invalidate(cache, &destination);
+    return update_in_r_tree(cache->r_tree, object, new_x, new_y);
+}
+
+// Frees the cache and its cached results, the cached tree is kept
+void free_query_cache(QUERY_CACHE cache) {
+    while (cache->lru_head != NULL)
+        cache_remove(cache, cache->lru_head);
+    free(cache->index->root);
+    free(cache->index->rect);
+    free(cache->index);
+    free(cache->buckets);
+    free(cache->scratch);
+    free(cache);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Batched insertion (Sort-Tile-Recursive packing)
+
+// Stores an entry while a batch is being packed into nodes
+struct pack_entry
+{
+    RECT region;
+    OBJ object;                  // Object of a leaf entry
+    NODE child;                  // Child of an internal entry
+    int center_x;
+    int center_y;
+};
+
+static int compare_pack_x(const void* a, const void* b) {
+    const struct pack_entry* p = (const struct pack_entry *)a;
+    const struct pack_entry* q = (const struct pack_entry *)b;
+    return (p->center_x > q->center_x) - (p->center_x < q->center_x);
+}
+
+static int compare_pack_y(const void* a, const void* b) {
+    const struct pack_entry* p = (const struct pack_entry *)a;
+    const struct pack_entry* q = (const struct pack_entry *)b;
+    return (p->center_y > q->center_y) - (p->center_y < q->center_y);
+}
+
+// Orders entries for STR: sorted by x, cut into vertical slices of about sqrt(count / M) nodes, each slice sorted by y
+static void str_order(struct pack_entry* entries, int count) {
+    int nodes = (count + M - 1) / M;
+    int slices = (int)ceil(sqrt((double)nodes));
+    int slice_size = ((nodes + slices - 1) / slices) * M;
+    qsort(entries, count, sizeof(struct pack_entry), compare_pack_x);
+    for (int start = 0; start < count; start += slice_size) {
+        int size = count - start < slice_size ? count - start : slice_size;
+        qsort(entries + start, size, sizeof(struct pack_entry), compare_pack_y);
+    }
+}
+
+// Packs one level: consecutive entries are spread evenly over ceil(count / M) nodes so every node holds at least m entries
+static int str_pack_level(struct pack_entry* entries, int count, bool leaves) {
+    int nodes = (count + M - 1) / M;
+    int next = 0;
+    for (int n = 0; n < nodes; ++n) {
+        int first = (int)((long long)count * n / nodes);
+        int last = (int)((long long)count * (n + 1) / nodes);
+        NODE node = leaves ? create_new_leaf_node() : create_new_internal_node();
+        for (int i = first; i < last; ++i) {
+            if (leaves)
+                insert_object_into_node(node, entries[i].object, entries[i].region);
+            else
+                insert_region_into_node(node, entries[i].child, entries[i].region);
+        }
+        RECT box = bounding_box(node);
+        entries[next].region = box;
+        entries[next].object = NULL;
+        entries[next].child = node;
+        entries[next].center_x = (int)(((long long)box->min_x + box->max_x) / 2);
+        entries[next].center_y = (int)(((long long)box->min_y + box->max_y) / 2);
+        ++next;
+    }
+    return next;
+}
+
+// Inserts many objects at once; regions are owned by the tree afterwards.
+// An empty tree is bulk loaded bottom-up with STR packing, otherwise the batch is inserted in STR order so consecutive inserts share paths.
+void insert_batch_in_r_tree(R_TREE r_tree, OBJ objects[], RECT regions[], int count) {
+    if (count <= 0)
+        return;
+    struct pack_entry* entries = (struct pack_entry *)malloc(sizeof(struct pack_entry) * count);
+    for (int i = 0; i < count; ++i) {
+        entries[i].region = regions[i];
+        entries[i].object = objects[i];
+        entries[i].child = NULL;
+        entries[i].center_x = (int)(((long long)regions[i]->min_x + regions[i]->max_x) / 2);
+        entries[i].center_y = (int)(((long long)regions[i]->min_y + regions[i]->max_y) / 2);
+    }
+    str_order(entries, count);
+
+    if (r_tree->root->is_leaf && r_tree->root->count == 0 && count > M) {
+        int height = 0;
+        int level = str_pack_level(entries, count, true);
+        while (level > 1) {
+            str_order(entries, level);
+            level = str_pack_level(entries, level, false);
+            ++height;
+        }
+        bool histograms = r_tree->root->histogram != NULL;
+        free(r_tree->root->histogram);
+        free(r_tree->root);
+        r_tree->root = entries[0].child;
+        r_tree->height = height;
+        free(r_tree->rect);
+        r_tree->rect = entries[0].region;
+        if (histograms)
+            enable_type_histograms(r_tree);
+    } else {
+        for (int i = 0; i < count; ++i)
+            insert_rect_in_r_tree(r_tree, entries[i].object, entries[i].region);
+    }
+    free(entries);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Snapshots and write-ahead log
+//
+// A snapshot holds every object of the tree together with the LSN of the last logged change it contains. The WAL holds the changes
+// made after it, each record being
+//     crc32 (4 bytes) | payload length (4 bytes) | payload
+// with payload
+//     lsn (8) | op (1) | x, y (8) | min_x, min_y, max_x, max_y (16) | new_x, new_y (8) | type length (1) | type
+// in host byte order. Recovery loads the snapshot, replays the valid prefix of the log and truncates a torn last record.
+// Logged deletes and updates identify their object by position and type.
+
+#define SNAPSHOT_MAGIC "RTSNAP1"
+#define WAL_HEADER_SIZE 8
+#define WAL_FIXED_PAYLOAD 41
+
+// Calculates the CRC-32 (IEEE) of a buffer
+static unsigned int crc32_of(const unsigned char* data, size_t length) {
+    static unsigned int table[256];
+    static bool ready = false;
+    if (!ready) {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = true;
+    }
+    unsigned int crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Writes all bytes, retrying short writes
+static bool write_fully(int fd, const unsigned char* data, size_t length) {
+    while (length > 0) {
+        int written = write(fd, data, (unsigned int)length);
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// Stores the fields of one logged change
+struct wal_record
+{
+    unsigned long long lsn;
+    enum wal_op op;
+    int x, y;
+    struct rectangle region;
+    int new_x, new_y;
+    char type[MAX_TYPE_LEN];
+};
+
+// Encodes a record into out, returns its size including the header
+static size_t wal_encode(const struct wal_record* record, unsigned char* out) {
+    unsigned char* p = out + WAL_HEADER_SIZE;
+    unsigned char op = (unsigned char)record->op;
+    unsigned char type_length = (unsigned char)strlen(record->type);
+    int ints[8] = {record->x, record->y, record->region.min_x, record->region.min_y, record->region.max_x, record->region.max_y, record->new_x, record->new_y};
+    memcpy(p, &record->lsn, 8);
+    memcpy(p + 8, &op, 1);
+    memcpy(p + 9, ints, sizeof(ints));
+    memcpy(p + 41, &type_length, 1);
+    memcpy(p + 42, record->type, type_length);
+
+    unsigned int length = WAL_FIXED_PAYLOAD + 1 + type_length;
+    unsigned int crc = crc32_of(out + WAL_HEADER_SIZE, length);
+    memcpy(out, &crc, 4);
+    memcpy(out + 4, &length, 4);
+    return WAL_HEADER_SIZE + length;
+}
+
+// Decodes a record from a validated payload
+static void wal_decode(const unsigned char* p, struct wal_record* record) {
+    unsigned char op, type_length;
+    int ints[8];
+    memcpy(&record->lsn, p, 8);
+    memcpy(&op, p + 8, 1);
+    memcpy(ints, p + 9, sizeof(ints));
+    memcpy(&type_length, p + 41, 1);
+    record->op = (enum wal_op)op;
+    record->x = ints[0];
+    record->y = ints[1];
+    record->region = (struct rectangle){ints[2], ints[3], ints[4], ints[5]};
+    record->new_x = ints[6];
+    record->new_y = ints[7];
+    memcpy(record->type, p + 42, type_length);
+    record->type[type_length] = '\0';
+}
+
+// Appends a record to the log buffer and returns its LSN; it becomes durable with wal_commit
+static unsigned long long wal_append(WAL wal, struct wal_record* record) {
+    unsigned char encoded[WAL_HEADER_SIZE + WAL_FIXED_PAYLOAD + 1 + MAX_TYPE_LEN];
+    pthread_mutex_lock(&wal->lock);
+    record->lsn = wal->next_lsn++;
+    size_t size = wal_encode(record, encoded);
+    if (wal->used + size > wal->capacity) {
+        wal->capacity = 2 * (wal->used + size);
+        wal->buffer = (unsigned char *)realloc(wal->buffer, wal->capacity);
+    }
+    memcpy(wal->buffer + wal->used, encoded, size);
+    wal->used += size;
+    pthread_mutex_unlock(&wal->lock);
+    return record->lsn;
+}
+
+// Logs the insertion of an object covering obj_rect
+unsigned long long wal_log_insert(WAL wal, OBJ object, RECT obj_rect) {
+    struct wal_record record = {0, WAL_INSERT, object->x, object->y, *obj_rect, 0, 0, ""};
+    strcpy(record.type, object->type);
+    return wal_append(wal, &record);
+}
+
+// Logs the deletion of an object
+unsigned long long wal_log_delete(WAL wal, OBJ object) {
+    struct wal_record record = {0, WAL_DELETE, object->x, object->y, {0, 0, 0, 0}, 0, 0, ""};
+    strcpy(record.type, object->type);
+    return wal_append(wal, &record);
+}
+
+// Logs the move of a point object to (new_x, new_y)
+unsigned long long wal_log_update(WAL wal, OBJ object, int new_x, int new_y) {
+    struct wal_record record = {0, WAL_UPDATE, object->x, object->y, {0, 0, 0, 0}, new_x, new_y, ""};
+    strcpy(record.type, object->type);
+    return wal_append(wal, &record);
+}
+
+// Waits until the record with the given LSN is on disk. Concurrent committers share one write and fsync (group commit).
+// Returns false if the group commit that should have written the record failed; the record then stays buffered, its bytes are
+// cut off the log again, and a later commit retries it.
+bool wal_commit(WAL wal, unsigned long long lsn) {
+    pthread_mutex_lock(&wal->lock);
+    long long failures = wal->failures;
+    while (wal->durable_lsn < lsn) {
+        if (wal->broken || wal->failures != failures) {
+            pthread_mutex_unlock(&wal->lock);
+            return false;
+        }
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+            continue;
+        }
+
+        // Become the leader: take everything appended so far and write it without holding the lock
+        wal->flushing = true;
+        unsigned char* batch = wal->buffer;
+        size_t size = wal->used;
+        unsigned long long batch_lsn = wal->next_lsn - 1;
+        wal->buffer = (unsigned char *)malloc(wal->capacity);
+        wal->used = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        bool ok = write_fully(wal->fd, batch, size) && fsync(wal->fd) == 0;
+        // A partial write would end the valid prefix of the log and hide every later record from recovery
+        bool truncated = ok || ftruncate(wal->fd, wal->durable_size) == 0;
+
+        pthread_mutex_lock(&wal->lock);
+        if (ok) {
+            free(batch);
+            wal->durable_lsn = batch_lsn;
+            wal->durable_size += (long)size;
+            wal->fsyncs += 1;
+        } else {
+            // Put the batch back in front of the records appended meanwhile
+            fprintf(stderr, "Error writing the write-ahead log!\n");
+            if (size + wal->used > wal->capacity)
+                wal->capacity = 2 * (size + wal->used);
+            batch = (unsigned char *)realloc(batch, wal->capacity);
+            memcpy(batch + size, wal->buffer, wal->used);
+            free(wal->buffer);
+            wal->buffer = batch;
+            wal->used += size;
+            wal->failures += 1;
+            wal->broken = wal->broken || !truncated;
+        }
+        wal->flushing = false;
+        pthread_cond_broadcast(&wal->flushed);
+        if (!ok) {
+            pthread_mutex_unlock(&wal->lock);
+            return false;
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return true;
+}
+
+#ifdef _WIN32
+// Declared here rather than through windows.h, whose RECT would clash with the one of this file
+__declspec(dllimport) int __stdcall MoveFileExA(const char* existing, const char* replacement, unsigned long flags);
+#define MOVEFILE_REPLACE_EXISTING 0x1
+#define MOVEFILE_WRITE_THROUGH 0x8
+#endif
+
+// Atomically replaces target with source, and makes the rename itself durable
+static bool replace_file(const char* source, const char* target) {
+#ifdef _WIN32
+    return MoveFileExA(source, target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(source, target) != 0)
+        return false;
+    // The new directory entry is only durable once the directory is synced
+    char directory[512];
+    const char* slash = strrchr(target, '/');
+    if (slash == NULL)
+        snprintf(directory, sizeof(directory), ".");
+    else if (slash == target)
+        snprintf(directory, sizeof(directory), "/");
+    else
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - target), target);
+    int fd = open(directory, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// Collects the objects and rectangles of a subtree in leaf order
+static void collect_entries(NODE node, OBJ objects[], RECT regions[], int* count) {
+    for (int i = 0; i < node->count; ++i) {
+        if (node->is_leaf) {
+            objects[*count] = node->objects[i];
+            regions[*count] = node->regions[i];
+            *count += 1;
+        } else {
+            collect_entries(node->children[i], objects, regions, count);
+        }
+    }
+}
+
+// Counts the objects of a subtree
+static int count_objects(NODE node) {
+    if (node->is_leaf)
+        return node->count;
+    int count = 0;
+    for (int i = 0; i < node->count; ++i)
+        count += count_objects(node->children[i]);
+    return count;
+}
+
+// Writes every object of the tree to path, replacing the previous snapshot atomically
+bool save_snapshot(R_TREE r_tree, const char* path, unsigned long long lsn) {
+    char temp_path[512];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL)
+        return false;
+
+    int count = count_objects(r_tree->root);
+    OBJ* objects = (OBJ *)malloc(sizeof(OBJ) * (count + 1));
+    RECT* regions = (RECT *)malloc(sizeof(RECT) * (count + 1));
+    int collected = 0;
+    collect_entries(r_tree->root, objects, regions, &collected);
+
+    bool ok = fwrite(SNAPSHOT_MAGIC, 1, 8, file) == 8 && fwrite(&lsn, sizeof(lsn), 1, file) == 1 && fwrite(&count, sizeof(count), 1, file) == 1;
+    for (int i = 0; ok && i < count; ++i) {
+        int ints[6] = {objects[i]->x, objects[i]->y, regions[i]->min_x, regions[i]->min_y, regions[i]->max_x, regions[i]->max_y};
+        ok = fwrite(ints, sizeof(ints), 1, file) == 1 && fwrite(objects[i]->type, 1, MAX_TYPE_LEN, file) == MAX_TYPE_LEN;
+    }
+    free(objects);
+    free(regions);
+
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    // Replace the old snapshot in one step, so that a crash leaves either the old or the new one
+    if (ok)
+        ok = replace_file(temp_path, path);
+    if (!ok)
+        remove(temp_path);
+    return ok;
+}
+
+// Loads a snapshot into a new tree through the batched insert path; returns NULL if it is missing or corrupt
+R_TREE load_snapshot(const char* path, unsigned long long* lsn) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    char magic[8];
+    int count;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0 || fread(lsn, sizeof(*lsn), 1, file) != 1 || fread(&count, sizeof(count), 1, file) != 1 || count < 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    OBJ* objects = (OBJ *)malloc(sizeof(OBJ) * (count + 1));
+    RECT* regions = (RECT *)malloc(sizeof(RECT) * (count + 1));
+    int loaded = 0;
+    for (; loaded < count; ++loaded) {
+        int ints[6];
+        char type[MAX_TYPE_LEN];
+        if (fread(ints, sizeof(ints), 1, file) != 1 || fread(type, 1, MAX_TYPE_LEN, file) != MAX_TYPE_LEN)
+            break;
+        type[MAX_TYPE_LEN - 1] = '\0';
+        objects[loaded] = create_new_object(ints[0], ints[1], type);
+        regions[loaded] = create_new_rect(ints[2], ints[3], ints[4], ints[5]);
+    }
+    fclose(file);
+
+    R_TREE r_tree = create_new_r_tree();
+    insert_batch_in_r_tree(r_tree, objects, regions, loaded);
+    free(objects);
+    free(regions);
+    return r_tree;
+}
+
+// Finds the object stored at (x, y) with the given type
+static OBJ find_object_at(R_TREE r_tree, int x, int y, const char* type) {
+    struct rectangle point = {x, y, x, y};
+    OBJ found[MAX_OBJECTS];
+    int num_found = 0;
+    search_window(r_tree->root, &point, WINDOW_INTERSECTS, found, MAX_OBJECTS, &num_found);
+    for (int i = 0; i < num_found; ++i)
+        if (found[i]->x == x && found[i]->y == y && strcmp(found[i]->type, type) == 0)
+            return found[i];
+    return NULL;
+}
+
+// Opens the log for appending after recovery
+static WAL wal_open(int fd, unsigned long long next_lsn, long size) {
+    WAL wal = (WAL)calloc(1, sizeof(struct wal));
+    wal->fd = fd;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+    wal->capacity = 4096;
+    wal->buffer = (unsigned char *)malloc(wal->capacity);
+    wal->next_lsn = next_lsn;
+    wal->durable_lsn = next_lsn - 1;
+    wal->durable_size = size;
+    return wal;
+}
+
+// Rebuilds the tree after a restart: loads the latest snapshot, replays the valid tail of the log (consecutive inserts through the
+// batched insert path) and opens the log for further changes
+R_TREE wal_recover(const char* snapshot_path, const char* wal_path, WAL* wal_out) {
+    unsigned long long snapshot_lsn = 0;
+    R_TREE r_tree = snapshot_path != NULL ? load_snapshot(snapshot_path, &snapshot_lsn) : NULL;
+    if (r_tree == NULL) {
+        r_tree = create_new_r_tree();
+        snapshot_lsn = 0;
+    }
+
+    int fd = open(wal_path, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (fd < 0) {
+        *wal_out = NULL;
+        return r_tree;
+    }
+
+    // Read the whole log; it only holds the changes since the last checkpoint
+    size_t size = 0, capacity = 1 << 16;
+    unsigned char* data = (unsigned char *)malloc(capacity);
+    int bytes;
+    lseek(fd, 0, SEEK_SET);
+    while ((bytes = read(fd, data + size, (unsigned int)(capacity - size))) > 0) {
+        size += bytes;
+        if (size == capacity) {
+            capacity *= 2;
+            data = (unsigned char *)realloc(data, capacity);
+        }
+    }
+
+    OBJ* batch_objects = (OBJ *)malloc(sizeof(OBJ) * 1024);
+    RECT* batch_regions = (RECT *)malloc(sizeof(RECT) * 1024);
+    int batch_count = 0, batch_capacity = 1024;
+    unsigned long long last_lsn = snapshot_lsn;
+    size_t offset = 0;
+    while (offset + WAL_HEADER_SIZE <= size) {
+        unsigned int crc, length;
+        memcpy(&crc, data + offset, 4);
+        memcpy(&length, data + offset + 4, 4);
+        // A torn or corrupt record ends the valid prefix
+        if (length < WAL_FIXED_PAYLOAD + 1 || length > WAL_FIXED_PAYLOAD + MAX_TYPE_LEN || offset + WAL_HEADER_SIZE + length > size || crc32_of(data + offset + WAL_HEADER_SIZE, length) != crc)
+            break;
+        struct wal_record record;
+        wal_decode(data + offset + WAL_HEADER_SIZE, &record);
+        offset += WAL_HEADER_SIZE + length;
+        if (record.lsn <= snapshot_lsn)
+            continue;
+        last_lsn = record.lsn;
+
+        if (record.op == WAL_INSERT) {
+            if (batch_count == batch_capacity) {
+                batch_capacity *= 2;
+                batch_objects = (OBJ *)realloc(batch_objects, sizeof(OBJ) * batch_capacity);
+                batch_regions = (RECT *)realloc(batch_regions, sizeof(RECT) * batch_capacity);
+            }
+            batch_objects[batch_count] = create_new_object(record.x, record.y, record.type);
+            batch_regions[batch_count] = create_new_rect(record.region.min_x, record.region.min_y, record.region.max_x, record.region.max_y);
+            ++batch_count;
+            continue;
+        }
+
+        // Deletes and updates must see every earlier insert
+        insert_batch_in_r_tree(r_tree, batch_objects, batch_regions, batch_count);
+        batch_count = 0;
+        OBJ object = find_object_at(r_tree, record.x, record.y, record.type);
+        if (object != NULL && record.op == WAL_DELETE)
+            delete_from_r_tree(r_tree, object);
+        else if (object != NULL && record.op == WAL_UPDATE)
+            update_in_r_tree(r_tree, object, record.new_x, record.new_y);
+    }
+    insert_batch_in_r_tree(r_tree, batch_objects, batch_regions, batch_count);
+    free(batch_objects);
+    free(batch_regions);
+    free(data);
+
+    // Drop the torn tail so new records follow the last valid one
+    bool truncated = offset == size || ftruncate(fd, (long)offset) == 0;
+    if (!truncated)
+        fprintf(stderr, "Error truncating the write-ahead log!\n");
+    *wal_out = wal_open(fd, last_lsn + 1, (long)offset);
+    (*wal_out)->broken = !truncated;
+    return r_tree;
+}
+
+// Writes a snapshot containing every logged change, then empties the log. The caller must not change the tree meanwhile.
+bool wal_checkpoint(WAL wal, R_TREE r_tree, const char* snapshot_path) {
+    pthread_mutex_lock(&wal->lock);
+    unsigned long long lsn = wal->next_lsn - 1;
+    pthread_mutex_unlock(&wal->lock);
+    if (!wal_commit(wal, lsn) || !save_snapshot(r_tree, snapshot_path, lsn))
+        return false;
+
+    pthread_mutex_lock(&wal->lock);
+    bool ok = wal->used == 0 && !wal->flushing && ftruncate(wal->fd, 0) == 0;
+    if (ok)
+        wal->durable_size = 0;
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+// Makes every logged change durable and closes the log; returns false if some changes could not be written
+bool wal_close(WAL wal) {
+    if (wal == NULL)
+        return true;
+    pthread_mutex_lock(&wal->lock);
+    unsigned long long lsn = wal->next_lsn - 1;
+    pthread_mutex_unlock(&wal->lock);
+    bool ok = wal_commit(wal, lsn);
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->flushed);
+    free(wal->buffer);
+    free(wal);
+    return ok;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Persistent copy-on-write versions
+//
+// A commit copies only the nodes on the paths from the modified leaves to the root; every other node is shared with the older
+// versions and reference counted. Nodes created by the commit in progress carry its id as epoch and are modified in place, so a
+// path touched by several inserts of the same batch is copied once. Committed versions are never modified, so readers need no locks.
+// Parent pointers are not maintained in versioned trees; deletion and adjust_tree are not used on them.
+
+// Drops one reference to a node, freeing it and releasing its children when the last reference goes
+static void release_node(NODE node) {
+    if (__atomic_sub_fetch(&node->ref_count, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (int i = 0; i < node->count; ++i) {
+        if (!node->is_leaf)
+            release_node(node->children[i]);
+        free(node->regions[i]);
+    }
+    free(node);
+}
+
+// Returns a node of the current epoch standing for node: node itself if this commit created it, otherwise a copy sharing its children
+static NODE cow_writable(NODE node, int epoch) {
+    if (node->epoch == epoch)
+        return node;
+    NODE copy = node->is_leaf ? create_new_leaf_node() : create_new_internal_node();
+    copy->epoch = epoch;
+    copy->count = node->count;
+    for (int i = 0; i < node->count; ++i) {
+        RECT region = node->regions[i];
+        copy->regions[i] = create_new_rect(region->min_x, region->min_y, region->max_x, region->max_y);
+        copy->objects[i] = node->objects[i];
+        copy->children[i] = node->children[i];
+        copy->counts[i] = node->counts[i];
+        if (!node->is_leaf)
+            __atomic_add_fetch(&node->children[i]->ref_count, 1, __ATOMIC_ACQ_REL);
+    }
+    // The copy takes the place of node in the new version
+    release_node(node);
+    return copy;
+}
+
+// Inserts below a writable node. Returns the node that replaces it, which differs when it was split; the other half goes to sibling.
+static NODE cow_insert(NODE node, OBJ object, RECT obj_rect, int epoch, NODE* sibling) {
+    NODE * nodes;
+    *sibling = NULL;
+    if (node->is_leaf) {
+        if (node->count < M) {
+            insert_object_into_node(node, object, obj_rect);
+            return node;
+        }
+        nodes = quadratic_split_leaf_node(node, object, obj_rect);
+    } else {
+        // Copy the chosen child into this version and descend
+        int index = choose_subtree(node, obj_rect);
+        NODE child_sibling;
+        NODE child = cow_insert(cow_writable(node->children[index], epoch), object, obj_rect, epoch, &child_sibling);
+        node->children[index] = child;
+        free(node->regions[index]);
+        node->regions[index] = bounding_box(child);
+        node->counts[index] = subtree_count(child);
+        if (child_sibling == NULL)
+            return node;
+        if (node->count < M) {
+            insert_region_into_node(node, child_sibling, bounding_box(child_sibling));
+            return node;
+        }
+        nodes = quadratic_split_internal_node(node, bounding_box(child_sibling), child_sibling);
+    }
+
+    // The split halves replace node, which only this commit could reference
+    nodes[0]->epoch = nodes[1]->epoch = epoch;
+    free(node);
+    NODE replacement = nodes[0];
+    *sibling = nodes[1];
+    free(nodes);
+    return replacement;
+}
+
+// Creates new versioned R-Tree keeping the retain most recent versions (at least one)
+VERSIONED_R_TREE create_versioned_r_tree(int retain) {
+    VERSIONED_R_TREE versioned = (VERSIONED_R_TREE)malloc(sizeof(struct versioned_r_tree));
+    pthread_mutex_init(&versioned->lock, NULL);
+    versioned->latest = NULL;
+    versioned->next_id = 1;
+    versioned->retain = retain > 0 ? retain : 1;
+    return versioned;
+}
+
+// Inserts a batch of objects as a new version and returns its id; regions are owned by the tree afterwards.
+// Versions beyond the retention limit leave the list and are freed once their last reader releases them.
+long long commit_batch(VERSIONED_R_TREE versioned, OBJ objects[], RECT regions[], int count) {
+    pthread_mutex_lock(&versioned->lock);
+    VERSION base = versioned->latest;
+    long long id = versioned->next_id++;
+    int epoch = (int)id;
+
+    // The new version starts by sharing the root of the latest one
+    NODE root;
+    int height = 0;
+    if (base != NULL) {
+        root = base->root;
+        height = base->height;
+        __atomic_add_fetch(&root->ref_count, 1, __ATOMIC_ACQ_REL);
+    } else {
+        root = create_new_leaf_node();
+        root->epoch = epoch;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        NODE sibling;
+        root = cow_insert(cow_writable(root, epoch), objects[i], regions[i], epoch, &sibling);
+        // Root was split, grow the tree by one level
+        if (sibling != NULL) {
+            NODE new_root = create_new_internal_node();
+            new_root->epoch = epoch;
+            insert_region_into_node(new_root, root, bounding_box(root));
+            insert_region_into_node(new_root, sibling, bounding_box(sibling));
+            root = new_root;
+            ++height;
+        }
+    }
+
+    VERSION version = (VERSION)malloc(sizeof(struct r_tree_version));
+    version->id = id;
+    version->committed_at = time(NULL);
+    version->height = height;
+    version->root = root;
+    version->ref_count = 1;
+    version->older = base;
+    versioned->latest = version;
+
+    // Drop versions beyond the retention limit from the list
+    VERSION kept = version;
+    for (int i = 1; i < versioned->retain && kept->older != NULL; ++i)
+        kept = kept->older;
+    VERSION dropped = kept->older;
+    kept->older = NULL;
+    while (dropped != NULL) {
+        VERSION older = dropped->older;
+        release_version(dropped);
+        dropped = older;
+    }
+    pthread_mutex_unlock(&versioned->lock);
+    return id;
+}
+
+// Returns the newest retained version committed at or before `at` (the latest one if at is 0), or NULL. Release it after use.
+VERSION acquire_version(VERSIONED_R_TREE versioned, time_t at) {
+    pthread_mutex_lock(&versioned->lock);
+    VERSION version = versioned->latest;
+    while (version != NULL && at != 0 && version->committed_at > at)
+        version = version->older;
+    if (version != NULL)
+        __atomic_add_fetch(&version->ref_count, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&versioned->lock);
+    return version;
+}
+
+// Drops a reference to a version; the last one frees the nodes no other version shares
+void release_version(VERSION version) {
+    if (__atomic_sub_fetch(&version->ref_count, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    release_node(version->root);
+    free(version);
+}
+
+// Returns a read-only R_TREE view of a version, usable with every query function while the version is held
+struct r_tree version_view(VERSION version) {
+    struct r_tree view = {version->height, NULL, version->root};
+    return view;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Disk-resident R-Tree
+//
+// Nodes live in fixed-size pages of one file and refer to their children by page id. Page 0 holds the header; every other page holds
+// a node of up to DISK_MAX_ENTRIES entries, leaf entries carrying the object itself. Pages are accessed through a buffer pool of a
+// fixed memory budget with CLOCK replacement: a page is pinned while in use and only unpinned frames are evicted, dirty ones being
+// written back first. Nodes have no parent pointers, so insertion records the path it descends instead.
+
+#define DISK_MAGIC "RTDISK1"
+#define DISK_MAX_HEIGHT 32
+
+// Reads or writes one page at its offset in the file
+static bool page_io(int fd, unsigned int page_id, unsigned char* data, bool write_page) {
+    long long offset = (long long)page_id * DISK_PAGE_SIZE;
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) != offset)
+        return false;
+    return (write_page ? write(fd, data, DISK_PAGE_SIZE) : read(fd, data, DISK_PAGE_SIZE)) == DISK_PAGE_SIZE;
+#else
+    return (write_page ? pwrite(fd, data, DISK_PAGE_SIZE, offset) : pread(fd, data, DISK_PAGE_SIZE, offset)) == DISK_PAGE_SIZE;
+#endif
+}
+
+// Asynchronous page reads
+//
+// A query hands every child page it is going to visit to the reader at once, keeping up to DISK_READ_DEPTH reads in flight, and
+// then works on whichever page completes first. Each read targets a claimed, pinned frame marked loading; pin_page waits for such
+// frames, so the synchronous paths stay correct while reads are outstanding.
+
+// Reads pages queued by the query on behalf of the reader pool
+static void* page_reader_thread(void* argument) {
+    struct page_reader* reader = (struct page_reader *)argument;
+    pthread_mutex_lock(&reader->lock);
+    while (true) {
+        while (reader->request_count == 0 && !reader->stopping)
+            pthread_cond_wait(&reader->requested, &reader->lock);
+        if (reader->request_count == 0)
+            break;
+        int frame = reader->requests[reader->request_head];
+        reader->request_head = (reader->request_head + 1) % reader->depth;
+        reader->request_count -= 1;
+        pthread_mutex_unlock(&reader->lock);
+
+        bool ok = page_io(reader->fd, reader->page_ids[frame], reader->buffers[frame], false);
+
+        pthread_mutex_lock(&reader->lock);
+        int slot = (reader->completion_head + reader->completion_count) % reader->depth;
+        reader->completions[slot] = frame;
+        reader->results[slot] = ok;
+        reader->completion_count += 1;
+        pthread_cond_signal(&reader->completed);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+// Sets up an io_uring instance with room for depth reads; returns false if the kernel does not provide one
+static bool io_uring_start(struct page_reader* reader) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    reader->ring_fd = (int)syscall(__NR_io_uring_setup, reader->depth, &params);
+    if (reader->ring_fd < 0)
+        return false;
+
+    reader->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reader->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    reader->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    reader->sq_ring = mmap(NULL, reader->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ring_fd, IORING_OFF_SQ_RING);
+    reader->cq_ring = mmap(NULL, reader->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ring_fd, IORING_OFF_CQ_RING);
+    reader->sqes = mmap(NULL, reader->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ring_fd, IORING_OFF_SQES);
+    if (reader->sq_ring == MAP_FAILED || reader->cq_ring == MAP_FAILED || reader->sqes == MAP_FAILED) {
+        if (reader->sq_ring != MAP_FAILED)
+            munmap(reader->sq_ring, reader->sq_ring_size);
+        if (reader->cq_ring != MAP_FAILED)
+            munmap(reader->cq_ring, reader->cq_ring_size);
+        if (reader->sqes != MAP_FAILED)
+            munmap(reader->sqes, reader->sqes_size);
+        close(reader->ring_fd);
+        reader->ring_fd = -1;
+        return false;
+    }
+    reader->sq_head = (unsigned *)(reader->sq_ring + params.sq_off.head);
+    reader->sq_tail = (unsigned *)(reader->sq_ring + params.sq_off.tail);
+    reader->sq_mask = (unsigned *)(reader->sq_ring + params.sq_off.ring_mask);
+    reader->sq_array = (unsigned *)(reader->sq_ring + params.sq_off.array);
+    reader->cq_head = (unsigned *)(reader->cq_ring + params.cq_off.head);
+    reader->cq_tail = (unsigned *)(reader->cq_ring + params.cq_off.tail);
+    reader->cq_mask = (unsigned *)(reader->cq_ring + params.cq_off.ring_mask);
+    reader->cqes = (struct io_uring_cqe *)(reader->cq_ring + params.cq_off.cqes);
+    reader->sq_local_tail = *reader->sq_tail;
+    return true;
+}
+
+// Submits the published entries the kernel has not consumed yet and updates unsubmitted; returns false, leaving errno set,
+// if io_uring_enter fails. A short submit is not an error, the remaining entries stay published for the next call.
+static bool io_uring_submit(struct page_reader* reader, unsigned wait_for) {
+    int result = (int)syscall(__NR_io_uring_enter, reader->ring_fd, reader->unsubmitted, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    reader->unsubmitted = (int)(reader->sq_local_tail - __atomic_load_n(reader->sq_head, __ATOMIC_ACQUIRE));
+    return result >= 0 || errno == EINTR;
+}
+
+// Performs the reads the kernel did not consume synchronously, completing them through the queue of the reader threads, and
+// withdraws their entries from the ring. Only used once io_uring_enter has failed, so the kernel will not read them meanwhile.
+static void io_uring_complete_inline(struct page_reader* reader) {
+    unsigned head = __atomic_load_n(reader->sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != reader->sq_local_tail; ++i) {
+        int frame = (int)reader->sqes[reader->sq_array[i & *reader->sq_mask]].user_data;
+        int slot = (reader->completion_head + reader->completion_count) % reader->depth;
+        reader->completions[slot] = frame;
+        reader->results[slot] = page_io(reader->fd, reader->page_ids[frame], reader->buffers[frame], false);
+        reader->completion_count += 1;
+    }
+    reader->sq_local_tail = head;
+    __atomic_store_n(reader->sq_tail, head, __ATOMIC_RELEASE);
+    reader->unsubmitted = 0;
+}
+#endif
+
+// Creates the asynchronous reader of a tree with frames buffer pool frames, preferring io_uring over reader threads
+static struct page_reader* page_reader_start(DISK_R_TREE tree) {
+    struct page_reader* reader = (struct page_reader *)calloc(1, sizeof(struct page_reader));
+    reader->fd = tree->fd;
+    reader->depth = DISK_READ_DEPTH;
+    reader->page_ids = (unsigned int *)calloc(tree->num_frames, sizeof(unsigned int));
+    reader->buffers = (unsigned char **)malloc(sizeof(unsigned char *) * tree->num_frames);
+    for (int i = 0; i < tree->num_frames; ++i)
+        reader->buffers[i] = tree->frames[i].data;
+    reader->requests = (int *)malloc(sizeof(int) * reader->depth);
+    reader->completions = (int *)malloc(sizeof(int) * reader->depth);
+    reader->results = (bool *)malloc(sizeof(bool) * reader->depth);
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->requested, NULL);
+    pthread_cond_init(&reader->completed, NULL);
+#ifdef HAVE_IO_URING
+    if (io_uring_start(reader))
+        return reader;
+#endif
+#ifndef _WIN32
+    // Windows reads seek the shared descriptor, so they stay inline there
+    reader->num_threads = DISK_READ_THREADS;
+    reader->threads = (pthread_t *)malloc(sizeof(pthread_t) * reader->num_threads);
+    for (int i = 0; i < reader->num_threads; ++i)
+        pthread_create(&reader->threads[i], NULL, page_reader_thread, reader);
+#endif
+    return reader;
+}
+
+// Queues a read of page_id into frame; page_reader_flush hands the queued reads over together
+static void page_reader_queue(struct page_reader* reader, int frame, unsigned int page_id) {
+    reader->page_ids[frame] = page_id;
+    reader->in_flight += 1;
+#ifdef HAVE_IO_URING
+    if (reader->ring_fd >= 0) {
+        unsigned index = reader->sq_local_tail & *reader->sq_mask;
+        struct io_uring_sqe* sqe = &reader->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = reader->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)reader->buffers[frame];
+        sqe->len = DISK_PAGE_SIZE;
+        sqe->off = (unsigned long long)page_id * DISK_PAGE_SIZE;
+        sqe->user_data = (unsigned long long)frame;
+        reader->sq_array[index] = index;
+        reader->sq_local_tail += 1;
+        reader->unsubmitted += 1;
+        return;
+    }
+#endif
+    pthread_mutex_lock(&reader->lock);
+    reader->requests[(reader->request_head + reader->request_count) % reader->depth] = frame;
+    reader->request_count += 1;
+    reader->unsubmitted += 1;
+    pthread_mutex_unlock(&reader->lock);
+}
+
+// Submits every queued read with a single system call or wakeup
+static void page_reader_flush(struct page_reader* reader) {
+    if (reader->unsubmitted == 0)
+        return;
+#ifdef HAVE_IO_URING
+    if (reader->ring_fd >= 0) {
+        // Publish only the entries written since the last flush; earlier ones the kernel did not take are already published
+        __atomic_store_n(reader->sq_tail, reader->sq_local_tail, __ATOMIC_RELEASE);
+        // EAGAIN and EBUSY mean the kernel is short of resources or completions for now, page_reader_reap submits again while
+        // waiting. Any other error will not go away, so the reads are done here instead.
+        if (!io_uring_submit(reader, 0) && errno != EAGAIN && errno != EBUSY)
+            io_uring_complete_inline(reader);
+        return;
+    }
+#endif
+    reader->unsubmitted = 0;
+    if (reader->num_threads > 0) {
+        pthread_mutex_lock(&reader->lock);
+        pthread_cond_broadcast(&reader->requested);
+        pthread_mutex_unlock(&reader->lock);
+        return;
+    }
+    // No threads: perform the reads inline, completing them in order
+    while (reader->request_count > 0) {
+        int frame = reader->requests[reader->request_head];
+        reader->request_head = (reader->request_head + 1) % reader->depth;
+        reader->request_count -= 1;
+        int slot = (reader->completion_head + reader->completion_count) % reader->depth;
+        reader->completions[slot] = frame;
+        reader->results[slot] = page_io(reader->fd, reader->page_ids[frame], reader->buffers[frame], false);
+        reader->completion_count += 1;
+    }
+}
+
+// Waits for any outstanding read to complete and returns its frame; ok tells whether the page was read in full
+static int page_reader_reap(struct page_reader* reader, bool* ok) {
+    page_reader_flush(reader);
+    int frame;
+#ifdef HAVE_IO_URING
+    if (reader->ring_fd >= 0) {
+        unsigned head = *reader->cq_head;
+        while (reader->completion_count == 0 && head == __atomic_load_n(reader->cq_tail, __ATOMIC_ACQUIRE)) {
+            // Only wait for a completion if the kernel holds a read; otherwise a failed submit would block forever
+            bool kernel_reads = reader->in_flight > reader->unsubmitted;
+            int unsubmitted = reader->unsubmitted;
+            if (io_uring_submit(reader, kernel_reads ? 1 : 0) && (kernel_reads || reader->unsubmitted < unsubmitted))
+                continue;
+            if ((errno == EAGAIN || errno == EBUSY) && kernel_reads && io_uring_submit(reader, 1))
+                continue;
+            io_uring_complete_inline(reader);
+        }
+        if (reader->completion_count > 0) {
+            frame = reader->completions[reader->completion_head];
+            *ok = reader->results[reader->completion_head];
+            reader->completion_head = (reader->completion_head + 1) % reader->depth;
+            reader->completion_count -= 1;
+            reader->in_flight -= 1;
+            return frame;
+        }
+        struct io_uring_cqe* cqe = &reader->cqes[head & *reader->cq_mask];
+        frame = (int)cqe->user_data;
+        *ok = cqe->res == DISK_PAGE_SIZE;
+        __atomic_store_n(reader->cq_head, head + 1, __ATOMIC_RELEASE);
+        // Short or rejected reads (e.g. kernels without IORING_OP_READ) are retried synchronously
+        if (!*ok)
+            *ok = page_io(reader->fd, reader->page_ids[frame], reader->buffers[frame], false);
+        reader->in_flight -= 1;
+        return frame;
+    }
+#endif
+    pthread_mutex_lock(&reader->lock);
+    while (reader->completion_count == 0)
+        pthread_cond_wait(&reader->completed, &reader->lock);
+    frame = reader->completions[reader->completion_head];
+    *ok = reader->results[reader->completion_head];
+    reader->completion_head = (reader->completion_head + 1) % reader->depth;
+    reader->completion_count -= 1;
+    pthread_mutex_unlock(&reader->lock);
+    reader->in_flight -= 1;
+    return frame;
+}
+
+// Stops the reader threads or tears down the ring; no reads may be outstanding
+static void page_reader_stop(struct page_reader* reader) {
+#ifdef HAVE_IO_URING
+    if (reader->ring_fd >= 0) {
+        munmap(reader->sq_ring, reader->sq_ring_size);
+        munmap(reader->cq_ring, reader->cq_ring_size);
+        munmap(reader->sqes, reader->sqes_size);
+        close(reader->ring_fd);
+    }
+#endif
+    pthread_mutex_lock(&reader->lock);
+    reader->stopping = true;
+    pthread_cond_broadcast(&reader->requested);
+    pthread_mutex_unlock(&reader->lock);
+    for (int i = 0; i < reader->num_threads; ++i)
+        pthread_join(reader->threads[i], NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->requested);
+    pthread_cond_destroy(&reader->completed);
+    free(reader->threads);
+    free(reader->page_ids);
+    free(reader->buffers);
+    free(reader->requests);
+    free(reader->completions);
+    free(reader->results);
+    free(reader);
+}
+
+// Returns the frame holding a page, or -1 if it is not cached
+static int pool_lookup(DISK_R_TREE tree, unsigned int page_id) {
+    int frame = tree->buckets[page_id % tree->num_buckets];
+    while (frame != -1 && tree->frames[frame].page_id != page_id)
+        frame = tree->frames[frame].next;
+    return frame;
+}
+
+// Removes a frame from its hash bucket
+static void pool_unlink(DISK_R_TREE tree, int frame) {
+    int* link = &tree->buckets[tree->frames[frame].page_id % tree->num_buckets];
+    while (*link != frame)
+        link = &tree->frames[*link].next;
+    *link = tree->frames[frame].next;
+}
+
+// Writes a dirty frame back to the file
+static bool pool_write_back(DISK_R_TREE tree, int frame) {
+    struct buffer_frame* f = &tree->frames[frame];
+    if (!f->valid || !f->dirty)
+        return true;
+    if (!page_io(tree->fd, f->page_id, f->data, true))
+        return false;
+    f->dirty = false;
+    ++tree->writes;
+    return true;
+}
+
+// Returns a free frame for page_id, pinned once and evicting an unpinned page chosen by CLOCK; -1 if every frame is pinned
+static int pool_claim(DISK_R_TREE tree, unsigned int page_id) {
+    for (int step = 0; step < 2 * tree->num_frames; ++step) {
+        int frame = tree->hand;
+        struct buffer_frame* f = &tree->frames[frame];
+        tree->hand = (tree->hand + 1) % tree->num_frames;
+        if (f->valid && (f->pin_count > 0 || f->referenced)) {
+            f->referenced = false;
+            continue;
+        }
+        if (f->valid) {
+            if (!pool_write_back(tree, frame))
+                return -1;
+            pool_unlink(tree, frame);
+        }
+        f->page_id = page_id;
+        f->valid = true;
+        f->dirty = false;
+        f->types_interned = false;
+        f->referenced = true;
+        f->pin_count = 1;
+        f->next = tree->buckets[page_id % tree->num_buckets];
+        tree->buckets[page_id % tree->num_buckets] = frame;
+        return frame;
+    }
+    return -1;
+}
+
+// Completes a reaped asynchronous read: the frame becomes usable, or failed if the page could not be read
+static void complete_page_read(DISK_R_TREE tree, int frame, bool ok) {
+    tree->frames[frame].loading = false;
+    tree->frames[frame].failed = !ok;
+}
+
+// Unpins a frame, marking it dirty if the caller modified it; a failed frame is dropped once no one holds it
+static void unpin_frame(DISK_R_TREE tree, int frame, bool dirty) {
+    struct buffer_frame* f = &tree->frames[frame];
+    f->pin_count -= 1;
+    f->dirty = f->dirty || dirty;
+    f->types_interned = f->types_interned && !dirty;
+    if (f->failed && f->pin_count == 0) {
+        pool_unlink(tree, frame);
+        f->valid = false;
+        f->failed = false;
+    }
+}
+
+// Pins a page in the buffer pool, reading it on a miss or waiting for its outstanding read; returns NULL if it cannot be read
+static struct disk_page* pin_page(DISK_R_TREE tree, unsigned int page_id) {
+    int frame = pool_lookup(tree, page_id);
+    if (frame != -1) {
+        ++tree->hits;
+        tree->frames[frame].pin_count += 1;
+        tree->frames[frame].referenced = true;
+        while (tree->frames[frame].loading) {
+            bool ok;
+            int done = page_reader_reap(tree->reader, &ok);
+            complete_page_read(tree, done, ok);
+        }
+        if (tree->frames[frame].failed) {
+            unpin_frame(tree, frame, false);
+            return NULL;
+        }
+        return (struct disk_page *)tree->frames[frame].data;
+    }
+    ++tree->misses;
+    frame = pool_claim(tree, page_id);
+    if (frame == -1) {
+        fprintf(stderr, "Buffer pool exhausted: all %d frames are pinned\n", tree->num_frames);
+        return NULL;
+    }
+    if (!page_io(tree->fd, page_id, tree->frames[frame].data, false)) {
+        pool_unlink(tree, frame);
+        tree->frames[frame].valid = false;
+        return NULL;
+    }
+    return (struct disk_page *)tree->frames[frame].data;
+}
+
+// Unpins a page, marking it dirty if the caller modified it
+static void unpin_page(DISK_R_TREE tree, unsigned int page_id, bool dirty) {
+    unpin_frame(tree, pool_lookup(tree, page_id), dirty);
+}
+
+// Starts reading a page into the pool without waiting for it. Returns its frame pinned for the caller, possibly still loading,
+// or -1 if the reader already has DISK_READ_DEPTH reads in flight or every frame is pinned.
+static int prefetch_page(DISK_R_TREE tree, unsigned int page_id) {
+    int frame = pool_lookup(tree, page_id);
+    if (frame != -1) {
+        ++tree->hits;
+        tree->frames[frame].pin_count += 1;
+        tree->frames[frame].referenced = true;
+        return frame;
+    }
+    if (tree->reader->in_flight >= tree->reader->depth)
+        return -1;
+    frame = pool_claim(tree, page_id);
+    if (frame == -1)
+        return -1;
+    ++tree->misses;
+    tree->frames[frame].loading = true;
+    page_reader_queue(tree->reader, frame, page_id);
+    return frame;
+}
+
+// Drops the pin taken by prefetch_page, first waiting for the read if it is still outstanding
+static void drop_prefetch(DISK_R_TREE tree, unsigned int page_id) {
+    int frame = pool_lookup(tree, page_id);
+    while (tree->frames[frame].loading) {
+        bool ok;
+        int done = page_reader_reap(tree->reader, &ok);
+        complete_page_read(tree, done, ok);
+    }
+    unpin_frame(tree, frame, false);
+}
+
+// Allocates an empty page at the end of the file and returns it pinned and dirty
+static struct disk_page* allocate_page(DISK_R_TREE tree, bool is_leaf, unsigned int* page_id) {
+    *page_id = tree->header.num_pages;
+    int frame = pool_claim(tree, *page_id);
+    if (frame == -1) {
+        fprintf(stderr, "Buffer pool exhausted: all %d frames are pinned\n", tree->num_frames);
+        return NULL;
+    }
+    tree->header.num_pages += 1;
+    tree->header_dirty = true;
+    tree->frames[frame].dirty = true;
+    memset(tree->frames[frame].data, 0, DISK_PAGE_SIZE);
+    struct disk_page* page = (struct disk_page *)tree->frames[frame].data;
+    page->is_leaf = is_leaf;
+    return page;
+}
+
+// Enlarges box to include rect
+static void extend_rect(RECT box, RECT rect) {
+    box->min_x = rect->min_x < box->min_x ? rect->min_x : box->min_x;
+    box->min_y = rect->min_y < box->min_y ? rect->min_y : box->min_y;
+    box->max_x = rect->max_x > box->max_x ? rect->max_x : box->max_x;
+    box->max_y = rect->max_y > box->max_y ? rect->max_y : box->max_y;
+}
+
+// Calculates the bounding rectangle of all entries of a page
+static struct rectangle page_bounding_box(struct disk_page* page) {
+    struct rectangle box = page->entries[0].region;
+    for (int i = 1; i < page->count; ++i)
+        extend_rect(&box, &page->entries[i].region);
+    return box;
+}
+
+// Selects the entry of an internal page which requires minimum enlargement to include rect, ties going to the smaller area
+static int disk_choose_subtree(struct disk_page* page, RECT rect) {
+    int best = 0;
+    long long best_increase = LLONG_MAX, best_area = LLONG_MAX;
+    for (int i = 0; i < page->count; ++i) {
+        long long increase = increase_in_area(&page->entries[i].region, rect);
+        long long area = area_rect(&page->entries[i].region);
+        if (increase < best_increase || (increase == best_increase && area < best_area)) {
+            best = i;
+            best_increase = increase;
+            best_area = area;
+        }
+    }
+    return best;
+}
+
+// Splits the full page plus one extra entry between page and the empty sibling using the quadratic split
+static void disk_quadratic_split(struct disk_page* page, struct disk_entry* extra, struct disk_page* sibling) {
+    int total = page->count + 1;
+    struct disk_entry* all = (struct disk_entry *)malloc(sizeof(struct disk_entry) * total);
+    memcpy(all, page->entries, sizeof(struct disk_entry) * page->count);
+    all[total - 1] = *extra;
+    bool* assigned = (bool *)calloc(total, sizeof(bool));
+
+    // QS1: Pick the pair of entries wasting the most area when grouped together as seeds
+    int seed1 = 0, seed2 = 1;
+    long long worst = LLONG_MIN;
+    for (int i = 0; i < total; ++i) {
+        for (int j = i + 1; j < total; ++j) {
+            long long waste = increase_in_area(&all[i].region, &all[j].region) - area_rect(&all[j].region);
+            if (waste > worst) {
+                worst = waste;
+                seed1 = i;
+                seed2 = j;
+            }
+        }
+    }
+    page->count = 0;
+    sibling->count = 0;
+    page->entries[page->count++] = all[seed1];
+    sibling->entries[sibling->count++] = all[seed2];
+    assigned[seed1] = assigned[seed2] = true;
+    struct rectangle box1 = all[seed1].region, box2 = all[seed2].region;
+
+    for (int remaining = total - 2; remaining > 0; --remaining) {
+        // QS2: If one group needs all remaining entries to reach the minimum, it gets them
+        struct disk_page* target = NULL;
+        if (page->count + remaining == DISK_MIN_ENTRIES)
+            target = page;
+        else if (sibling->count + remaining == DISK_MIN_ENTRIES)
+            target = sibling;
+
+        // QS3: Pick the entry with the greatest preference for one group
+        int next = -1;
+        long long best_difference = -1, d1 = 0, d2 = 0;
+        for (int i = 0; i < total; ++i) {
+            if (assigned[i])
+                continue;
+            long long e1 = increase_in_area(&box1, &all[i].region);
+            long long e2 = increase_in_area(&box2, &all[i].region);
+            long long difference = e1 > e2 ? e1 - e2 : e2 - e1;
+            if (difference > best_difference) {
+                best_difference = difference;
+                next = i;
+                d1 = e1;
+                d2 = e2;
+            }
+        }
+        if (target == NULL) {
+            if (d1 != d2)
+                target = d1 < d2 ? page : sibling;
+            else if (area_rect(&box1) != area_rect(&box2))
+                target = area_rect(&box1) < area_rect(&box2) ? page : sibling;
+            else
+                target = page->count <= sibling->count ? page : sibling;
+        }
+        target->entries[target->count++] = all[next];
+        assigned[next] = true;
+        struct rectangle* box = target == page ? &box1 : &box2;
+        extend_rect(box, &all[next].region);
+    }
+    free(all);
+    free(assigned);
+}
+
+// Opens the disk-resident R-Tree stored at path, creating an empty one if the file is missing or empty.
+// memory_budget is the size in bytes of the buffer pool. Returns NULL if the file cannot be opened or is not a tree.
+DISK_R_TREE disk_r_tree_open(const char* path, size_t memory_budget) {
+    int fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0)
+        return NULL;
+    DISK_R_TREE tree = (DISK_R_TREE)calloc(1, sizeof(struct disk_r_tree));
+    tree->fd = fd;
+    tree->num_frames = (int)(memory_budget / DISK_PAGE_SIZE);
+    if (tree->num_frames < DISK_MIN_FRAMES)
+        tree->num_frames = DISK_MIN_FRAMES;
+    tree->frames = (struct buffer_frame *)calloc(tree->num_frames, sizeof(struct buffer_frame));
+    tree->memory = (unsigned char *)malloc((size_t)tree->num_frames * DISK_PAGE_SIZE);
+    tree->type_ids = (int *)malloc(sizeof(int) * (size_t)tree->num_frames * DISK_MAX_ENTRIES);
+    for (int i = 0; i < tree->num_frames; ++i) {
+        tree->frames[i].data = tree->memory + (size_t)i * DISK_PAGE_SIZE;
+        tree->frames[i].type_ids = tree->type_ids + (size_t)i * DISK_MAX_ENTRIES;
+    }
+    tree->num_buckets = tree->num_frames * 2 + 1;
+    tree->buckets = (int *)malloc(sizeof(int) * tree->num_buckets);
+    for (int i = 0; i < tree->num_buckets; ++i)
+        tree->buckets[i] = -1;
+    tree->reader = page_reader_start(tree);
+
+    unsigned char header_page[DISK_PAGE_SIZE];
+    if (page_io(fd, 0, header_page, false)) {
+        memcpy(&tree->header, header_page, sizeof(struct disk_header));
+        if (memcmp(tree->header.magic, DISK_MAGIC, 8) != 0 || tree->header.page_size != DISK_PAGE_SIZE) {
+            fprintf(stderr, "%s is not a disk R-Tree with %d byte pages\n", path, DISK_PAGE_SIZE);
+            tree->header_dirty = false;
+            disk_r_tree_close(tree);
+            return NULL;
+        }
+        return tree;
+    }
+
+    // New tree: the header followed by an empty root leaf
+    memcpy(tree->header.magic, DISK_MAGIC, 8);
+    tree->header.page_size = DISK_PAGE_SIZE;
+    tree->header.num_pages = 1;
+    allocate_page(tree, true, &tree->header.root);
+    unpin_page(tree, tree->header.root, true);
+    disk_r_tree_flush(tree);
+    return tree;
+}
+
+// Writes every dirty page and the header to the file and syncs it
+bool disk_r_tree_flush(DISK_R_TREE tree) {
+    bool ok = true;
+    for (int i = 0; i < tree->num_frames; ++i)
+        ok = pool_write_back(tree, i) && ok;
+    if (tree->header_dirty) {
+        unsigned char header_page[DISK_PAGE_SIZE];
+        memset(header_page, 0, DISK_PAGE_SIZE);
+        memcpy(header_page, &tree->header, sizeof(struct disk_header));
+        ok = page_io(tree->fd, 0, header_page, true) && ok;
+        tree->header_dirty = !ok;
+    }
+    return fsync(tree->fd) == 0 && ok;
+}
+
+// Flushes and closes the tree, freeing the buffer pool
+bool disk_r_tree_close(DISK_R_TREE tree) {
+    bool ok = disk_r_tree_flush(tree);
+    page_reader_stop(tree->reader);
+    ok = close(tree->fd) == 0 && ok;
+    free(tree->frames);
+    free(tree->memory);
+    free(tree->type_ids);
+    free(tree->buckets);
+    free(tree);
+    return ok;
+}
+
+// Inserts a point object into the disk-resident R-Tree
+bool disk_insert_in_r_tree(DISK_R_TREE tree, OBJ object) {
+    struct rectangle point = {object->x, object->y, object->x, object->y};
+    return disk_insert_rect_in_r_tree(tree, object, &point);
+}
+
+// Inserts a copy of the object with bounding rectangle obj_rect, splitting pages on the way back up the path as needed
+bool disk_insert_rect_in_r_tree(DISK_R_TREE tree, OBJ object, RECT obj_rect) {
+    unsigned int path[DISK_MAX_HEIGHT + 1];
+    struct disk_page* pages[DISK_MAX_HEIGHT + 1];
+    int slots[DISK_MAX_HEIGHT + 1];
+
+    // Descend to a leaf, keeping the path pinned
+    int depth = 0;
+    path[0] = tree->header.root;
+    while (true) {
+        pages[depth] = pin_page(tree, path[depth]);
+        if (pages[depth] == NULL) {
+            while (--depth >= 0)
+                unpin_page(tree, path[depth], false);
+            return false;
+        }
+        if (pages[depth]->is_leaf)
+            break;
+        slots[depth] = disk_choose_subtree(pages[depth], obj_rect);
+        path[depth + 1] = pages[depth]->entries[slots[depth]].child;
+        ++depth;
+    }
+
+    struct disk_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.region = *obj_rect;
+    entry.x = object->x;
+    entry.y = object->y;
+    memcpy(entry.type, object->type, MAX_TYPE_LEN - 1);
+
+    // Place the entry at the leaf and propagate splits and enlarged MBRs up the path
+    bool pending = true;
+    bool ok = true;
+    for (int level = depth; level >= 0; --level) {
+        struct disk_page* page = pages[level];
+        unsigned int sibling_id = 0;
+        struct disk_page* sibling = NULL;
+        if (pending) {
+            if (page->count < DISK_MAX_ENTRIES) {
+                page->entries[page->count++] = entry;
+            } else {
+                sibling = allocate_page(tree, page->is_leaf, &sibling_id);
+                if (sibling == NULL) {
+                    ok = false;
+                    pending = false;
+                } else {
+                    disk_quadratic_split(page, &entry, sibling);
+                }
+            }
+            pending = false;
+        }
+
+        struct rectangle box = page_bounding_box(page);
+        if (sibling != NULL) {
+            memset(&entry, 0, sizeof(entry));
+            entry.region = page_bounding_box(sibling);
+            entry.child = sibling_id;
+            pending = true;
+            unpin_page(tree, sibling_id, true);
+        }
+        if (level > 0) {
+            pages[level - 1]->entries[slots[level - 1]].region = box;
+        } else if (pending) {
+            // Root was split, grow the tree by one level
+            unsigned int root_id;
+            struct disk_page* root = allocate_page(tree, false, &root_id);
+            if (root == NULL) {
+                ok = false;
+            } else {
+                root->entries[0].region = box;
+                root->entries[0].child = path[0];
+                root->entries[1] = entry;
+                root->count = 2;
+                unpin_page(tree, root_id, true);
+                tree->header.root = root_id;
+                tree->header.height += 1;
+            }
+        }
+        unpin_page(tree, path[level], true);
+    }
+    if (ok) {
+        tree->header.count += 1;
+        tree->header_dirty = true;
+    }
+    return ok;
+}
+
+// Copies the object of a leaf entry out of its page
+static void disk_entry_object(struct disk_entry* entry, int type_id, struct object* object) {
+    object->x = entry->x;
+    object->y = entry->y;
+    memcpy(object->type, entry->type, MAX_TYPE_LEN);
+    object->type_id = type_id;
+}
+
+// Returns the interned types of the entries of a pinned leaf page. They are interned once after the page is read or modified,
+// taking the type lock once per run of equal types, so queries do not contend on it for every object they decode.
+static const int* frame_type_ids(DISK_R_TREE tree, int frame) {
+    struct buffer_frame* f = &tree->frames[frame];
+    if (!f->types_interned) {
+        struct disk_page* page = (struct disk_page *)f->data;
+        for (int i = 0; i < page->count; ++i)
+            f->type_ids[i] = i > 0 && strncmp(page->entries[i].type, page->entries[i - 1].type, MAX_TYPE_LEN) == 0 ?
+                             f->type_ids[i - 1] : intern_type(page->entries[i].type);
+        f->types_interned = true;
+    }
+    return f->type_ids;
+}
+
+// Stores a window or radius query over the disk-resident R-Tree
+struct disk_query
+{
+    bool radius_query;
+    RECT window;
+    enum window_predicate predicate;
+    int user_x;
+    int user_y;
+    double radius;
+};
+
+// Checks whether an entry of a leaf or internal page qualifies for the query
+static bool disk_query_matches(struct disk_query* query, struct disk_entry* entry, bool is_leaf) {
+    if (query->radius_query)
+        return min_distance_to_rect(&entry->region, query->user_x, query->user_y) <= query->radius;
+    if (is_leaf)
+        return window_matches(&entry->region, query->window, query->predicate);
+    return query->predicate == WINDOW_CONTAINS ? rect_contains(&entry->region, query->window) : rect_intersects(&entry->region, query->window);
+}
+
+// Runs a window or radius query, submitting reads for all qualifying children of a page at once and scanning pages in the order
+// their reads complete. At most half of the buffer pool is pinned by the query at any time. Returns false, with the results
+// found so far, if a page could not be read.
+static bool disk_range_query(DISK_R_TREE tree, struct disk_query* query, struct object found_objects[], int max_found, int* num_found) {
+    bool complete = true;
+    int pin_limit = tree->num_frames / 2;
+    int capacity = 64, num_waiting = 0, num_ready = 0, outstanding = 0;
+    unsigned int* waiting = (unsigned int *)malloc(sizeof(unsigned int) * capacity);   // Pages to visit whose reads are not started
+    int* ready = (int *)malloc(sizeof(int) * pin_limit);                                // Pinned frames holding pages to scan
+    waiting[num_waiting++] = tree->header.root;
+
+    while (*num_found < max_found) {
+        // Start reading as many waiting pages as the read depth and the pin limit allow
+        while (num_waiting > 0 && num_ready + outstanding < pin_limit) {
+            int frame = prefetch_page(tree, waiting[num_waiting - 1]);
+            if (frame == -1)
+                break;
+            --num_waiting;
+            if (tree->frames[frame].loading)
+                ++outstanding;
+            else
+                ready[num_ready++] = frame;
+        }
+        page_reader_flush(tree->reader);
+
+        int frame;
+        if (num_ready > 0) {
+            frame = ready[--num_ready];
+        } else if (outstanding > 0) {
+            bool ok;
+            frame = page_reader_reap(tree->reader, &ok);
+            complete_page_read(tree, frame, ok);
+            --outstanding;
+        } else if (num_waiting > 0) {
+            // Nothing in flight and no frame to read into, fall back to a synchronous read
+            unsigned int page_id = waiting[--num_waiting];
+            if (pin_page(tree, page_id) == NULL) {
+                complete = false;
+                break;
+            }
+            frame = pool_lookup(tree, page_id);
+        } else {
+            break;
+        }
+
+        if (tree->frames[frame].failed) {
+            unpin_frame(tree, frame, false);
+            complete = false;
+            break;
+        }
+        struct disk_page* page = (struct disk_page *)tree->frames[frame].data;
+        const int* type_ids = page->is_leaf ? frame_type_ids(tree, frame) : NULL;
+        for (int i = 0; i < page->count && *num_found < max_found; ++i) {
+            struct disk_entry* entry = &page->entries[i];
+            if (!disk_query_matches(query, entry, page->is_leaf))
+                continue;
+            if (page->is_leaf) {
+                disk_entry_object(entry, type_ids[i], &found_objects[(*num_found)++]);
+                continue;
+            }
+            if (num_waiting == capacity) {
+                capacity *= 2;
+                waiting = (unsigned int *)realloc(waiting, sizeof(unsigned int) * capacity);
+            }
+            waiting[num_waiting++] = entry->child;
+        }
+        unpin_frame(tree, frame, false);
+    }
+
+    // Release the pages still pinned once the result is full or a read failed
+    while (num_ready > 0)
+        unpin_frame(tree, ready[--num_ready], false);
+    while (outstanding-- > 0) {
+        bool ok;
+        int frame = page_reader_reap(tree->reader, &ok);
+        complete_page_read(tree, frame, ok);
+        unpin_frame(tree, frame, false);
+    }
+    free(waiting);
+    free(ready);
+    return complete;
+}
+
+// Search for objects whose rectangles satisfy the predicate against the window, copying at most max_found of them.
+// Returns false if a page could not be read, in which case the results are incomplete.
+bool disk_search_window(DISK_R_TREE tree, RECT window, enum window_predicate predicate, struct object found_objects[], int max_found, int* num_found) {
+    struct disk_query query = {false, window, predicate, 0, 0, 0.0};
+    return disk_range_query(tree, &query, found_objects, max_found, num_found);
+}
+
+// Search for objects within the radius of the user's location, copying at most max_found of them.
+// Returns false if a page could not be read, in which case the results are incomplete.
+bool disk_search_radius(DISK_R_TREE tree, int user_x, int user_y, double radius, struct object found_objects[], int max_found, int* num_found) {
+    struct disk_query query = {true, NULL, WINDOW_INTERSECTS, user_x, user_y, radius};
+    return disk_range_query(tree, &query, found_objects, max_found, num_found);
+}
+
+// Stores an entry of the best-first queue of the disk nearest neighbour search: a page still to be read, or a copied object
+struct disk_nn_entry
+{
+    double distance;
+    unsigned int page_id;        // 0 if the entry is an object
+    bool prefetched;             // The page's read was started and holds a pin
+    struct object object;
+};
+
+// Adds an entry to the min-heap of the disk nearest neighbour search
+static void disk_nn_push(struct disk_nn_entry** heap, int* size, int* capacity, struct disk_nn_entry entry) {
+    if (*size == *capacity) {
+        *capacity *= 2;
+        *heap = (struct disk_nn_entry *)realloc(*heap, sizeof(struct disk_nn_entry) * (*capacity));
+    }
+    int i = (*size)++;
+    while (i > 0 && (*heap)[(i - 1) / 2].distance > entry.distance) {
+        (*heap)[i] = (*heap)[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    (*heap)[i] = entry;
+}
+
+// Removes and returns the closest entry of the min-heap
+static struct disk_nn_entry disk_nn_pop(struct disk_nn_entry* heap, int* size) {
+    struct disk_nn_entry top = heap[0];
+    struct disk_nn_entry last = heap[--(*size)];
+    int i = 0;
+    while (2 * i + 1 < *size) {
+        int child = 2 * i + 1;
+        if (child + 1 < *size && heap[child + 1].distance < heap[child].distance)
+            ++child;
+        if (heap[child].distance >= last.distance)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// Finds the K nearest objects to the user's location by best-first search, closest first. Returns the number found.
+// Only the pages whose MBR is closer than the K-th neighbour are ever read. When a page is expanded, reads of all its children
+// that can still hold one of the K nearest objects are started at once, so they are usually cached when the search reaches them.
+// Returns -1 if a page could not be read, since the objects found might then not be the nearest. distances may be NULL.
+int disk_find_k_nearest_neighbors(DISK_R_TREE tree, int user_x, int user_y, int K, struct object neighbors[], double distances[]) {
+    int size = 0, capacity = 64, found = 0;
+    struct disk_nn_entry* heap = (struct disk_nn_entry *)malloc(sizeof(struct disk_nn_entry) * capacity);
+    struct disk_nn_entry start = {0.0, tree->header.root, false, {0, 0, "", 0}};
+    disk_nn_push(&heap, &size, &capacity, start);
+
+    // Smallest object distances queued so far; the K-th bounds the distance of pages worth reading
+    double* bound = (double *)malloc(sizeof(double) * (K > 0 ? K : 1));
+    int num_bound = 0;
+    int pinned = 0, pin_limit = tree->num_frames / 2;
+
+    while (size > 0 && found < K) {
+        struct disk_nn_entry top = disk_nn_pop(heap, &size);
+        if (top.page_id == 0) {
+            neighbors[found] = top.object;
+            if (distances != NULL)
+                distances[found] = top.distance;
+            ++found;
+            continue;
+        }
+        struct disk_page* page = pin_page(tree, top.page_id);
+        if (top.prefetched) {
+            drop_prefetch(tree, top.page_id);
+            --pinned;
+        }
+        if (page == NULL) {
+            found = -1;
+            break;
+        }
+        const int* type_ids = page->is_leaf ? frame_type_ids(tree, pool_lookup(tree, top.page_id)) : NULL;
+        for (int i = 0; i < page->count; ++i) {
+            struct disk_nn_entry entry;
+            entry.distance = min_distance_to_rect(&page->entries[i].region, user_x, user_y);
+            entry.page_id = page->is_leaf ? 0 : page->entries[i].child;
+            entry.prefetched = false;
+            if (page->is_leaf) {
+                disk_entry_object(&page->entries[i], type_ids[i], &entry.object);
+                // Keep the K smallest distances in ascending order
+                if (num_bound < K || entry.distance < bound[K - 1]) {
+                    int j = num_bound < K ? num_bound++ : K - 1;
+                    while (j > 0 && bound[j - 1] > entry.distance) {
+                        bound[j] = bound[j - 1];
+                        --j;
+                    }
+                    bound[j] = entry.distance;
+                }
+            } else if ((num_bound < K || entry.distance <= bound[K - 1]) && pinned < pin_limit) {
+                entry.prefetched = prefetch_page(tree, entry.page_id) != -1;
+                pinned += entry.prefetched;
+            }
+            disk_nn_push(&heap, &size, &capacity, entry);
+        }
+        page_reader_flush(tree->reader);
+        unpin_page(tree, top.page_id, false);
+    }
+
+    // Release the reads started for pages the search did not reach
+    for (int i = 0; i < size; ++i)
+        if (heap[i].prefetched)
+            drop_prefetch(tree, heap[i].page_id);
+    free(bound);
+    free(heap);
+    return found;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Frozen R-Tree
+//
+// r_tree_freeze compacts a tree that will no longer change into one contiguous block. Nodes are laid out breadth-first, so the
+// children of a node are consecutive and a 32-bit index of the first one replaces the children pointers; there are no parent or
+// name fields and no separately allocated rectangles. Objects are copied into the same block, leaf by leaf, which makes the block
+// position independent and lets it be written to and read from a file as is. Query results point into the block.
+
+#define FROZEN_MAGIC "RTFRZ1"
+
+// Allocates the block of a frozen tree for the given number of nodes and objects
+static FROZEN_R_TREE frozen_allocate(int num_nodes, int num_objects) {
+    FROZEN_R_TREE frozen = (FROZEN_R_TREE)malloc(sizeof(struct frozen_r_tree));
+    frozen->num_nodes = num_nodes;
+    frozen->num_objects = num_objects;
+    frozen->block_size = sizeof(struct frozen_node) * num_nodes + sizeof(struct object) * num_objects;
+    frozen->block = malloc(frozen->block_size > 0 ? frozen->block_size : 1);
+    frozen->nodes = (struct frozen_node *)frozen->block;
+    frozen->objects = (struct object *)(frozen->nodes + num_nodes);
+    return frozen;
+}
+
+// Counts the nodes and objects of a subtree
+static void frozen_count(NODE node, int* num_nodes, int* num_objects) {
+    *num_nodes += 1;
+    if (node->is_leaf) {
+        *num_objects += node->count;
+        return;
+    }
+    for (int i = 0; i < node->count; ++i)
+        frozen_count(node->children[i], num_nodes, num_objects);
+}
+
+// Compacts the tree into a frozen, read-only copy; the tree itself is left unchanged
+FROZEN_R_TREE r_tree_freeze(R_TREE r_tree) {
+    int num_nodes = 0, num_objects = 0;
+    frozen_count(r_tree->root, &num_nodes, &num_objects);
+    FROZEN_R_TREE frozen = frozen_allocate(num_nodes, num_objects);
+
+    // Breadth-first: the queue doubles as the map from frozen index to source node
+    NODE* queue = (NODE *)malloc(sizeof(NODE) * num_nodes);
+    int tail = 1, next_object = 0;
+    queue[0] = r_tree->root;
+    for (int head = 0; head < num_nodes; ++head) {
+        NODE node = queue[head];
+        struct frozen_node* fnode = &frozen->nodes[head];
+        memset(fnode, 0, sizeof(struct frozen_node));
+        fnode->is_leaf = node->is_leaf;
+        fnode->count = (unsigned short)node->count;
+        fnode->first = node->is_leaf ? (unsigned int)next_object : (unsigned int)tail;
+        for (int i = 0; i < node->count; ++i) {
+            fnode->regions[i] = *node->regions[i];
+            if (node->is_leaf)
+                frozen->objects[next_object++] = *node->objects[i];
+            else
+                queue[tail++] = node->children[i];
+        }
+    }
+    free(queue);
+    return frozen;
+}
+
+// Frees a frozen tree and its block
+void free_frozen_r_tree(FROZEN_R_TREE frozen) {
+    free(frozen->block);
+    free(frozen);
+}
+
+// Searches the subtree of a frozen node for objects satisfying the predicate against the window
+static void frozen_search_node(FROZEN_R_TREE frozen, int index, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    struct frozen_node* node = &frozen->nodes[index];
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        RECT region = &node->regions[i];
+        if (node->is_leaf) {
+            if (window_matches(region, window, predicate))
+                found_objects[(*num_found)++] = &frozen->objects[node->first + i];
+        } else if (predicate == WINDOW_CONTAINS ? rect_contains(region, window) : rect_intersects(region, window)) {
+            frozen_search_node(frozen, node->first + i, window, predicate, found_objects, max_found, num_found);
+        }
+    }
+}
+
+// Search for objects whose rectangles satisfy the predicate against the window, storing at most max_found of them
+void frozen_search_window(FROZEN_R_TREE frozen, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    if (frozen->num_nodes > 0)
+        frozen_search_node(frozen, 0, window, predicate, found_objects, max_found, num_found);
+}
+
+// Searches the subtree of a frozen node for objects within radius of the user's location
+static void frozen_radius_node(FROZEN_R_TREE frozen, int index, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
+    struct frozen_node* node = &frozen->nodes[index];
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        if (min_distance_to_rect(&node->regions[i], user_x, user_y) > radius)
+            continue;
+        if (node->is_leaf)
+            found_objects[(*num_found)++] = &frozen->objects[node->first + i];
+        else
+            frozen_radius_node(frozen, node->first + i, user_x, user_y, radius, found_objects, max_found, num_found);
+    }
+}
+
+// Search for objects within the radius of the user's location, storing at most max_found of them
+void frozen_search_radius(FROZEN_R_TREE frozen, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
+    if (frozen->num_nodes > 0)
+        frozen_radius_node(frozen, 0, user_x, user_y, radius, found_objects, max_found, num_found);
+}
+
+// Depth-first branch and bound kNN over a frozen node; children are visited closest first and pruned against the Kth candidate
+static void frozen_knn_node(FROZEN_R_TREE frozen, int index, int user_x, int user_y, int K, OBJ neighbors[], double distances[], int* found) {
+    struct frozen_node* node = &frozen->nodes[index];
+    if (node->is_leaf) {
+        for (int i = 0; i < node->count; ++i) {
+            double d = min_distance_to_rect(&node->regions[i], user_x, user_y);
+            if (*found == K && d >= distances[K - 1])
+                continue;
+            int j = *found < K ? (*found)++ : K - 1;
+            while (j > 0 && distances[j - 1] > d) {
+                neighbors[j] = neighbors[j - 1];
+                distances[j] = distances[j - 1];
+                --j;
+            }
+            neighbors[j] = &frozen->objects[node->first + i];
+            distances[j] = d;
+        }
+        return;
+    }
+
+    double mindist[M];
+    int order[M];
+    for (int i = 0; i < node->count; ++i) {
+        mindist[i] = min_distance_to_rect(&node->regions[i], user_x, user_y);
+        int j = i;
+        while (j > 0 && mindist[order[j - 1]] > mindist[i]) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+    for (int k = 0; k < node->count; ++k) {
+        int i = order[k];
+        if (*found == K && mindist[i] >= distances[K - 1])
+            break;
+        frozen_knn_node(frozen, node->first + i, user_x, user_y, K, neighbors, distances, found);
+    }
+}
+
+// Finds the K nearest neighbours of the user in the frozen tree, closest first; returns how many were found
+int frozen_find_k_nearest_neighbors(FROZEN_R_TREE frozen, int user_x, int user_y, int K, OBJ neighbors[], double distances[]) {
+    int found = 0;
+    if (K <= 0 || frozen->num_nodes == 0)
+        return 0;
+    double * best = distances != NULL ? distances : (double *)malloc(sizeof(double) * K);
+    frozen_knn_node(frozen, 0, user_x, user_y, K, neighbors, best, &found);
+    if (distances == NULL)
+        free(best);
+    return found;
+}
+
+// Writes the frozen tree to a file: a magic, the node and object counts, and the block as is (host byte order)
+bool save_frozen_r_tree(FROZEN_R_TREE frozen, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    char magic[8] = FROZEN_MAGIC;
+    int counts[2] = {frozen->num_nodes, frozen->num_objects};
+    bool ok = fwrite(magic, 1, 8, file) == 8 && fwrite(counts, sizeof(counts), 1, file) == 1 && fwrite(frozen->block, 1, frozen->block_size, file) == frozen->block_size;
+    return fclose(file) == 0 && ok;
+}
+
+// Reads a frozen tree written by save_frozen_r_tree; returns NULL if it is missing or corrupt
+FROZEN_R_TREE load_frozen_r_tree(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    char magic[8];
+    int counts[2];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, FROZEN_MAGIC, 7) != 0 || fread(counts, sizeof(counts), 1, file) != 1 || counts[0] < 0 || counts[1] < 0) {
+        fclose(file);
+        return NULL;
+    }
+    FROZEN_R_TREE frozen = frozen_allocate(counts[0], counts[1]);
+    bool ok = fread(frozen->block, 1, frozen->block_size, file) == frozen->block_size;
+    fclose(file);
+
+    // Type ids are only meaningful within one process
+    for (int i = 0; ok && i < frozen->num_objects; ++i) {
+        frozen->objects[i].type[MAX_TYPE_LEN - 1] = '\0';
+        frozen->objects[i].type_id = intern_type(frozen->objects[i].type);
+    }
+
+    // Reject child and object ranges pointing outside the block
+    for (int i = 0; ok && i < frozen->num_nodes; ++i) {
+        struct frozen_node* node = &frozen->nodes[i];
+        long long end = (long long)node->first + node->count;
+        ok = node->count <= M && (node->is_leaf ? end <= frozen->num_objects : (node->first > (unsigned int)i && end <= frozen->num_nodes));
+    }
+    if (!ok) {
+        free_frozen_r_tree(frozen);
+        return NULL;
+    }
+    return frozen;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Polygon queries
+//
+// search_in_polygon finds the objects whose rectangles share at least one point with a polygon. The traversal is driven by the
+// polygon's MBR; every child MBR meeting it is then classified exactly as outside, inside or crossing the polygon. Subtrees inside
+// the polygon are reported without further tests and only the entries of crossing leaves are refined one by one.
+
+enum polygon_relation
+{
+    POLYGON_OUTSIDE,
+    POLYGON_INSIDE,
+    POLYGON_CROSSING
+};
+
+// Returns the slab of the edge grid holding the y coordinate, clamped to the grid
+static int polygon_slab(POLYGON polygon, double y) {
+    int slab = (int)((y - polygon->mbr.min_y) / polygon->slab_height);
+    if (slab < 0)
+        return 0;
+    return slab < polygon->num_slabs ? slab : polygon->num_slabs - 1;
+}
+
+// Creates a polygon from its vertices, in either orientation; the last vertex is joined back to the first
+POLYGON create_polygon(const int xs[], const int ys[], int num_vertices) {
+    if (num_vertices < 3)
+        return NULL;
+    POLYGON polygon = (POLYGON)calloc(1, sizeof(struct polygon));
+    polygon->num_vertices = num_vertices;
+    polygon->xs = (int *)malloc(sizeof(int) * num_vertices);
+    polygon->ys = (int *)malloc(sizeof(int) * num_vertices);
+    memcpy(polygon->xs, xs, sizeof(int) * num_vertices);
+    memcpy(polygon->ys, ys, sizeof(int) * num_vertices);
+    polygon->mbr.min_x = polygon->mbr.max_x = xs[0];
+    polygon->mbr.min_y = polygon->mbr.max_y = ys[0];
+    for (int i = 1; i < num_vertices; ++i) {
+        struct rectangle vertex = {xs[i], ys[i], xs[i], ys[i]};
+        extend_rect(&polygon->mbr, &vertex);
+    }
+    if (num_vertices <= POLYGON_GRID_VERTICES)
+        return polygon;
+
+    // Build the edge grid with about one slab per vertex, counting the edges of each slab before filling them in
+    polygon->num_slabs = num_vertices;
+    polygon->slab_height = (polygon->mbr.max_y - polygon->mbr.min_y + 1.0) / polygon->num_slabs;
+    polygon->slab_start = (int *)calloc(polygon->num_slabs + 1, sizeof(int));
+    for (int i = 0; i < num_vertices; ++i) {
+        int j = (i + 1) % num_vertices;
+        int first = polygon_slab(polygon, ys[i] < ys[j] ? ys[i] : ys[j]);
+        int last = polygon_slab(polygon, ys[i] < ys[j] ? ys[j] : ys[i]);
+        for (int k = first; k <= last; ++k)
+            polygon->slab_start[k + 1]++;
+    }
+    for (int k = 0; k < polygon->num_slabs; ++k)
+        polygon->slab_start[k + 1] += polygon->slab_start[k];
+    polygon->slab_edges = (int *)malloc(sizeof(int) * (polygon->slab_start[polygon->num_slabs] + 1));
+    int* fill = (int *)malloc(sizeof(int) * polygon->num_slabs);
+    memcpy(fill, polygon->slab_start, sizeof(int) * polygon->num_slabs);
+    for (int i = 0; i < num_vertices; ++i) {
+        int j = (i + 1) % num_vertices;
+        int first = polygon_slab(polygon, ys[i] < ys[j] ? ys[i] : ys[j]);
+        int last = polygon_slab(polygon, ys[i] < ys[j] ? ys[j] : ys[i]);
+        for (int k = first; k <= last; ++k)
+            polygon->slab_edges[fill[k]++] = i;
+    }
+    free(fill);
+    return polygon;
+}
+
+// Frees a polygon and its edge grid
+void free_polygon(POLYGON polygon) {
+    if (polygon == NULL)
+        return;
+    free(polygon->xs);
+    free(polygon->ys);
+    free(polygon->slab_start);
+    free(polygon->slab_edges);
+    free(polygon);
+}
+
+// Gives the range of edges to test for the y-extent [min_y, max_y]: a run of the edge grid, or all edges without a grid
+static void polygon_edge_range(POLYGON polygon, int min_y, int max_y, int* begin, int* end) {
+    if (polygon->num_slabs == 0) {
+        *begin = 0;
+        *end = polygon->num_vertices;
+        return;
+    }
+    *begin = polygon->slab_start[polygon_slab(polygon, min_y)];
+    *end = polygon->slab_start[polygon_slab(polygon, max_y) + 1];
+}
+
+// Returns the index of the edge at position i of an edge range
+static inline int polygon_edge(POLYGON polygon, int i) {
+    return polygon->num_slabs == 0 ? i : polygon->slab_edges[i];
+}
+
+// Checks whether the point lies inside the polygon or on its boundary, using exact integer arithmetic
+bool point_in_polygon(POLYGON polygon, int x, int y) {
+    if (x < polygon->mbr.min_x || x > polygon->mbr.max_x || y < polygon->mbr.min_y || y > polygon->mbr.max_y)
+        return false;
+    int begin, end;
+    polygon_edge_range(polygon, y, y, &begin, &end);
+    bool inside = false;
+    for (int i = begin; i < end; ++i) {
+        int a = polygon_edge(polygon, i);
+        int b = (a + 1) % polygon->num_vertices;
+        long long x1 = polygon->xs[a], y1 = polygon->ys[a], x2 = polygon->xs[b], y2 = polygon->ys[b];
+        long long cross = (x2 - x1) * (y - y1) - (x - x1) * (y2 - y1);
+        // Points on an edge belong to the polygon
+        if (cross == 0 && x >= (x1 < x2 ? x1 : x2) && x <= (x1 < x2 ? x2 : x1) && y >= (y1 < y2 ? y1 : y2) && y <= (y1 < y2 ? y2 : y1))
+            return true;
+        // Count the edges crossed by a ray going right from the point; each edge owns its lower end point only
+        if ((y1 > y) != (y2 > y) && (y2 > y1 ? cross > 0 : cross < 0))
+            inside = !inside;
+    }
+    return inside;
+}
+
+// Checks whether the closed segment and rectangle share a point: their bounding boxes must overlap and the rectangle's corners
+// must not all lie strictly on one side of the segment's line
+static bool segment_meets_rect(long long x1, long long y1, long long x2, long long y2, RECT rect) {
+    if ((x1 < x2 ? x1 : x2) > rect->max_x || (x1 < x2 ? x2 : x1) < rect->min_x ||
+        (y1 < y2 ? y1 : y2) > rect->max_y || (y1 < y2 ? y2 : y1) < rect->min_y)
+        return false;
+    long long corners_x[4] = {rect->min_x, rect->max_x, rect->max_x, rect->min_x};
+    long long corners_y[4] = {rect->min_y, rect->min_y, rect->max_y, rect->max_y};
+    int positive = 0, negative = 0;
+    for (int i = 0; i < 4; ++i) {
+        long long cross = (x2 - x1) * (corners_y[i] - y1) - (corners_x[i] - x1) * (y2 - y1);
+        positive += cross > 0;
+        negative += cross < 0;
+    }
+    return positive < 4 && negative < 4;
+}
+
+// Classifies a rectangle against the polygon. Without any edge meeting the rectangle it lies either wholly inside or wholly
+// outside the polygon (a polygon inside the rectangle would have edges in it), which one of its corners decides.
+static enum polygon_relation classify_rect(POLYGON polygon, RECT rect) {
+    if (!rect_intersects(rect, &polygon->mbr))
+        return POLYGON_OUTSIDE;
+    int begin, end;
+    polygon_edge_range(polygon, rect->min_y, rect->max_y, &begin, &end);
+    for (int i = begin; i < end; ++i) {
+        int a = polygon_edge(polygon, i);
+        int b = (a + 1) % polygon->num_vertices;
+        if (segment_meets_rect(polygon->xs[a], polygon->ys[a], polygon->xs[b], polygon->ys[b], rect))
+            return POLYGON_CROSSING;
+    }
+    return point_in_polygon(polygon, rect->min_x, rect->min_y) ? POLYGON_INSIDE : POLYGON_OUTSIDE;
+}
+
+// Reports every object of a subtree, storing at most max_found of them
+static void collect_subtree(NODE node, OBJ found_objects[], int max_found, int* num_found) {
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        if (node->is_leaf)
+            found_objects[(*num_found)++] = node->objects[i];
+        else
+            collect_subtree(node->children[i], found_objects, max_found, num_found);
+    }
+}
+
+// Search for objects whose rectangles share at least one point with the polygon, storing at most max_found of them
+void search_in_polygon(NODE node, POLYGON polygon, OBJ found_objects[], int max_found, int* num_found) {
+    if (node == NULL || polygon == NULL)
+        return;
+    for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+        RECT region = node->regions[i];
+        // Point objects of crossing leaves only need the point in polygon test
+        if (node->is_leaf && region->min_x == region->max_x && region->min_y == region->max_y) {
+            if (point_in_polygon(polygon, region->min_x, region->min_y))
+                found_objects[(*num_found)++] = node->objects[i];
+            continue;
+        }
+        enum polygon_relation relation = classify_rect(polygon, region);
+        if (relation == POLYGON_OUTSIDE)
+            continue;
+        if (node->is_leaf)
+            found_objects[(*num_found)++] = node->objects[i];
+        else if (relation == POLYGON_INSIDE)
+            collect_subtree(node->children[i], found_objects, max_found, num_found);
+        else
+            search_in_polygon(node->children[i], polygon, found_objects, max_found, num_found);
+    }
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Concurrent inserts (R-link tree)
+//
+// A concurrent tree lets many threads insert and query at once without a tree-wide lock. Every node has a latch, a link to its
+// right sibling and a node sequence number (NSN) taken from a global counter when it splits, kept in a node_link that only
+// concurrent trees allocate. Nodes split in place: the left half
+// stays in the node and the right half moves to a new sibling linked after it. The counter is incremented while the parent is
+// exclusively latched, so a reader that memorised it while reading the parent recognises a split it has not seen there (NSN above
+// the memorised value) and follows the right link as well. Readers and the descent of an insert hold one latch at a time; an insert
+// then goes back up latching each parent while still holding the node below, so latches are only requested upwards or to the right.
+// A parent is latched exclusively only to be split, to take a new sibling or to enlarge an entry; adding the new object to its
+// entry's count needs a shared latch only. Deletion is not supported concurrently and type histograms are not kept.
+
+// Latches a node for reading or for modifying it
+static inline void latch_node(NODE node, bool exclusive) {
+    if (exclusive)
+        pthread_rwlock_wrlock(&node->link->latch);
+    else
+        pthread_rwlock_rdlock(&node->link->latch);
+}
+
+static inline void unlatch_node(NODE node) {
+    pthread_rwlock_unlock(&node->link->latch);
+}
+
+// Gives a node the latch, right link and NSN of a node of a concurrent tree
+static void link_node(NODE node, NODE right_link) {
+    node->link = (struct node_link *)malloc(sizeof(struct node_link));
+    pthread_rwlock_init(&node->link->latch, NULL);
+    node->link->right_link = right_link;
+    node->link->nsn = 0;
+}
+
+// Drops the concurrent tree state of the nodes of a subtree
+static void unlink_subtree(NODE node) {
+    for (int i = 0; i < node->count && !node->is_leaf; ++i)
+        unlink_subtree(node->children[i]);
+    pthread_rwlock_destroy(&node->link->latch);
+    free(node->link);
+    node->link = NULL;
+}
+
+// Returns the counter value to memorise for the entries of a node latched by the caller
+static inline unsigned long long read_nsn_counter(CONCURRENT_R_TREE tree) {
+    return __atomic_load_n(&tree->nsn_counter, __ATOMIC_ACQUIRE);
+}
+
+// Takes over a tree for concurrent use, linking the nodes of every level from left to right. The leftmost node of a level stays
+// leftmost since splits only add siblings to the right of a node.
+CONCURRENT_R_TREE create_concurrent_r_tree(R_TREE r_tree) {
+    if (r_tree->height >= CONCURRENT_MAX_HEIGHT)
+        return NULL;
+    CONCURRENT_R_TREE tree = (CONCURRENT_R_TREE)calloc(1, sizeof(struct concurrent_r_tree));
+    tree->r_tree = r_tree;
+    pthread_rwlock_init(&tree->root_latch, NULL);
+    disable_type_histograms(r_tree);
+
+    int capacity = 64, num_level = 1;
+    NODE* level = (NODE *)malloc(sizeof(NODE) * capacity);
+    NODE* next_level = (NODE *)malloc(sizeof(NODE) * capacity);
+    level[0] = r_tree->root;
+    for (int depth = r_tree->height; depth >= 0; --depth) {
+        tree->level_heads[depth] = level[0];
+        int num_next = 0;
+        for (int n = 0; n < num_level; ++n) {
+            NODE node = level[n];
+            link_node(node, n + 1 < num_level ? level[n + 1] : NULL);
+            for (int i = 0; i < node->count && !node->is_leaf; ++i) {
+                if (num_next == capacity) {
+                    capacity *= 2;
+                    level = (NODE *)realloc(level, sizeof(NODE) * capacity);
+                    next_level = (NODE *)realloc(next_level, sizeof(NODE) * capacity);
+                }
+                next_level[num_next++] = node->children[i];
+            }
+        }
+        NODE* swap = level;
+        level = next_level;
+        next_level = swap;
+        num_level = num_next;
+    }
+    free(level);
+    free(next_level);
+    return tree;
+}
+
+// Ends concurrent use of the tree, which must not be accessed by other threads any more, and returns it
+R_TREE release_concurrent_r_tree(CONCURRENT_R_TREE tree) {
+    R_TREE r_tree = tree->r_tree;
+    free(r_tree->rect);
+    r_tree->rect = bounding_box(r_tree->root);
+    unlink_subtree(r_tree->root);
+    pthread_rwlock_destroy(&tree->root_latch);
+    free(tree);
+    return r_tree;
+}
+
+// Latches the node holding the entry of child, a node of the given level, and stores the entry's position in index. The search
+// starts from the node the insert descended through, or from the leftmost node of the level when the root has been split since,
+// and moves right past the splits that carried the entry away. Returns NULL with the root latch held instead if child is the root.
+static NODE latch_parent(CONCURRENT_R_TREE tree, NODE child, int level, NODE path[], int path_height, bool exclusive, int* index) {
+    NODE parent = NULL;
+    if (level < path_height) {
+        parent = path[level + 1];
+    } else {
+        if (exclusive)
+            pthread_rwlock_wrlock(&tree->root_latch);
+        else
+            pthread_rwlock_rdlock(&tree->root_latch);
+        if (tree->r_tree->root == child)
+            return NULL;
+        parent = tree->level_heads[level + 1];
+        pthread_rwlock_unlock(&tree->root_latch);
+    }
+    while (true) {
+        latch_node(parent, exclusive);
+        for (int i = 0; i < parent->count; ++i) {
+            if (parent->children[i] == child) {
+                *index = i;
+                return parent;
+            }
+        }
+        NODE next = parent->link->right_link;
+        unlatch_node(parent);
+        parent = next;
+    }
+}
+
+// Splits a full, exclusively latched node in place to make room for one more entry: an object for a leaf, a child for an internal
+// node. The node keeps one group; a new sibling linked to its right takes the other along with the node's old NSN and right link.
+// The sibling's link is set up before it is published through the node's right link.
+static NODE split_in_place(CONCURRENT_R_TREE tree, NODE node, OBJ object, NODE child, RECT rect) {
+    NODE * nodes = node->is_leaf ? quadratic_split_leaf_node(node, object, rect) : quadratic_split_internal_node(node, rect, child);
+    NODE kept = nodes[0];
+    NODE sibling = nodes[1];
+    node->count = kept->count;
+    for (int i = 0; i < M; ++i) {
+        node->regions[i] = kept->regions[i];
+        node->children[i] = kept->children[i];
+        node->objects[i] = kept->objects[i];
+        node->counts[i] = kept->counts[i];
+        if (node->children[i] != NULL)
+            node->children[i]->parent = node;
+    }
+    link_node(sibling, node->link->right_link);
+    sibling->link->nsn = node->link->nsn;
+    node->link->nsn = __atomic_add_fetch(&tree->nsn_counter, 1, __ATOMIC_ACQ_REL);
+    node->link->right_link = sibling;
+    free(kept);
+    free(nodes);
+    return sibling;
+}
+
+// Inserts an object in the concurrent tree
+void concurrent_insert(CONCURRENT_R_TREE tree, OBJ object) {
+    concurrent_insert_rect(tree, object, create_new_rect(object->x, object->y, object->x, object->y));
+}
+
+// Inserts an object covering obj_rect in the concurrent tree; the rectangle is owned by the tree afterwards
+void concurrent_insert_rect(CONCURRENT_R_TREE tree, OBJ object, RECT obj_rect) {
+    NODE path[CONCURRENT_MAX_HEIGHT];
+    pthread_rwlock_rdlock(&tree->root_latch);
+    NODE node = tree->r_tree->root;
+    int height = tree->r_tree->height;
+    pthread_rwlock_unlock(&tree->root_latch);
+
+    // Descend to a leaf holding one shared latch at a time. A split met on the way needs no care: the entry may go to any node of
+    // the split chain, so the node reached is used.
+    for (int level = height; level > 0; --level) {
+        latch_node(node, false);
+        path[level] = node;
+        NODE next = node->children[choose_subtree(node, obj_rect)];
+        unlatch_node(node);
+        node = next;
+    }
+    latch_node(node, true);
+
+    // Place the entry, splitting full nodes upwards. A split node stays latched until its sibling has an entry in the parent, so
+    // the sibling can only be reached through its right link meanwhile and its object count stays valid.
+    int level = 0;
+    OBJ entry_object = object;
+    NODE entry_child = NULL;
+    RECT entry_rect = obj_rect;
+    NODE below = NULL;
+    while (node->count == M) {
+        int index;
+        NODE parent = latch_parent(tree, node, level, path, height, true, &index);
+        NODE sibling = split_in_place(tree, node, entry_object, entry_child, entry_rect);
+        if (below != NULL)
+            unlatch_node(below);
+        if (parent == NULL) {
+            // The root was split: grow the tree with a new root over both halves
+            NODE new_root = create_new_internal_node();
+            link_node(new_root, NULL);
+            insert_region_into_node(new_root, node, bounding_box(node));
+            insert_region_into_node(new_root, sibling, bounding_box(sibling));
+            tree->level_heads[level + 1] = new_root;
+            tree->r_tree->root = new_root;
+            tree->r_tree->height = level + 1;
+            unlatch_node(node);
+            pthread_rwlock_unlock(&tree->root_latch);
+            return;
+        }
+        // The entry of the node shrinks to its half; the rectangle stays in place as readers may hold it
+        RECT box = bounding_box(node);
+        *(parent->regions[index]) = *box;
+        free(box);
+        parent->counts[index] = subtree_count(node);
+        below = node;
+        entry_object = NULL;
+        entry_child = sibling;
+        entry_rect = bounding_box(sibling);
+        node = parent;
+        ++level;
+    }
+    if (node->is_leaf)
+        insert_object_into_node(node, entry_object, entry_rect);
+    else
+        insert_region_into_node(node, entry_child, entry_rect);
+    if (below != NULL)
+        unlatch_node(below);
+
+    // Add the object to the entries of the node's ancestors, enlarging those which do not cover it yet
+    while (true) {
+        int index;
+        NODE parent = latch_parent(tree, node, level, path, height, false, &index);
+        if (parent == NULL) {
+            pthread_rwlock_unlock(&tree->root_latch);
+            break;
+        }
+        if (rect_contains(parent->regions[index], obj_rect)) {
+            __atomic_add_fetch(&parent->counts[index], 1, __ATOMIC_RELAXED);
+        } else {
+            unlatch_node(parent);
+            parent = latch_parent(tree, node, level, path, height, true, &index);
+            extend_rect(parent->regions[index], obj_rect);
+            parent->counts[index] += 1;
+        }
+        unlatch_node(node);
+        node = parent;
+        ++level;
+    }
+    unlatch_node(node);
+}
+
+// Stores a node still to be visited by a concurrent query with the counter value memorised when its entry was read
+struct link_visit
+{
+    NODE node;
+    unsigned long long nsn;
+};
+
+// Checks whether an entry of a concurrent tree qualifies for a window query, or for a radius query when window is NULL
+static bool link_query_matches(RECT region, bool is_leaf, RECT window, enum window_predicate predicate, int user_x, int user_y, double radius) {
+    if (window == NULL)
+        return min_distance_to_rect(region, user_x, user_y) <= radius;
+    if (is_leaf)
+        return window_matches(region, window, predicate);
+    return predicate == WINDOW_CONTAINS ? rect_contains(region, window) : rect_intersects(region, window);
+}
+
+// Visits the entries of a concurrent tree qualifying for a window query, or for a radius query when window is NULL
+static void link_search(CONCURRENT_R_TREE tree, RECT window, enum window_predicate predicate, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
+    int capacity = 64, size = 0;
+    struct link_visit* stack = (struct link_visit *)malloc(sizeof(struct link_visit) * capacity);
+    pthread_rwlock_rdlock(&tree->root_latch);
+    stack[size].node = tree->r_tree->root;
+    stack[size++].nsn = read_nsn_counter(tree);
+    pthread_rwlock_unlock(&tree->root_latch);
+
+    while (size > 0 && *num_found < max_found) {
+        struct link_visit visit = stack[--size];
+        NODE node = visit.node;
+        latch_node(node, false);
+        // Room for the right sibling and all children
+        if (size + M + 1 > capacity) {
+            capacity *= 2;
+            stack = (struct link_visit *)realloc(stack, sizeof(struct link_visit) * capacity);
+        }
+        // The node was split after its entry was read: part of what the entry covered is now to its right
+        if (node->link->nsn > visit.nsn && node->link->right_link != NULL) {
+            stack[size].node = node->link->right_link;
+            stack[size++].nsn = visit.nsn;
+        }
+        unsigned long long nsn = read_nsn_counter(tree);
+        for (int i = 0; i < node->count && *num_found < max_found; ++i) {
+            if (!link_query_matches(node->regions[i], node->is_leaf, window, predicate, user_x, user_y, radius))
+                continue;
+            if (node->is_leaf) {
+                found_objects[(*num_found)++] = node->objects[i];
+            } else {
+                stack[size].node = node->children[i];
+                stack[size++].nsn = nsn;
+            }
+        }
+        unlatch_node(node);
+    }
+    free(stack);
+}
+
+// Search for objects whose rectangles satisfy the predicate against the window while other threads insert, storing at most
+// max_found of them. Objects inserted during the search may or may not be found.
+void concurrent_search_window(CONCURRENT_R_TREE tree, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    link_search(tree, window, predicate, 0, 0, 0.0, found_objects, max_found, num_found);
+}
+
+// Search for objects within the radius of the user's location while other threads insert, storing at most max_found of them
+void concurrent_search_radius(CONCURRENT_R_TREE tree, int user_x, int user_y, double radius, OBJ found_objects[], int max_found, int* num_found) {
+    link_search(tree, NULL, WINDOW_INTERSECTS, user_x, user_y, radius, found_objects, max_found, num_found);
+}
+
+// Depth-first branch and bound kNN below a node of a concurrent tree, and the nodes split off it since its entry was read. The
+// entries are copied out so that no latch is held while the children are visited.
+static void link_knn_node(CONCURRENT_R_TREE tree, NODE node, unsigned long long nsn, int user_x, int user_y, int K, OBJ neighbors[], double distances[], int* found) {
+    while (node != NULL) {
+        NODE children[M];
+        double mindist[M];
+        int order[M];
+        latch_node(node, false);
+        NODE next = node->link->nsn > nsn ? node->link->right_link : NULL;
+        unsigned long long child_nsn = read_nsn_counter(tree);
+        bool is_leaf = node->is_leaf;
+        int count = node->count;
+        for (int i = 0; i < count; ++i) {
+            double d = min_distance_to_rect(node->regions[i], user_x, user_y);
+            if (is_leaf) {
+                if (*found == K && d >= distances[K - 1])
+                    continue;
+                int j = *found < K ? (*found)++ : K - 1;
+                while (j > 0 && distances[j - 1] > d) {
+                    neighbors[j] = neighbors[j - 1];
+                    distances[j] = distances[j - 1];
+                    --j;
+                }
+                neighbors[j] = node->objects[i];
+                distances[j] = d;
+                continue;
+            }
+            children[i] = node->children[i];
+            mindist[i] = d;
+            int j = i;
+            while (j > 0 && mindist[order[j - 1]] > d) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        unlatch_node(node);
+
+        for (int k = 0; k < count && !is_leaf; ++k) {
+            int i = order[k];
+            if (*found == K && mindist[i] >= distances[K - 1])
+                break;
+            link_knn_node(tree, children[i], child_nsn, user_x, user_y, K, neighbors, distances, found);
+        }
+        node = next;
+    }
+}
+
+// Finds the K nearest objects to the user's location while other threads insert, closest first. Returns the number found.
+int concurrent_find_k_nearest_neighbors(CONCURRENT_R_TREE tree, int user_x, int user_y, int K, OBJ neighbors[], double distances[]) {
+    if (K <= 0)
+        return 0;
+    pthread_rwlock_rdlock(&tree->root_latch);
+    NODE root = tree->r_tree->root;
+    unsigned long long nsn = read_nsn_counter(tree);
+    pthread_rwlock_unlock(&tree->root_latch);
+    int found = 0;
+    link_knn_node(tree, root, nsn, user_x, user_y, K, neighbors, distances, &found);
+    return found;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Sharded R-Tree
+//
+// A sharded tree cuts space into up to MAX_SHARDS regions with a KD split of a sample of the data, so shards get about the same
+// number of objects even for skewed data. Each shard has its own R-Tree and writer thread: inserts are routed by the centre of
+// their rectangle and queued, and the writer applies its queue in batches, so producers on different shards never contend.
+// Window and kNN queries only visit the shards whose objects' MBR they can reach; kNN visits shards closest first and merges their
+// neighbours into one top K. Queries see the inserts applied so far; sharded_flush waits until every queued insert is applied.
+
+// Splits region among num_shards shards, cutting the sample at the matching quantile across its wider coordinate
+static void kd_partition(struct pack_entry* sample, int sample_size, struct rectangle region, struct shard* shards, int num_shards) {
+    if (num_shards == 1) {
+        shards[0].region = region;
+        return;
+    }
+    long long width = (long long)region.max_x - region.min_x, height = (long long)region.max_y - region.min_y;
+    if (width == 0 && height == 0) {
+        // A single coordinate cannot be split: the first shard owns it and the others route nothing
+        shards[0].region = region;
+        for (int i = 1; i < num_shards; ++i)
+            shards[i].region = (struct rectangle){INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+        return;
+    }
+    int left_shards = num_shards / 2;
+    int split = (int)((long long)sample_size * left_shards / num_shards);
+    // Cut across the sample's wider coordinate, or the region's when no sample points are left, but never across a side of width 0
+    bool split_x = width >= height;
+    if (sample_size > 0) {
+        int min_x = INT_MAX, max_x = INT_MIN, min_y = INT_MAX, max_y = INT_MIN;
+        for (int i = 0; i < sample_size; ++i) {
+            min_x = sample[i].center_x < min_x ? sample[i].center_x : min_x;
+            max_x = sample[i].center_x > max_x ? sample[i].center_x : max_x;
+            min_y = sample[i].center_y < min_y ? sample[i].center_y : min_y;
+            max_y = sample[i].center_y > max_y ? sample[i].center_y : max_y;
+        }
+        split_x = (long long)max_x - min_x >= (long long)max_y - min_y;
+    }
+    if ((split_x ? width : height) == 0)
+        split_x = !split_x;
+    int low = split_x ? region.min_x : region.min_y;
+    int high = split_x ? region.max_x : region.max_y;
+    int value = low;
+    if (sample_size > 0) {
+        qsort(sample, sample_size, sizeof(struct pack_entry), split_x ? compare_pack_x : compare_pack_y);
+        value = split_x ? sample[split].center_x : sample[split].center_y;
+    }
+    if (value <= low || value > high) {
+        // Both halves must keep at least one coordinate: when the quantile does not fall inside the region (coinciding or
+        // outlying points), halve the region and hand each half the sample points on its side
+        value = (int)(((long long)low + high + 1) / 2);
+        split = 0;
+        while (split < sample_size && (split_x ? sample[split].center_x : sample[split].center_y) < value)
+            ++split;
+    }
+
+    struct rectangle left = region, right = region;
+    if (split_x) {
+        left.max_x = value - 1;
+        right.min_x = value;
+    } else {
+        left.max_y = value - 1;
+        right.min_y = value;
+    }
+    kd_partition(sample, split, left, shards, left_shards);
+    kd_partition(sample + split, sample_size - split, right, shards + left_shards, num_shards - left_shards);
+}
+
+// Applies the queued inserts of a shard in batches until the shard is closed and its queue drained
+static void* shard_writer(void* arg) {
+    struct shard* shard = (struct shard *)arg;
+    pthread_mutex_lock(&shard->lock);
+    while (true) {
+        while (shard->queue_size == 0 && !shard->stopping)
+            pthread_cond_wait(&shard->queued, &shard->lock);
+        if (shard->queue_size == 0)
+            break;
+        // Take the whole queue so producers can go on queueing while the batch is applied
+        struct shard_insert* batch = shard->queue;
+        int size = shard->queue_size;
+        shard->queue = NULL;
+        shard->queue_size = 0;
+        shard->queue_capacity = 0;
+        pthread_mutex_unlock(&shard->lock);
+
+        pthread_rwlock_wrlock(&shard->tree_latch);
+        for (int i = 0; i < size; ++i) {
+            insert_rect_in_r_tree(shard->r_tree, batch[i].object, batch[i].rect);
+            if (shard->num_objects++ == 0)
+                shard->bounds = *batch[i].rect;
+            else
+                extend_rect(&shard->bounds, batch[i].rect);
+        }
+        pthread_rwlock_unlock(&shard->tree_latch);
+        free(batch);
+
+        pthread_mutex_lock(&shard->lock);
+        shard->num_applied += size;
+        pthread_cond_broadcast(&shard->applied);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+// Creates a sharded tree of num_shards shards, partitioning space from a sample of the objects to be indexed
+SHARDED_R_TREE create_sharded_r_tree(OBJ sample[], int sample_size, int num_shards) {
+    if (num_shards < 1 || num_shards > MAX_SHARDS)
+        return NULL;
+    SHARDED_R_TREE sharded = (SHARDED_R_TREE)malloc(sizeof(struct sharded_r_tree));
+    sharded->num_shards = num_shards;
+    sharded->shards = (struct shard *)calloc(num_shards, sizeof(struct shard));
+
+    struct pack_entry* points = (struct pack_entry *)calloc(sample_size > 0 ? sample_size : 1, sizeof(struct pack_entry));
+    for (int i = 0; i < sample_size; ++i) {
+        points[i].center_x = sample[i]->x;
+        points[i].center_y = sample[i]->y;
+    }
+    struct rectangle everywhere = {INT_MIN, INT_MIN, INT_MAX, INT_MAX};
+    kd_partition(points, sample_size, everywhere, sharded->shards, num_shards);
+    free(points);
+
+    for (int i = 0; i < num_shards; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        shard->r_tree = create_new_r_tree();
+        pthread_rwlock_init(&shard->tree_latch, NULL);
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->queued, NULL);
+        pthread_cond_init(&shard->applied, NULL);
+        pthread_create(&shard->writer, NULL, shard_writer, shard);
+    }
+    return sharded;
+}
+
+// Inserts an object in the shard owning its location
+void sharded_insert(SHARDED_R_TREE sharded, OBJ object) {
+    sharded_insert_rect(sharded, object, create_new_rect(object->x, object->y, object->x, object->y));
+}
+
+// Queues an object covering obj_rect for the shard owning the centre of obj_rect; the rectangle is owned by the tree afterwards
+void sharded_insert_rect(SHARDED_R_TREE sharded, OBJ object, RECT obj_rect) {
+    int center_x = (int)(((long long)obj_rect->min_x + obj_rect->max_x) / 2);
+    int center_y = (int)(((long long)obj_rect->min_y + obj_rect->max_y) / 2);
+    struct shard* shard = &sharded->shards[0];
+    for (int i = 0; i < sharded->num_shards; ++i) {
+        struct rectangle* region = &sharded->shards[i].region;
+        if (region->min_x <= center_x && center_x <= region->max_x && region->min_y <= center_y && center_y <= region->max_y) {
+            shard = &sharded->shards[i];
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    while (shard->queue_size >= SHARD_QUEUE_LIMIT)
+        pthread_cond_wait(&shard->applied, &shard->lock);
+    if (shard->queue_size == shard->queue_capacity) {
+        shard->queue_capacity = shard->queue_capacity == 0 ? 256 : shard->queue_capacity * 2;
+        shard->queue = (struct shard_insert *)realloc(shard->queue, sizeof(struct shard_insert) * shard->queue_capacity);
+    }
+    shard->queue[shard->queue_size].object = object;
+    shard->queue[shard->queue_size++].rect = obj_rect;
+    shard->num_queued += 1;
+    pthread_cond_signal(&shard->queued);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Waits until every insert queued so far has been applied to its shard
+void sharded_flush(SHARDED_R_TREE sharded) {
+    for (int i = 0; i < sharded->num_shards; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        long long target = shard->num_queued;
+        while (shard->num_applied < target)
+            pthread_cond_wait(&shard->applied, &shard->lock);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Search the shards for objects whose rectangles satisfy the predicate against the window, storing at most max_found of them
+void sharded_search_window(SHARDED_R_TREE sharded, RECT window, enum window_predicate predicate, OBJ found_objects[], int max_found, int* num_found) {
+    for (int i = 0; i < sharded->num_shards && *num_found < max_found; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        pthread_rwlock_rdlock(&shard->tree_latch);
+        if (shard->num_objects > 0 && (predicate == WINDOW_CONTAINS ? rect_contains(&shard->bounds, window) : rect_intersects(&shard->bounds, window)))
+            search_window(shard->r_tree->root, window, predicate, found_objects, max_found, num_found);
+        pthread_rwlock_unlock(&shard->tree_latch);
+    }
+}
+
+// Finds the K nearest objects to the user's location over all shards, closest first. Returns the number found.
+// Shards are visited in order of the distance to their objects' MBR and each is browsed only while it can still improve the top K.
+int sharded_find_k_nearest_neighbors(SHARDED_R_TREE sharded, int user_x, int user_y, int K, OBJ neighbors[], double distances[]) {
+    int order[MAX_SHARDS];
+    double mindist[MAX_SHARDS];
+    int num_order = 0;
+    for (int i = 0; i < sharded->num_shards; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        pthread_rwlock_rdlock(&shard->tree_latch);
+        bool empty = shard->num_objects == 0;
+        double d = empty ? 0.0 : min_distance_to_rect(&shard->bounds, user_x, user_y);
+        pthread_rwlock_unlock(&shard->tree_latch);
+        if (empty)
+            continue;
+        int j = num_order++;
+        while (j > 0 && mindist[order[j - 1]] > d) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+        mindist[i] = d;
+    }
+
+    int found = 0;
+    for (int k = 0; k < num_order && K > 0; ++k) {
+        if (found == K && mindist[order[k]] >= distances[K - 1])
+            break;
+        struct shard* shard = &sharded->shards[order[k]];
+        pthread_rwlock_rdlock(&shard->tree_latch);
+        NN_ITER iter = nn_iter_open(shard->r_tree, user_x, user_y);
+        double d;
+        OBJ object;
+        // Neighbours come closest first, so the shard is done as soon as one does not make it into the top K
+        while ((object = nn_iter_next(iter, &d)) != NULL && (found < K || d < distances[K - 1])) {
+            int j = found < K ? found++ : K - 1;
+            while (j > 0 && distances[j - 1] > d) {
+                neighbors[j] = neighbors[j - 1];
+                distances[j] = distances[j - 1];
+                --j;
+            }
+            neighbors[j] = object;
+            distances[j] = d;
+        }
+        nn_iter_close(iter);
+        pthread_rwlock_unlock(&shard->tree_latch);
+    }
+    return found;
+}
+
+// Applies the queued inserts, stops the writer threads and frees the sharded tree with the shards' R-Trees; the objects are not freed
+void close_sharded_r_tree(SHARDED_R_TREE sharded) {
+    for (int i = 0; i < sharded->num_shards; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->stopping = true;
+        pthread_cond_signal(&shard->queued);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    for (int i = 0; i < sharded->num_shards; ++i) {
+        struct shard* shard = &sharded->shards[i];
+        pthread_join(shard->writer, NULL);
+        pthread_rwlock_destroy(&shard->tree_latch);
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->queued);
+        pthread_cond_destroy(&shard->applied);
+        free(shard->queue);
+        free_r_tree(shard->r_tree);
+    }
+    free(sharded->shards);
+    free(sharded);
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Benchmark
+//
+// --bench builds a tree of uniformly distributed points, by default far larger than the last level cache, and times radius,
+// nearest neighbour and K nearest neighbour queries with software prefetching off and on. Each mode runs the same random queries
+// twice and keeps its faster round; the result checksums of both modes must agree.
+
+#define BENCH_EXTENT (1 << 20)   // Objects are spread over [0, BENCH_EXTENT) in both dimensions
+#define BENCH_ROUNDS 2
+#define BENCH_TEMPLATE_OBJECTS 200000 // Objects inserted one at a time into both 2D trees to compare them
+
+// Runs one kind of query (0 radius, 1 nearest neighbour, 2 K nearest neighbours) at every query point, returning ns per query
+static double bench_queries(R_TREE r_tree, int kind, int num_queries, const int* query_x, const int* query_y, double radius, long long* checksum) {
+    OBJ found[MAX_OBJECTS];
+    struct rectangle everything = {INT_MIN, INT_MIN, INT_MAX, INT_MAX};
+    *checksum = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int q = 0; q < num_queries; ++q) {
+        int x = query_x[q], y = query_y[q];
+        int num_found = 0;
+        if (kind == 0) {
+            struct rectangle search_rect = {(int)(x - radius), (int)(y - radius), (int)(x + radius), (int)(y + radius)};
+            search_in_r_tree(r_tree->root, &search_rect, x, y, radius, found, MAX_OBJECTS, &num_found);
+        } else if (kind == 1) {
+            double min_distance = INFINITY;
+            found[0] = search_nearest_neighbor(r_tree->root, &everything, x, y, NULL, &min_distance);
+            num_found = found[0] != NULL;
+        } else {
+            find_k_nearest_neighbors(r_tree->root, x, y, K_NEAREST_NEIGHBORS, found);
+            num_found = K_NEAREST_NEIGHBORS;
+        }
+        for (int i = 0; i < num_found; ++i)
+            if (found[i] != NULL)
+                *checksum += found[i]->x + (long long)found[i]->y * 3;
+    }
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    return (double)elapsed * 1e9 / (double)SDL_GetPerformanceFrequency() / num_queries;
+}
+
+// Compares the 2D instantiation of rtree_nd.h with the 2D R-Tree on window and K nearest neighbour queries, both trees built by
+// inserting the same objects one at a time; returns false if they disagree on the results
+static bool bench_template(OBJ objects[], int num_objects, const int* query_x, const int* query_y, int num_queries) {
+    R_TREE r_tree = create_new_r_tree();
+    R_TREE2 r_tree2 = rtree2_create();
+    for (int i = 0; i < num_objects; ++i) {
+        int coords[2] = {objects[i]->x, objects[i]->y};
+        insert_in_r_tree(r_tree, objects[i]);
+        rtree2_insert(r_tree2, rtree2_create_object(coords, objects[i]->type));
+    }
+    // Windows holding about 16 objects on average
+    int side = (int)sqrt(16.0 * BENCH_EXTENT * (double)BENCH_EXTENT / num_objects);
+    OBJ found[MAX_OBJECTS];
+    OBJ2 found2[MAX_OBJECTS];
+    double distances2[K_NEAREST_NEIGHBORS];
+    double best[2][2] = {{INFINITY, INFINITY}, {INFINITY, INFINITY}};
+    double checksums[2][2];
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        for (int tree = 0; tree < 2; ++tree) {
+            for (int kind = 0; kind < 2; ++kind) {
+                double checksum = 0;
+                Uint64 start = SDL_GetPerformanceCounter();
+                for (int q = 0; q < num_queries; ++q) {
+                    int x = query_x[q], y = query_y[q];
+                    int num_found = 0;
+                    if (kind == 0 && tree == 0) {
+                        struct rectangle window = {x, y, x + side, y + side};
+                        search_window(r_tree->root, &window, WINDOW_INTERSECTS, found, MAX_OBJECTS, &num_found);
+                        for (int i = 0; i < num_found; ++i)
+                            checksum += found[i]->x + 3.0 * found[i]->y;
+                    } else if (kind == 0) {
+                        struct rtree2_rect window = {{x, y}, {x + side, y + side}};
+                        rtree2_search_window(r_tree2, &window, found2, MAX_OBJECTS, &num_found);
+                        for (int i = 0; i < num_found; ++i)
+                            checksum += found2[i]->coords[0] + 3.0 * found2[i]->coords[1];
+                    } else if (tree == 0) {
+                        find_k_nearest_neighbors(r_tree->root, x, y, K_NEAREST_NEIGHBORS, found);
+                        for (int i = 0; i < K_NEAREST_NEIGHBORS; ++i)
+                            checksum += found[i] != NULL ? euclidean_distance(x, y, found[i]->x, found[i]->y) : 0;
+                    } else {
+                        int point[2] = {x, y};
+                        num_found = rtree2_find_k_nearest_neighbors(r_tree2, point, K_NEAREST_NEIGHBORS, found2, distances2);
+                        for (int i = 0; i < num_found; ++i)
+                            checksum += distances2[i];
+                    }
+                }
+                double ns = (double)(SDL_GetPerformanceCounter() - start) * 1e9 / (double)SDL_GetPerformanceFrequency() / num_queries;
+                best[kind][tree] = ns < best[kind][tree] ? ns : best[kind][tree];
+                checksums[kind][tree] = checksum;
+            }
+        }
+    }
+    const char* names[2] = {"window search", "K nearest neighbours"};
+    printf("\nBuilt both 2D trees of %d objects one insert at a time\n", num_objects);
+    printf("%-22s %14s %14s %9s\n", "Query", "2D R-Tree", "rtree_nd.h", "ratio");
+    bool agree = true;
+    for (int kind = 0; kind < 2; ++kind) {
+        printf("%-22s %11.0f ns %11.0f ns %8.2fx\n", names[kind], best[kind][0], best[kind][1], best[kind][1] / best[kind][0]);
+        // kNN ties may be broken differently, so the distances are compared rather than the objects
+        if (fabs(checksums[kind][0] - checksums[kind][1]) > 1e-6 * (fabs(checksums[kind][0]) + 1)) {
+            fprintf(stderr, "%s returned different results on the two 2D trees\n", names[kind]);
+            agree = false;
+        }
+    }
+    free_r_tree(r_tree);
+    rtree2_free(r_tree2);
+    return agree;
+}
+
+// Builds a tree of num_objects random points and reports query latencies without and with software prefetching
+int run_benchmark(int num_objects, int num_queries) {
+    if (num_objects <= M || num_queries <= 0) {
+        fprintf(stderr, "--bench needs more than %d objects and at least one query\n", M);
+        return 1;
+    }
+    srand(12345);
+    OBJ* objects = (OBJ *)malloc(sizeof(OBJ) * num_objects);
+    RECT* regions = (RECT *)malloc(sizeof(RECT) * num_objects);
+    for (int i = 0; i < num_objects; ++i) {
+        int x = (int)(((long long)rand() * (RAND_MAX + 1LL) + rand()) % BENCH_EXTENT);
+        int y = (int)(((long long)rand() * (RAND_MAX + 1LL) + rand()) % BENCH_EXTENT);
+        objects[i] = create_new_object(x, y, "bench");
+        regions[i] = create_new_rect(x, y, x, y);
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    R_TREE r_tree = create_new_r_tree();
+    insert_batch_in_r_tree(r_tree, objects, regions, num_objects);
+    double build_seconds = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+    printf("Built R-Tree of %d objects (height %d) in %.2f s\n", num_objects, r_tree->height, build_seconds);
+
+    int* query_x = (int *)malloc(sizeof(int) * num_queries);
+    int* query_y = (int *)malloc(sizeof(int) * num_queries);
+    for (int q = 0; q < num_queries; ++q) {
+        query_x[q] = rand() % BENCH_EXTENT;
+        query_y[q] = rand() % BENCH_EXTENT;
+    }
+    // Radius holding about 16 objects on average
+    double radius = sqrt(16.0 * BENCH_EXTENT * (double)BENCH_EXTENT / (acos(-1.0) * num_objects));
+
+    const char* names[3] = {"radius search", "nearest neighbour", "K nearest neighbours"};
+    printf("%-22s %14s %14s %9s\n", "Query", "no prefetch", "prefetch", "speedup");
+    int status = 0;
+    for (int kind = 0; kind < 3; ++kind) {
+        double best[2] = {INFINITY, INFINITY};
+        long long checksums[2];
+        for (int round = 0; round < BENCH_ROUNDS; ++round) {
+            for (int mode = 0; mode < 2; ++mode) {
+                software_prefetch = mode == 1;
+                double ns = bench_queries(r_tree, kind, num_queries, query_x, query_y, radius, &checksums[mode]);
+                best[mode] = ns < best[mode] ? ns : best[mode];
+            }
+        }
+        printf("%-22s %11.0f ns %11.0f ns %8.2fx\n", names[kind], best[0], best[1], best[0] / best[1]);
+        if (checksums[0] != checksums[1]) {
+            fprintf(stderr, "%s returned different results with prefetching\n", names[kind]);
+            status = 1;
+        }
+    }
+    software_prefetch = true;
+    if (!bench_template(objects, num_objects < BENCH_TEMPLATE_OBJECTS ? num_objects : BENCH_TEMPLATE_OBJECTS, query_x, query_y, num_queries))
+        status = 1;
+    free_r_tree(r_tree);
+    for (int i = 0; i < num_objects; ++i)
+        free(objects[i]);
+    free(query_x);
+    free(query_y);
+    free(objects);
+    free(regions);
+    return status;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Self test
+//
+// --selftest [objects] [writers] stresses the latching of concurrent trees: writer threads insert three quarters of the objects
+// while SELFTEST_READERS threads run window and K nearest neighbour queries. Each window query must find every object inserted
+// before the threads started that lies in the window, and nothing outside it or twice; each kNN query must return distinct
+// objects in order, none farther than the K-th nearest preloaded object. The tree handed back must then be a valid R-Tree holding
+// every object. Build with -fsanitize=thread to have ThreadSanitizer check the latch protocol as well.
+
+#define SELFTEST_READERS 4
+#define SELFTEST_EXTENT 10000    // Objects are spread over [0, SELFTEST_EXTENT) in both dimensions
+#define SELFTEST_WINDOW 300      // Side of the query windows
+
+// Stores the state shared by the threads of the self test
+struct selftest
+{
+    CONCURRENT_R_TREE tree;
+    OBJ * objects;               // The first num_preloaded are in the tree before the threads start
+    int num_objects;
+    int num_preloaded;
+    int num_writers;
+    int writers_running;
+    long long queries;
+    long long errors;
+};
+
+// Stores a thread of the self test
+struct selftest_thread
+{
+    struct selftest * test;
+    int index;
+    pthread_t thread;
+};
+
+// Reports a failed check; called from any thread
+static void selftest_error(struct selftest* test, const char* message) {
+    if (__atomic_fetch_add(&test->errors, 1, __ATOMIC_RELAXED) < 10)
+        fprintf(stderr, "Self test: %s\n", message);
+}
+
+// Returns the next number of a xorshift sequence, so every thread has its own random numbers
+static unsigned int selftest_random(unsigned int* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Inserts every num_writers-th object not preloaded, starting at the thread's index
+static void* selftest_writer(void* arg) {
+    struct selftest_thread* self = (struct selftest_thread *)arg;
+    struct selftest* test = self->test;
+    for (int i = test->num_preloaded + self->index; i < test->num_objects; i += test->num_writers)
+        concurrent_insert(test->tree, test->objects[i]);
+    __atomic_sub_fetch(&test->writers_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Runs window and kNN queries until the writers are done, checking them against the preloaded objects
+static void* selftest_reader(void* arg) {
+    struct selftest_thread* self = (struct selftest_thread *)arg;
+    struct selftest* test = self->test;
+    unsigned int seed = 2463534242u + (unsigned int)self->index;
+    OBJ* found = (OBJ *)malloc(sizeof(OBJ) * test->num_objects);
+    long long queries = 0;
+    while (__atomic_load_n(&test->writers_running, __ATOMIC_ACQUIRE) > 0) {
+        int x = (int)(selftest_random(&seed) % SELFTEST_EXTENT), y = (int)(selftest_random(&seed) % SELFTEST_EXTENT);
+        struct rectangle window = {x, y, x + SELFTEST_WINDOW, y + SELFTEST_WINDOW};
+        int num_found = 0;
+        concurrent_search_window(test->tree, &window, WINDOW_INTERSECTS, found, test->num_objects, &num_found);
+        int expected = 0, preloaded_found = 0;
+        for (int i = 0; i < test->num_preloaded; ++i)
+            expected += test->objects[i]->x >= window.min_x && test->objects[i]->x <= window.max_x &&
+                        test->objects[i]->y >= window.min_y && test->objects[i]->y <= window.max_y;
+        for (int i = 0; i < num_found; ++i) {
+            OBJ object = found[i];
+            if (object->x < window.min_x || object->x > window.max_x || object->y < window.min_y || object->y > window.max_y)
+                selftest_error(test, "window query returned an object outside the window");
+            for (int j = 0; j < i; ++j)
+                if (found[j] == object)
+                    selftest_error(test, "window query returned an object twice");
+            preloaded_found += object->type[0] == 'P';
+        }
+        if (preloaded_found != expected)
+            selftest_error(test, "window query missed an object");
+
+        OBJ neighbors[K_NEAREST_NEIGHBORS];
+        double distances[K_NEAREST_NEIGHBORS], nearest[K_NEAREST_NEIGHBORS];
+        int num_neighbors = concurrent_find_k_nearest_neighbors(test->tree, x, y, K_NEAREST_NEIGHBORS, neighbors, distances);
+        int num_nearest = 0;
+        for (int i = 0; i < test->num_preloaded; ++i) {
+            double distance = euclidean_distance(x, y, test->objects[i]->x, test->objects[i]->y);
+            if (num_nearest == K_NEAREST_NEIGHBORS && distance >= nearest[K_NEAREST_NEIGHBORS - 1])
+                continue;
+            int j = num_nearest < K_NEAREST_NEIGHBORS ? num_nearest++ : K_NEAREST_NEIGHBORS - 1;
+            while (j > 0 && nearest[j - 1] > distance) {
+                nearest[j] = nearest[j - 1];
+                --j;
+            }
+            nearest[j] = distance;
+        }
+        if (num_neighbors < num_nearest || (num_nearest > 0 && distances[num_neighbors - 1] > nearest[num_nearest - 1]))
+            selftest_error(test, "kNN query missed a nearer object");
+        for (int i = 1; i < num_neighbors; ++i) {
+            if (distances[i] < distances[i - 1])
+                selftest_error(test, "kNN query returned objects out of order");
+            for (int j = 0; j < i; ++j)
+                if (neighbors[j] == neighbors[i])
+                    selftest_error(test, "kNN query returned an object twice");
+        }
+        ++queries;
+    }
+    __atomic_add_fetch(&test->queries, queries, __ATOMIC_RELAXED);
+    free(found);
+    return NULL;
+}
+
+// Checks the structure of a subtree: parent pointers, fill, entry rectangles and counts, and the depth of the leaves. Returns the
+// number of objects below the node.
+static int selftest_check_node(struct selftest* test, NODE node, RECT cover, int depth, int* leaf_depth) {
+    if (node->count < (cover != NULL ? m : 1) || node->count > M)
+        selftest_error(test, "node with too few or too many entries");
+    int total = 0;
+    for (int i = 0; i < node->count; ++i) {
+        if (cover != NULL && !rect_contains(cover, node->regions[i]))
+            selftest_error(test, "entry not covered by its parent's entry");
+        if (node->is_leaf) {
+            total += 1;
+            continue;
+        }
+        if (node->children[i]->parent != node)
+            selftest_error(test, "child with a wrong parent");
+        int count = selftest_check_node(test, node->children[i], node->regions[i], depth + 1, leaf_depth);
+        if (count != node->counts[i])
+            selftest_error(test, "entry with a wrong object count");
+        total += count;
+    }
+    if (node->is_leaf && *leaf_depth != depth) {
+        if (*leaf_depth != -1)
+            selftest_error(test, "leaves at different depths");
+        *leaf_depth = depth;
+    }
+    return total;
+}
+
+// Runs the self test with num_objects objects and num_writers writer threads; returns the process exit status
+int run_selftest(int num_objects, int num_writers) {
+    if (num_objects < 4 || num_writers < 1) {
+        fprintf(stderr, "--selftest needs at least 4 objects and one writer\n");
+        return 1;
+    }
+    struct selftest test;
+    memset(&test, 0, sizeof(test));
+    test.num_objects = num_objects;
+    test.num_preloaded = num_objects / 4;
+    test.num_writers = num_writers;
+    test.writers_running = num_writers;
+    test.objects = (OBJ *)malloc(sizeof(OBJ) * num_objects);
+    unsigned int seed = 88172645u;
+    R_TREE r_tree = create_new_r_tree();
+    for (int i = 0; i < num_objects; ++i) {
+        int x = (int)(selftest_random(&seed) % SELFTEST_EXTENT), y = (int)(selftest_random(&seed) % SELFTEST_EXTENT);
+        test.objects[i] = create_new_object(x, y, i < test.num_preloaded ? "P" : "C");
+        if (i < test.num_preloaded)
+            insert_in_r_tree(r_tree, test.objects[i]);
+    }
+
+    test.tree = create_concurrent_r_tree(r_tree);
+    int num_threads = num_writers + SELFTEST_READERS;
+    struct selftest_thread* threads = (struct selftest_thread *)malloc(sizeof(struct selftest_thread) * num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+        threads[i].test = &test;
+        threads[i].index = i < num_writers ? i : i - num_writers;
+        pthread_create(&threads[i].thread, NULL, i < num_writers ? selftest_writer : selftest_reader, &threads[i]);
+    }
+    for (int i = 0; i < num_threads; ++i)
+        pthread_join(threads[i].thread, NULL);
+    free(threads);
+    r_tree = release_concurrent_r_tree(test.tree);
+
+    int leaf_depth = -1;
+    if (selftest_check_node(&test, r_tree->root, NULL, 0, &leaf_depth) != num_objects || leaf_depth != r_tree->height)
+        selftest_error(&test, "tree does not hold every object");
+    OBJ* found = (OBJ *)malloc(sizeof(OBJ) * num_objects);
+    struct rectangle everything = {INT_MIN, INT_MIN, INT_MAX, INT_MAX};
+    int num_found = 0;
+    search_window(r_tree->root, &everything, WINDOW_INTERSECTS, found, num_objects, &num_found);
+    if (num_found != num_objects)
+        selftest_error(&test, "window query over the whole tree missed objects");
+    free(found);
+
+    printf("Self test: %d objects, %d writers, %d readers, %lld queries, %lld errors\n", num_objects, num_writers, SELFTEST_READERS,
+           test.queries, test.errors);
+    free_r_tree(r_tree);
+    for (int i = 0; i < num_objects; ++i)
+        free(test.objects[i]);
+    free(test.objects);
+    return test.errors == 0 ? 0 : 1;
+}
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Query server
+//
+// --serve ADDRESS [FILE] loads a snapshot or data file (or starts empty) and serves the index on a Unix domain socket
+// ("unix:PATH") or on localhost TCP ("tcp:PORT"). One thread runs an epoll loop that accepts connections and reads requests;
+// complete requests are handed to a pool of worker threads which answer them on the shared concurrent tree.
+//
+// Every message is a frame: a 4-byte length of the rest of the frame, a 4-byte request id and a 1-byte opcode (status in
+// responses), then the payload. Integers are in host byte order since the server only listens locally. Clients may pipeline any
+// number of requests; a worker answers all complete requests of a connection as one batch and responses come back in request order.
+//
+//   SERVE_INSERT  min_x min_y max_x max_y (int32), type length (uint8), type      -> empty
+//   SERVE_WINDOW  min_x min_y max_x max_y (int32), predicate (uint8), max (uint32) -> count (uint32), objects
+//   SERVE_RADIUS  x y (int32), radius (double), max (uint32)                        -> count (uint32), objects
+//   SERVE_KNN     x y (int32), K (uint32)                                           -> count (uint32), objects each followed by its distance (double)
+//
+// An object is sent as x y (int32), type length (uint8), type. A malformed request gets an empty SERVE_BAD_REQUEST response.
+// max and K are capped at SERVER_MAX_RESULTS so that every response fits in a frame.
+
+#define SERVER_MAX_FRAME (1 << 20)
+#define SERVER_FRAME_HEADER 9
+#define SERVER_MAX_OBJECT (9 + MAX_TYPE_LEN - 1 + 8) // Largest object in a response, with its kNN distance
+#define SERVER_MAX_RESULTS ((SERVER_MAX_FRAME - (SERVER_FRAME_HEADER - 4) - 4) / SERVER_MAX_OBJECT)
+#define SERVER_INPUT_LIMIT (2 * SERVER_MAX_FRAME) // Unanswered request bytes above which a connection is not read
+#define SERVER_OUTPUT_LIMIT (16 << 20) // Unsent response bytes above which a connection's requests wait and it is not read
+#define SERVER_MAX_WORKERS 64
+
+enum serve_op
+{
+    SERVE_INSERT = 1,
+    SERVE_WINDOW = 2,
+    SERVE_RADIUS = 3,
+    SERVE_KNN = 4
+};
+
+enum serve_status
+{
+    SERVE_OK = 0,
+    SERVE_BAD_REQUEST = 1
+};
+
+#ifdef HAVE_EPOLL
+
+// Stores a growable byte buffer
+struct byte_buffer
+{
+    unsigned char * data;
+    size_t size;
+    size_t capacity;
+};
+
+// Stores the state of a client connection. It is freed when its last reference goes: the epoll registration holds one and a
+// worker answering its requests holds another.
+struct connection
+{
+    int fd;
+    pthread_mutex_t lock;
+    struct byte_buffer input;    // Received bytes not yet taken by a worker
+    struct byte_buffer output;   // Responses not yet sent
+    int refs;
+    bool busy;                   // Queued for or held by a worker
+    bool closing;                // Failed or broke the protocol; no more requests are answered
+    bool eof;                    // The peer shut down its side; the requests received are still answered
+    unsigned int events;         // Events the connection is registered for, see watch_connection
+    struct connection * next_job;
+};
+
+// Stores the state shared by the event loop and the workers
+struct server
+{
+    CONCURRENT_R_TREE tree;
+    int epoll_fd;
+    pthread_mutex_t lock;        // Guards the job queue and stopping
+    pthread_cond_t job_ready;
+    struct connection * first_job;
+    struct connection * last_job;
+    bool stopping;
+};
+
+static volatile sig_atomic_t server_interrupted = 0;
+
+static void server_signal(int signal_number) {
+    server_interrupted = 1;
+}
+
+static void buffer_append(struct byte_buffer* buffer, const void* data, size_t length) {
+    if (buffer->size + length > buffer->capacity) {
+        buffer->capacity = 2 * (buffer->size + length);
+        buffer->data = (unsigned char *)realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += length;
+}
+
+// Drops the first length bytes of a buffer
+static void buffer_consume(struct byte_buffer* buffer, size_t length) {
+    memmove(buffer->data, buffer->data + length, buffer->size - length);
+    buffer->size -= length;
+}
+
+// Returns the number of leading bytes of input forming complete frames; malformed is set if a frame has an impossible length
+static size_t complete_frames(const struct byte_buffer* input, bool* malformed) {
+    size_t used = 0;
+    *malformed = false;
+    while (input->size - used >= 4) {
+        unsigned int length;
+        memcpy(&length, input->data + used, 4);
+        if (length < SERVER_FRAME_HEADER - 4 || length > SERVER_MAX_FRAME) {
+            *malformed = true;
+            return used;
+        }
+        if (input->size - used - 4 < length)
+            break;
+        used += 4 + (size_t)length;
+    }
+    return used;
+}
+
+// Appends an object to a response
+static void put_object(struct byte_buffer* out, OBJ object) {
+    unsigned char type_length = (unsigned char)strlen(object->type);
+    buffer_append(out, &object->x, 4);
+    buffer_append(out, &object->y, 4);
+    buffer_append(out, &type_length, 1);
+    buffer_append(out, object->type, type_length);
+}
+
+// Answers one request frame (without its length), appending the response frame to out
+static void answer_request(CONCURRENT_R_TREE tree, const unsigned char* frame, unsigned int length, struct byte_buffer* out) {
+    unsigned int id;
+    unsigned char op = frame[4];
+    memcpy(&id, frame, 4);
+    const unsigned char* payload = frame + 5;
+    unsigned int payload_length = length - 5;
+
+    size_t start = out->size;
+    unsigned char header[SERVER_FRAME_HEADER] = {0};
+    buffer_append(out, header, SERVER_FRAME_HEADER);
+    unsigned char status = SERVE_OK;
+    int ints[4];
+    unsigned int max_results;
+    switch (op) {
+        case SERVE_INSERT: {
+            unsigned char type_length = payload_length >= 17 ? payload[16] : 0;
+            if (payload_length < 17 || payload_length != 17u + type_length || type_length >= MAX_TYPE_LEN) {
+                status = SERVE_BAD_REQUEST;
+                break;
+            }
+            memcpy(ints, payload, 16);
+            if (ints[0] > ints[2] || ints[1] > ints[3]) {
+                status = SERVE_BAD_REQUEST;
+                break;
+            }
+            char type[MAX_TYPE_LEN];
+            memcpy(type, payload + 17, type_length);
+            type[type_length] = '\0';
+            OBJ object = create_new_object((int)(((long long)ints[0] + ints[2]) / 2), (int)(((long long)ints[1] + ints[3]) / 2), type);
+            concurrent_insert_rect(tree, object, create_new_rect(ints[0], ints[1], ints[2], ints[3]));
+            break;
+        }
+        case SERVE_WINDOW:
+        case SERVE_RADIUS:
+        case SERVE_KNN: {
+            unsigned int expected = op == SERVE_WINDOW ? 21 : (op == SERVE_RADIUS ? 20 : 12);
+            if (payload_length != expected) {
+                status = SERVE_BAD_REQUEST;
+                break;
+            }
+            memcpy(&max_results, payload + expected - 4, 4);
+            max_results = max_results < SERVER_MAX_RESULTS ? max_results : SERVER_MAX_RESULTS;
+            OBJ* found = (OBJ *)malloc(sizeof(OBJ) * (max_results > 0 ? max_results : 1));
+            double* distances = NULL;
+            int num_found = 0;
+            if (op == SERVE_WINDOW) {
+                memcpy(ints, payload, 16);
+                struct rectangle window = {ints[0], ints[1], ints[2], ints[3]};
+                enum window_predicate predicate = payload[16] <= WINDOW_WITHIN ? (enum window_predicate)payload[16] : WINDOW_INTERSECTS;
+                concurrent_search_window(tree, &window, predicate, found, (int)max_results, &num_found);
+            } else if (op == SERVE_RADIUS) {
+                double radius;
+                memcpy(ints, payload, 8);
+                memcpy(&radius, payload + 8, 8);
+                concurrent_search_radius(tree, ints[0], ints[1], radius, found, (int)max_results, &num_found);
+            } else {
+                memcpy(ints, payload, 8);
+                distances = (double *)malloc(sizeof(double) * (max_results > 0 ? max_results : 1));
+                num_found = concurrent_find_k_nearest_neighbors(tree, ints[0], ints[1], (int)max_results, found, distances);
+            }
+            unsigned int count = (unsigned int)num_found;
+            buffer_append(out, &count, 4);
+            for (int i = 0; i < num_found; ++i) {
+                put_object(out, found[i]);
+                if (distances != NULL)
+                    buffer_append(out, &distances[i], 8);
+            }
+            free(found);
+            free(distances);
+            break;
+        }
+        default:
+            status = SERVE_BAD_REQUEST;
+    }
+    if (status != SERVE_OK)
+        out->size = start + SERVER_FRAME_HEADER;
+    unsigned int response_length = (unsigned int)(out->size - start - 4);
+    memcpy(out->data + start, &response_length, 4);
+    memcpy(out->data + start + 4, &id, 4);
+    out->data[start + 8] = status;
+}
+
+// Sends as much pending output as the socket takes; returns false if the connection failed
+static bool send_output(struct connection* conn) {
+    while (conn->output.size > 0) {
+        ssize_t sent = send(conn->fd, conn->output.data, conn->output.size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        buffer_consume(&conn->output, (size_t)sent);
+    }
+    return true;
+}
+
+// Registers for EPOLLOUT while output is pending, and for EPOLLIN only while neither the unanswered requests nor the unsent
+// responses are over their limit, so a client that does not read its responses cannot make the server buffer without bound.
+// Called with the connection locked whenever either buffer changes.
+static void watch_connection(struct server* server, struct connection* conn) {
+    unsigned int events = 0;
+    if (!conn->eof && conn->input.size < SERVER_INPUT_LIMIT && conn->output.size < SERVER_OUTPUT_LIMIT)
+        events |= EPOLLIN;
+    if (conn->output.size > 0)
+        events |= EPOLLOUT;
+    if (events == conn->events || conn->closing)
+        return;
+    struct epoll_event event = {events, {.ptr = conn}};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+}
+
+// Drops a reference to a connection, closing and freeing it with the last one; called with the connection locked
+static void release_connection(struct connection* conn) {
+    bool last = --conn->refs == 0;
+    pthread_mutex_unlock(&conn->lock);
+    if (!last)
+        return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->input.data);
+    free(conn->output.data);
+    free(conn);
+}
+
+// Returns whether a connection is finished: it failed, or the peer shut down its side and every complete request it sent has
+// been answered and sent. Called with the connection locked.
+static bool connection_finished(struct connection* conn) {
+    bool malformed;
+    return conn->closing || (conn->eof && !conn->busy && conn->output.size == 0 && complete_frames(&conn->input, &malformed) == 0);
+}
+
+// Unregisters a finished connection and drops the reference of the registration, unlocking it; otherwise leaves it locked and
+// returns false. Only the event loop calls it, so no event for the connection is pending afterwards.
+static bool finish_connection(struct server* server, struct connection* conn) {
+    if (!connection_finished(conn))
+        return false;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    release_connection(conn);
+    return true;
+}
+
+// Queues a connection with complete requests for the workers unless it is already queued or its output is backed up; called
+// with the connection locked
+static void schedule_connection(struct server* server, struct connection* conn) {
+    bool malformed;
+    if (conn->busy || conn->closing || conn->output.size >= SERVER_OUTPUT_LIMIT || complete_frames(&conn->input, &malformed) == 0)
+        return;
+    conn->busy = true;
+    conn->refs += 1;
+    pthread_mutex_lock(&server->lock);
+    conn->next_job = NULL;
+    if (server->last_job != NULL)
+        server->last_job->next_job = conn;
+    else
+        server->first_job = conn;
+    server->last_job = conn;
+    pthread_cond_signal(&server->job_ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Takes queued connections and answers their complete requests in batches until the server stops
+static void* server_worker(void* arg) {
+    struct server* server = (struct server *)arg;
+    struct byte_buffer requests = {NULL, 0, 0};
+    struct byte_buffer responses = {NULL, 0, 0};
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->first_job == NULL && !server->stopping)
+            pthread_cond_wait(&server->job_ready, &server->lock);
+        struct connection* conn = server->first_job;
+        if (conn == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        server->first_job = conn->next_job;
+        if (server->first_job == NULL)
+            server->last_job = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_mutex_lock(&conn->lock);
+        while (!conn->closing && conn->output.size < SERVER_OUTPUT_LIMIT) {
+            bool malformed;
+            size_t ready = complete_frames(&conn->input, &malformed);
+            if (ready == 0)
+                break;
+            // Copy the batch out so the event loop can keep reading while it is answered. The requests stay counted in the input
+            // until answered, and a batch stops once its responses reach the output limit.
+            requests.size = 0;
+            buffer_append(&requests, conn->input.data, ready);
+            pthread_mutex_unlock(&conn->lock);
+
+            responses.size = 0;
+            size_t used = 0;
+            while (used < ready && responses.size < SERVER_OUTPUT_LIMIT) {
+                unsigned int length;
+                memcpy(&length, requests.data + used, 4);
+                answer_request(server->tree, requests.data + used + 4, length, &responses);
+                used += 4 + (size_t)length;
+            }
+
+            pthread_mutex_lock(&conn->lock);
+            if (conn->closing)
+                break;
+            buffer_consume(&conn->input, used);
+            buffer_append(&conn->output, responses.data, responses.size);
+            if (!send_output(conn)) {
+                // The event loop sees the shutdown as a hang up and unregisters the connection
+                conn->closing = true;
+                shutdown(conn->fd, SHUT_RDWR);
+                break;
+            }
+            watch_connection(server, conn);
+        }
+        conn->busy = false;
+        // A shut down peer with nothing left to answer or send: hang up so the event loop sees it and closes the connection
+        if (!conn->closing && connection_finished(conn))
+            shutdown(conn->fd, SHUT_RDWR);
+        release_connection(conn);
+    }
+    free(requests.data);
+    free(responses.data);
+    return NULL;
+}
+
+// Opens the listening socket for "unix:PATH" or "tcp:PORT" (localhost only); returns -1 on failure
+static int open_listener(const char* address) {
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(local.sun_path))
+            return -1;
+        strcpy(local.sun_path, address + 5);
+        unlink(local.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons((unsigned short)atoi(address + 4));
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int reuse = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads what is available on a connection up to SERVER_INPUT_LIMIT and schedules its complete requests. The connection is
+// unregistered and its reference dropped once it fails, the peer sends a malformed frame, or the peer has shut down its side and
+// every request it sent has been answered.
+static void read_connection(struct server* server, struct connection* conn) {
+    unsigned char chunk[65536];
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->closing && !conn->eof && conn->input.size < SERVER_INPUT_LIMIT) {
+        ssize_t received = recv(conn->fd, chunk, sizeof(chunk), 0);
+        if (received > 0) {
+            buffer_append(&conn->input, chunk, (size_t)received);
+            continue;
+        }
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received == 0)
+            conn->eof = true;
+        else
+            conn->closing = true;
+    }
+    bool malformed;
+    complete_frames(&conn->input, &malformed);
+    conn->closing = conn->closing || malformed;
+    if (finish_connection(server, conn))
+        return;
+    watch_connection(server, conn);
+    schedule_connection(server, conn);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Serves the index at address until interrupted; returns the process exit status
+int run_server(const char* address, const char* data_path) {
+    R_TREE r_tree = data_path != NULL ? load_r_tree(data_path) : create_new_r_tree();
+    if (r_tree == NULL) {
+        fprintf(stderr, "Cannot read %s\n", data_path);
+        return 1;
+    }
+
+    int listen_fd = open_listener(address);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Cannot listen on %s (expected unix:PATH or tcp:PORT)\n", address);
+        return 1;
+    }
+    struct server server;
+    memset(&server, 0, sizeof(server));
+    server.tree = create_concurrent_r_tree(r_tree);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.job_ready, NULL);
+    struct epoll_event listen_event = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+
+    // Interrupt epoll_wait on SIGINT and SIGTERM; broken connections are reported by send instead of SIGPIPE
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = cores < 1 ? 1 : (cores > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS : (int)cores);
+    pthread_t workers[SERVER_MAX_WORKERS];
+    for (int i = 0; i < num_workers; ++i)
+        pthread_create(&workers[i], NULL, server_worker, &server);
+    printf("Serving %d objects on %s with %d workers\n", subtree_count(r_tree->root), address, num_workers);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    while (!server_interrupted) {
+        int num_events = epoll_wait(server.epoll_fd, events, 64, -1);
+        for (int i = 0; i < num_events; ++i) {
+            struct connection* conn = (struct connection *)events[i].data.ptr;
+            if (conn == NULL) {
+                int fd;
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    conn = (struct connection *)calloc(1, sizeof(struct connection));
+                    conn->fd = fd;
+                    conn->refs = 1;
+                    conn->events = EPOLLIN;
+                    pthread_mutex_init(&conn->lock, NULL);
+                    struct epoll_event event = {EPOLLIN, {.ptr = conn}};
+                    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&conn->lock);
+                if (!conn->closing && send_output(conn)) {
+                    watch_connection(&server, conn);
+                    // Requests held back while the output was backed up can go now
+                    schedule_connection(&server, conn);
+                } else if (!conn->closing) {
+                    conn->closing = true;
+                    shutdown(conn->fd, SHUT_RDWR);
+                }
+                if (finish_connection(&server, conn))
+                    continue;
+                pthread_mutex_unlock(&conn->lock);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_connection(&server, conn);
+        }
+    }
+
+    printf("Stopping server\n");
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.job_ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < num_workers; ++i)
+        pthread_join(workers[i], NULL);
+    close(listen_fd);
+    close(server.epoll_fd);
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+    release_concurrent_r_tree(server.tree);
+    return 0;
+}
+
+#else
+
+int run_server(const char* address, const char* data_path) {
+    fprintf(stderr, "--serve needs epoll and is only available on Linux\n");
+    return 1;
+}
+
+#endif
+
+//******************************************************************************************************************************************************************
+
+
+
+
+//******************************************************************************************************************************************************************
+// Load generator
+//
+// --loadgen ADDRESS [RATE] [SECONDS] [CONNECTIONS] [MIX] [FILE] replays a query mix against a --serve instance at RATE requests per
+// second spread over CONNECTIONS connections, each with one request outstanding at a time. Requests are scheduled at fixed
+// intervals and latency is measured from the time a request should have been sent, so a stall is charged to every request it
+// delayed (coordinated omission correction) rather than only to the one in flight. Latencies go into log-linear histograms in the
+// style of HdrHistogram. A summary is printed, and FILE, if given, receives the summary and the full percentile distribution.
+// MIX weighs the operations in percent, e.g. "knn:70,window:25,insert:5"; radius queries may be mixed in too.
+
+#define LATENCY_SUB_BUCKETS 128    // Buckets per power of two, for a relative error below 1%
+#define LATENCY_BUCKETS (34 * LATENCY_SUB_BUCKETS) // Exact values below 256, then powers of two up to LATENCY_MAX_NS
+#define LATENCY_MAX_NS (1LL << 40)
+#define LOADGEN_OPERATIONS 4       // kNN, window, radius and insert, in this order
+#define LOADGEN_WINDOW (BENCH_EXTENT / 100) // Side of the query windows
+#define LOADGEN_RADIUS (BENCH_EXTENT / 200)
+
+// Stores a latency histogram: values below 2 * LATENCY_SUB_BUCKETS ns are counted exactly, larger ones in LATENCY_SUB_BUCKETS
+// buckets of equal width per power of two
+struct latency_histogram
+{
+    long long counts[LATENCY_BUCKETS];
+    long long total;
+    long long max;
+};
+
+#ifdef HAVE_EPOLL
+
+static const char* loadgen_names[LOADGEN_OPERATIONS] = {"knn", "window", "radius", "insert"};
+
+// Stores the state of one load generating connection
+struct loadgen_worker
+{
+    const char* address;
+    long long start_ns;
+    long long end_ns;
+    long long interval_ns;       // Time between the scheduled starts of two requests of the connection
+    int mix[LOADGEN_OPERATIONS]; // Cumulative percentages of the operations
+    unsigned int seed;
+    long long errors;
+    struct latency_histogram latency[LOADGEN_OPERATIONS]; // Measured from the scheduled start
+    struct latency_histogram service;                      // Measured from the actual send, for comparison
+};
+
+static long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int latency_bucket(long long value) {
+    if (value < 2 * LATENCY_SUB_BUCKETS)
+        return (int)value;
+    int msb = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = msb - 7;
+    return 2 * LATENCY_SUB_BUCKETS + (msb - 8) * LATENCY_SUB_BUCKETS + (int)((value >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+// Returns the highest value counted by a bucket
+static long long bucket_value(int index) {
+    if (index < 2 * LATENCY_SUB_BUCKETS)
+        return index;
+    int k = index - 2 * LATENCY_SUB_BUCKETS;
+    int shift = k / LATENCY_SUB_BUCKETS + 1;
+    long long sub = LATENCY_SUB_BUCKETS + k % LATENCY_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void record_latency(struct latency_histogram* histogram, long long value) {
+    value = value < 0 ? 0 : (value >= LATENCY_MAX_NS ? LATENCY_MAX_NS - 1 : value);
+    histogram->counts[latency_bucket(value)] += 1;
+    histogram->total += 1;
+    histogram->max = value > histogram->max ? value : histogram->max;
+}
+
+static void merge_histogram(struct latency_histogram* into, const struct latency_histogram* from) {
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+// Returns the latency below which the given percentage of the recorded values lie
+static long long latency_percentile(const struct latency_histogram* histogram, double percentile) {
+    long long rank = (long long)ceil(percentile / 100.0 * histogram->total);
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= rank && seen > 0)
+            return bucket_value(i) < histogram->max ? bucket_value(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+// Connects to a server listening on "unix:PATH" or "tcp:PORT"; returns -1 on failure
+static int connect_to_server(const char* address) {
+    int fd = -1;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un remote;
+        memset(&remote, 0, sizeof(remote));
+        remote.sun_family = AF_UNIX;
+        strncpy(remote.sun_path, address + 5, sizeof(remote.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&remote, sizeof(remote)) < 0) {
+            close(fd);
+            fd = -1;
         }
-    } else {
-        for (int i = 0; i < node->count; ++i) {
-            OBJ object = node->objects[i];
-            // Draw bounding rectangle around point
-            int rectSize = 5; // Size of bounding rectangle
-            SDL_Rect pointRect = {object->x - rectSize/2, object->y - rectSize/2, rectSize, rectSize};
-            SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0xFF, 0xFF);
-            SDL_RenderDrawRect(renderer, &pointRect);
-            SDL_RenderDrawPoint(renderer, object->x, object->y);
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in remote;
+        memset(&remote, 0, sizeof(remote));
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons((unsigned short)atoi(address + 4));
+        remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int no_delay = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&remote, sizeof(remote)) < 0) {
+            close(fd);
+            fd = -1;
         }
     }
+    return fd;
 }
 
-// Renders yellow boxes around points within the specified radius
-void render_points_within_radius(int user_x , int user_y , OBJ found_objects[], int num_found, double radius) {
-    SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF); // Yellow color
-    int rectSize = 10; // Size of the yellow box
-    for (int i = 0; i < num_found; ++i) {
-        OBJ object = found_objects[i];
-        SDL_Rect rect = {object->x - rectSize/2, object->y - rectSize/2, rectSize, rectSize};
-        SDL_RenderDrawRect(renderer, &rect);
-        SDL_RenderDrawLine(renderer, user_x, user_y, object->x, object->y);
-        SDL_RenderPresent(renderer);
+// Reads exactly length bytes
+static bool read_fully(int fd, unsigned char* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = read(fd, data, length);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        data += received;
+        length -= (size_t)received;
     }
-    SDL_RenderPresent(renderer);
-}
-
-
-// Renders the R-Tree
-void render_r_tree(R_TREE r_tree)
-{
-    SDL_RenderClear(renderer);
-    render_r_tree_node(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
-    SDL_RenderPresent(renderer);
+    return true;
 }
 
-//******************************************************************************************************************************************************************
-// Initialize the priority queue
-/*PriorityQueue* init_priority_queue(int capacity) {
-    PriorityQueue* pq = (PriorityQueue*)malloc(sizeof(PriorityQueue));
-    pq->heap = (PriorityNode*)malloc(capacity * sizeof(PriorityNode));
-    pq->size = 0;
-    pq->capacity = capacity;
-    return pq;
+// Encodes a random request of the given operation and returns its frame size
+static size_t loadgen_request(int operation, unsigned int id, unsigned int* seed, unsigned char* frame) {
+    int x = rand_r(seed) % BENCH_EXTENT;
+    int y = rand_r(seed) % BENCH_EXTENT;
+    unsigned char op;
+    unsigned char payload[32];
+    unsigned int payload_length;
+    if (operation == 0) {
+        unsigned int k = K_NEAREST_NEIGHBORS;
+        op = SERVE_KNN;
+        memcpy(payload, &x, 4);
+        memcpy(payload + 4, &y, 4);
+        memcpy(payload + 8, &k, 4);
+        payload_length = 12;
+    } else if (operation == 1) {
+        int window[4] = {x, y, x + LOADGEN_WINDOW, y + LOADGEN_WINDOW};
+        unsigned int max_results = SERVER_MAX_RESULTS;
+        op = SERVE_WINDOW;
+        memcpy(payload, window, 16);
+        payload[16] = WINDOW_INTERSECTS;
+        memcpy(payload + 17, &max_results, 4);
+        payload_length = 21;
+    } else if (operation == 2) {
+        double radius = LOADGEN_RADIUS;
+        unsigned int max_results = SERVER_MAX_RESULTS;
+        op = SERVE_RADIUS;
+        memcpy(payload, &x, 4);
+        memcpy(payload + 4, &y, 4);
+        memcpy(payload + 8, &radius, 8);
+        memcpy(payload + 16, &max_results, 4);
+        payload_length = 20;
+    } else {
+        int rect[4] = {x, y, x, y};
+        const char* type = "Loadgen";
+        op = SERVE_INSERT;
+        memcpy(payload, rect, 16);
+        payload[16] = (unsigned char)strlen(type);
+        memcpy(payload + 17, type, payload[16]);
+        payload_length = 17 + payload[16];
+    }
+    unsigned int length = 5 + payload_length;
+    memcpy(frame, &length, 4);
+    memcpy(frame + 4, &id, 4);
+    frame[8] = op;
+    memcpy(frame + SERVER_FRAME_HEADER, payload, payload_length);
+    return 4 + (size_t)length;
 }
 
-// Insert a node into the priority queue
-void insert_into_priority_queue(PriorityQueue* pq, OBJ object, double distance) {
-    // Check if the object is already in the priority queue
-    for (int i = 0; i < pq->size; ++i) {
-        if (pq->heap[i].object->x == object->x &&
-            pq->heap[i].object->y == object->y &&
-            strcmp(pq->heap[i].object->type, object->type) == 0) {
-            // If the object is already present, skip the insertion
-            return;
+// Sends requests on one connection at their scheduled times until the run ends, waiting for each response before the next request
+static void* loadgen_connection(void* arg) {
+    struct loadgen_worker* worker = (struct loadgen_worker *)arg;
+    int fd = connect_to_server(worker->address);
+    if (fd < 0) {
+        worker->errors += 1;
+        return NULL;
+    }
+    unsigned char frame[64];
+    unsigned char* response = (unsigned char *)malloc(SERVER_MAX_FRAME);
+    long long scheduled = worker->start_ns;
+    for (unsigned int id = 1; scheduled < worker->end_ns; ++id, scheduled += worker->interval_ns) {
+        struct timespec wake = {(time_t)(scheduled / 1000000000LL), (long)(scheduled % 1000000000LL)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+            ;
+        int choice = rand_r(&worker->seed) % 100;
+        int operation = 0;
+        while (operation < LOADGEN_OPERATIONS - 1 && choice >= worker->mix[operation])
+            ++operation;
+        size_t size = loadgen_request(operation, id, &worker->seed, frame);
+
+        long long sent = monotonic_ns();
+        unsigned int length, response_id;
+        if (!write_fully(fd, frame, size) || !read_fully(fd, (unsigned char *)&length, 4) || length < SERVER_FRAME_HEADER - 4 ||
+            length > SERVER_MAX_FRAME || !read_fully(fd, response, length)) {
+            worker->errors += 1;
+            break;
         }
+        long long done = monotonic_ns();
+        memcpy(&response_id, response, 4);
+        if (response_id != id || response[4] != SERVE_OK)
+            worker->errors += 1;
+        record_latency(&worker->latency[operation], done - scheduled);
+        record_latency(&worker->service, done - sent);
     }
+    free(response);
+    close(fd);
+    return NULL;
+}
 
-    // If the object is not already present, insert it into the priority queue
-    if (pq->size == pq->capacity)
-        return; // Queue is full
-
-    // Create a new priority node
-    PriorityNode newNode;
-    newNode.object = object;
-    newNode.distance = distance;
+// Prints one summary line of a histogram, in microseconds
+static void print_latency_line(FILE* out, const char* name, const struct latency_histogram* histogram) {
+    fprintf(out, "%-8s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, histogram->total,
+            latency_percentile(histogram, 50.0) / 1000.0, latency_percentile(histogram, 90.0) / 1000.0,
+            latency_percentile(histogram, 99.0) / 1000.0, latency_percentile(histogram, 99.9) / 1000.0, histogram->max / 1000.0);
+}
 
-    // Add the node to the end of the queue
-    pq->heap[pq->size++] = newNode;
+static void print_loadgen_summary(FILE* out, struct latency_histogram latency[], const struct latency_histogram* all, const struct latency_histogram* service,
+                                  double seconds, long long errors) {
+    fprintf(out, "%.0f requests/s over %.1f s, %lld errors\n", all->total / seconds, seconds, errors);
+    fprintf(out, "%-8s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < LOADGEN_OPERATIONS; ++i)
+        if (latency[i].total > 0)
+            print_latency_line(out, loadgen_names[i], &latency[i]);
+    print_latency_line(out, "all", all);
+    print_latency_line(out, "service", service);
+}
 
-    // Perform heapify up to maintain heap property
-    int i = pq->size - 1;
-    while (i > 0 && pq->heap[(i - 1) / 2].distance > pq->heap[i].distance) {
-        // Swap parent and child
-        PriorityNode temp = pq->heap[(i - 1) / 2];
-        pq->heap[(i - 1) / 2] = pq->heap[i];
-        pq->heap[i] = temp;
-        // Move up to parent
-        i = (i - 1) / 2;
+// Parses a mix like "knn:70,window:25,insert:5" into cumulative percentages; returns false unless it adds up to 100
+static bool parse_loadgen_mix(const char* text, int mix[]) {
+    int weights[LOADGEN_OPERATIONS] = {0};
+    char copy[128];
+    strncpy(copy, text, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    char* saved;
+    for (char* token = strtok_r(copy, ",", &saved); token != NULL; token = strtok_r(NULL, ",", &saved)) {
+        char name[16];
+        int weight;
+        if (sscanf(token, "%15[a-z]:%d", name, &weight) != 2 || weight < 0)
+            return false;
+        int i = 0;
+        while (i < LOADGEN_OPERATIONS && strcmp(name, loadgen_names[i]) != 0)
+            ++i;
+        if (i == LOADGEN_OPERATIONS)
+            return false;
+        weights[i] += weight;
     }
+    int total = 0;
+    for (int i = 0; i < LOADGEN_OPERATIONS; ++i) {
+        total += weights[i];
+        mix[i] = total;
+    }
+    return total == 100;
 }
 
+// Runs the load generator; returns the process exit status
+int run_loadgen(const char* address, double rate, double seconds, int connections, const char* mix_text, const char* summary_path) {
+    int mix[LOADGEN_OPERATIONS];
+    if (rate <= 0 || seconds <= 0 || connections < 1 || !parse_loadgen_mix(mix_text, mix)) {
+        fprintf(stderr, "Usage: --loadgen ADDRESS [RATE] [SECONDS] [CONNECTIONS] [MIX like knn:70,window:25,insert:5] [FILE]\n");
+        return 1;
+    }
+    struct loadgen_worker* workers = (struct loadgen_worker *)calloc(connections, sizeof(struct loadgen_worker));
+    pthread_t* threads = (pthread_t *)malloc(sizeof(pthread_t) * connections);
+    long long interval = (long long)(1e9 * connections / rate);
+    long long start = monotonic_ns() + 100000000LL;
+    for (int i = 0; i < connections; ++i) {
+        workers[i].address = address;
+        // Stagger the connections so the requests are spread evenly over each interval
+        workers[i].start_ns = start + interval * i / connections;
+        workers[i].end_ns = start + (long long)(seconds * 1e9);
+        workers[i].interval_ns = interval > 0 ? interval : 1;
+        memcpy(workers[i].mix, mix, sizeof(mix));
+        workers[i].seed = 1234567u + 7919u * i;
+        pthread_create(&threads[i], NULL, loadgen_connection, &workers[i]);
+    }
 
-// Extract the minimum node from the priority queue
-PriorityNode extract_min_from_priority_queue(PriorityQueue* pq) {
-    PriorityNode minNode = pq->heap[0];
-    // Replace the root with the last node
-    pq->heap[0] = pq->heap[pq->size - 1];
-    pq->size--;
-    // Perform heapify down to maintain heap property
-    int i = 0;
-    while (true) {
-        int leftChild = 2 * i + 1;
-        int rightChild = 2 * i + 2;
-        int smallest = i;
-        if (leftChild < pq->size && pq->heap[leftChild].distance < pq->heap[smallest].distance)
-            smallest = leftChild;
-        if (rightChild < pq->size && pq->heap[rightChild].distance < pq->heap[smallest].distance)
-            smallest = rightChild;
-        if (smallest != i) {
-            // Swap parent and smallest child
-            PriorityNode temp = pq->heap[i];
-            pq->heap[i] = pq->heap[smallest];
-            pq->heap[smallest] = temp;
-            i = smallest; // Update the index
+    struct latency_histogram* latency = (struct latency_histogram *)calloc(LOADGEN_OPERATIONS + 2, sizeof(struct latency_histogram));
+    struct latency_histogram* all = &latency[LOADGEN_OPERATIONS];
+    struct latency_histogram* service = &latency[LOADGEN_OPERATIONS + 1];
+    long long errors = 0;
+    for (int i = 0; i < connections; ++i) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < LOADGEN_OPERATIONS; ++op) {
+            merge_histogram(&latency[op], &workers[i].latency[op]);
+            merge_histogram(all, &workers[i].latency[op]);
+        }
+        merge_histogram(service, &workers[i].service);
+        errors += workers[i].errors;
+    }
+
+    print_loadgen_summary(stdout, latency, all, service, seconds, errors);
+    if (summary_path != NULL) {
+        FILE* out = fopen(summary_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot write %s\n", summary_path);
         } else {
-            break;
+            print_loadgen_summary(out, latency, all, service, seconds, errors);
+            // Percentile distribution of all requests in the layout HdrHistogram tools plot
+            fprintf(out, "\n%12s %14s %10s %14s\n", "Value(us)", "Percentile", "TotalCount", "1/(1-Percentile)");
+            long long seen = 0;
+            for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+                if (all->counts[i] == 0)
+                    continue;
+                seen += all->counts[i];
+                double fraction = (double)seen / all->total;
+                fprintf(out, "%12.3f %14.12f %10lld %14.2f\n", bucket_value(i) / 1000.0, fraction, seen, fraction < 1.0 ? 1.0 / (1.0 - fraction) : INFINITY);
+            }
+            fclose(out);
         }
     }
-    return minNode;
+    free(latency);
+    free(threads);
+    free(workers);
+    return errors == 0 ? 0 : 1;
 }
 
+#else
 
-// Free the memory allocated for the priority queue
-void free_priority_queue(PriorityQueue* pq) {
-    free(pq->heap);
-    free(pq);
+int run_loadgen(const char* address, double rate, double seconds, int connections, const char* mix_text, const char* summary_path) {
+    fprintf(stderr, "--loadgen needs the Linux socket support of --serve\n");
+    return 1;
 }
 
-void search_k_nearest_neighbors(NODE node, RECT rect, int user_x, int user_y, PriorityQueue* pq) {
-    // If the node is null, return
-    if (node == NULL)
-        return;
+#endif
 
-    // If the node is a leaf node
-    if (node->is_leaf) {
-        // Iterate through the objects in the leaf node
-        for (int i = 0; i < M && (node->objects)[i] != NULL; ++i) {
-            int obj_x = (node->objects)[i]->x;
-            int obj_y = (node->objects)[i]->y;
-            double distance = euclidean_distance(user_x, user_y, obj_x, obj_y);
+//******************************************************************************************************************************************************************
 
-            // Check if the priority queue is not full or the distance is less than the maximum distance in the queue
-            if (pq->size < K_NEAREST_NEIGHBORS || distance < pq->heap[0].distance) {
-                // Check if the object is already in the priority queue
-                bool found = false;
-                for (int j = 0; j < pq->size; ++j) {
-                    if (pq->heap[j].object == (node->objects)[i]) {
-                        found = true;
-                        break;
-                    }
-                }
-                // If the object is not already present, insert it into the priority queue
-                if (!found) {
-                    insert_into_priority_queue(pq, (node->objects)[i], distance);
-                    // If the priority queue size exceeds K_NEAREST_NEIGHBORS, remove the farthest object
-                    if (pq->size > K_NEAREST_NEIGHBORS) {
-                        extract_min_from_priority_queue(pq);
-                    }
-                }
-            }
-        }
-    } else {
-        // If the node is an internal node
-        // Calculate the minimum distance between the user and the bounding box of the node
-        RECT node_rect = bounding_box(node);
-        double min_dist = INFINITY;
-        double max_dist = 0.0;
-        for (int i = 0; i < node->count; ++i) {
-            RECT child_rect = node->regions[i];
-            double dist_to_rect = euclidean_distance(user_x, user_y, (child_rect->min_x + child_rect->max_x) / 2, (child_rect->min_y + child_rect->max_y) / 2);
-            min_dist = fmin(min_dist, dist_to_rect);
-            max_dist = fmax(max_dist, dist_to_rect);
-        }
 
-        // If the minimum distance is greater than the maximum distance in the priority queue, we can prune this node
-        if (min_dist > pq->heap[0].distance) {
-            free(node_rect);
-            return;
-        }
 
-        // If the maximum distance is less than or equal to the minimum distance in the priority queue, we can insert all objects in this node
-        if (max_dist <= pq->heap[0].distance) {
-            for (int i = 0; i < node->count; ++i) {
-                NODE child_node = node->children[i];
-                if (child_node->is_leaf) {
-                    for (int j = 0; j < child_node->count; ++j) {
-                        OBJ obj = child_node->objects[j];
-                        double dist = euclidean_distance(user_x, user_y, obj->x, obj->y);
-                        insert_into_priority_queue(pq, obj, dist);
-                        if (pq->size > K_NEAREST_NEIGHBORS) {
-                            extract_min_from_priority_queue(pq);
-                        }
-                    }
-                }
-            }
-            free(node_rect);
-            return;
-        }
 
-        // Otherwise, recursively search the child nodes
-        if (rect_intersects(rect, node_rect)) {
-            for (int i = 0; i < M && (node->children)[i] != NULL; ++i) {
-                search_k_nearest_neighbors((node->children)[i], (node->regions)[i], user_x, user_y, pq);
-            }
-        }
-        free(node_rect);
-    }
-}*/
-//********************************************************************************************************************************************************
+//******************************************************************************************************************************************************************
+// Headless rendering
+//
+// --render-out FILE [DATA [X Y RADIUS]] draws what the viewer would show into a PPM image without opening a window, for
+// snapshots on machines without a display. The shapes are gathered by the same traversal as the viewer, including its culling
+// and level of detail, and rasterised in software into tiles that worker threads take in turn.
 
-OBJ find_nearest_neighbor(NODE root, int user_x, int user_y) {
-    OBJ nearest_neighbor = NULL;
-    double min_distance = INFINITY;
+#define RENDER_TILE 64
+#define RENDER_MAX_THREADS 64
 
-    // Traverse the R-Tree and find the nearest neighbor
-    nearest_neighbor = search_nearest_neighbor(root, bounding_box(root), user_x, user_y, nearest_neighbor, &min_distance);
+// Stores an RGB image
+struct framebuffer
+{
+    int width;
+    int height;
+    unsigned char* pixels;
+};
 
-    return nearest_neighbor;
+// Stores the shapes of a frame and the tiles still to rasterise
+struct render_job
+{
+    struct framebuffer* image;
+    const struct render_batch* tree;   // Outlines, points and density rectangles of the tree
+    const struct render_batch* query;  // Boxes around the query results and the polyline joining them to the user, if any
+    int user_x;
+    int user_y;
+    int num_tiles_x;
+    int num_tiles;
+    int next_tile;
+};
 
+static void plot_pixel(struct framebuffer* image, const SDL_Rect* clip, int x, int y, const Uint8 color[3]) {
+    if (x < clip->x || x >= clip->x + clip->w || y < clip->y || y >= clip->y + clip->h)
+        return;
+    memcpy(image->pixels + 3 * ((size_t)y * image->width + x), color, 3);
 }
 
-OBJ search_next_nearest_neighbor(NODE root, RECT rect, int user_x, int user_y, OBJ* neighbors, int num_neighbors, double* min_distance) {
-    OBJ next_nearest_neighbor = NULL;
-    double current_min_distance = INFINITY;
+static void fill_rect_clipped(struct framebuffer* image, const SDL_Rect* clip, const SDL_Rect* rect, const Uint8 color[3]) {
+    int min_x = rect->x > clip->x ? rect->x : clip->x;
+    int min_y = rect->y > clip->y ? rect->y : clip->y;
+    int max_x = rect->x + rect->w < clip->x + clip->w ? rect->x + rect->w : clip->x + clip->w;
+    int max_y = rect->y + rect->h < clip->y + clip->h ? rect->y + rect->h : clip->y + clip->h;
+    for (int y = min_y; y < max_y; ++y)
+        for (int x = min_x; x < max_x; ++x)
+            memcpy(image->pixels + 3 * ((size_t)y * image->width + x), color, 3);
+}
 
-    if (root == NULL)
-        return NULL;
+// Draws the outline of a rectangle the way SDL_RenderDrawRect does
+static void draw_rect_clipped(struct framebuffer* image, const SDL_Rect* clip, const SDL_Rect* rect, const Uint8 color[3]) {
+    if (rect->w <= 0 || rect->h <= 0 || !rect_visible(clip, rect->x, rect->y, rect->w, rect->h))
+        return;
+    SDL_Rect edges[4] = {{rect->x, rect->y, rect->w, 1}, {rect->x, rect->y + rect->h - 1, rect->w, 1},
+                         {rect->x, rect->y, 1, rect->h}, {rect->x + rect->w - 1, rect->y, 1, rect->h}};
+    for (int i = 0; i < 4; ++i)
+        fill_rect_clipped(image, clip, &edges[i], color);
+}
 
-    if (root->is_leaf) {
-        // If the current node is a leaf node, process its objects
-        for (int i = 0; i < root->count; ++i) {
-            OBJ obj = root->objects[i];
-            double distance = euclidean_distance(user_x, user_y, obj->x, obj->y);
-
-            // Check if the object is not already in the neighbors array and if it's closer than the current minimum distance
-            bool found = false;
-            for (int j = 0; j < num_neighbors; ++j) {
-                if (neighbors[j] == obj) {
-                    found = true;
-                    break;
-                }
-            }
+// Returns the offset along the minor axis of the point k steps along the major axis of a line spanning major by minor pixels,
+// rounded the way Bresenham's algorithm does. rest receives minor * k modulo major, so the next points can follow incrementally.
+static long long line_minor_offset(long long major, long long minor, long long k, long long* rest) {
+    unsigned long long product = (unsigned long long)minor * (unsigned long long)k;
+    *rest = (long long)(product % (unsigned long long)major);
+    return (long long)(product / (unsigned long long)major) + (2 * *rest >= major);
+}
 
-            if (!found && distance < current_min_distance) {
-                current_min_distance = distance;
-                next_nearest_neighbor = obj;
-            }
-        }
-    } else {
-        // If the current node is an internal node, process its children
-        if (rect_intersects(rect, bounding_box(root))) {
-            for (int i = 0; i < root->count; ++i) {
-                OBJ next_neighbor = search_next_nearest_neighbor(root->children[i], root->regions[i], user_x, user_y, neighbors, num_neighbors, &current_min_distance);
-                if (next_neighbor != NULL && current_min_distance < *min_distance) {
-                    next_nearest_neighbor = next_neighbor;
-                    *min_distance = current_min_distance; // Update the minimum distance
-                }
-            }
-        }
+// Draws a line with Bresenham's algorithm, keeping only the pixels inside clip. The line is clipped first, in the integer
+// parameter of its major axis so the pixels match those of the whole line, and only the steps inside clip are walked.
+static void draw_line_clipped(struct framebuffer* image, const SDL_Rect* clip, int x0, int y0, int x1, int y1, const Uint8 color[3]) {
+    long long dx = llabs((long long)x1 - x0), dy = llabs((long long)y1 - y0);
+    bool x_major = dx >= dy;
+    long long major = x_major ? dx : dy, minor = x_major ? dy : dx;
+    if (major == 0) {
+        plot_pixel(image, clip, x0, y0, color);
+        return;
     }
+    int step_x = x0 < x1 ? 1 : -1, step_y = y0 < y1 ? 1 : -1;
+
+    // Offsets from the start, in the direction of the line, of the clip edges along each axis
+    long long clip_x0 = step_x > 0 ? (long long)clip->x - x0 : (long long)x0 - (clip->x + clip->w - 1);
+    long long clip_x1 = step_x > 0 ? (long long)clip->x + clip->w - 1 - x0 : (long long)x0 - clip->x;
+    long long clip_y0 = step_y > 0 ? (long long)clip->y - y0 : (long long)y0 - (clip->y + clip->h - 1);
+    long long clip_y1 = step_y > 0 ? (long long)clip->y + clip->h - 1 - y0 : (long long)y0 - clip->y;
+    long long minor_lo = x_major ? clip_y0 : clip_x0, minor_hi = x_major ? clip_y1 : clip_x1;
+    long long first = x_major ? clip_x0 : clip_y0, last = x_major ? clip_x1 : clip_y1;
+    first = first > 0 ? first : 0;
+    last = last < major ? last : major;
+    long long rest;
+    if (first > last || line_minor_offset(major, minor, first, &rest) > minor_hi || line_minor_offset(major, minor, last, &rest) < minor_lo)
+        return;
 
-    // Update the minimum distance if it's changed
-    if (current_min_distance < *min_distance) {
-        *min_distance = current_min_distance;
+    // The minor offset never decreases along the line, so the steps inside the minor range are found by bisection
+    for (long long lo = first, hi = last; lo < hi; ) {
+        long long mid = lo + (hi - lo) / 2;
+        if (line_minor_offset(major, minor, mid, &rest) < minor_lo)
+            lo = first = mid + 1;
+        else
+            hi = mid;
+    }
+    for (long long lo = first, hi = last; lo < hi; ) {
+        long long mid = hi - (hi - lo) / 2;
+        if (line_minor_offset(major, minor, mid, &rest) > minor_hi)
+            hi = last = mid - 1;
+        else
+            lo = mid;
     }
 
-    return next_nearest_neighbor;
+    long long quotient = line_minor_offset(major, minor, first, &rest) - (2 * rest >= major);
+    for (long long k = first; k <= last; ++k) {
+        long long offset = quotient + (2 * rest >= major);
+        long long x = x0 + step_x * (x_major ? k : offset), y = y0 + step_y * (x_major ? offset : k);
+        plot_pixel(image, clip, (int)x, (int)y, color);
+        rest += minor;
+        if (rest >= major) {
+            rest -= major;
+            quotient += 1;
+        }
+    }
 }
 
+// Rasterises the tiles of a job until none are left, in the order render_r_tree_node and render_points_within_radius draw
+static void* render_tiles(void* arg) {
+    struct render_job* job = (struct render_job *)arg;
+    struct framebuffer* image = job->image;
+    const struct render_batch* tree = job->tree;
+    const struct render_batch* query = job->query;
+    const Uint8 red[3] = {0xFF, 0x00, 0x00}, cyan[3] = {0x00, 0xFF, 0xFF}, yellow[3] = {0xFF, 0xFF, 0x00}, green[3] = {0x00, 0xFF, 0x00};
+    while (true) {
+        int tile = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED);
+        if (tile >= job->num_tiles)
+            break;
+        SDL_Rect clip = {(tile % job->num_tiles_x) * RENDER_TILE, (tile / job->num_tiles_x) * RENDER_TILE, RENDER_TILE, RENDER_TILE};
+        clip.w = clip.x + clip.w > image->width ? image->width - clip.x : clip.w;
+        clip.h = clip.y + clip.h > image->height ? image->height - clip.y : clip.h;
+
+        for (int i = 0; i < tree->num_node_rects; ++i)
+            draw_rect_clipped(image, &clip, &tree->node_rects[i], red);
+        for (int i = 0; i < tree->num_object_rects; ++i)
+            draw_rect_clipped(image, &clip, &tree->object_rects[i], cyan);
+        for (int i = 0; i < tree->num_points; ++i)
+            plot_pixel(image, &clip, tree->points[i].x, tree->points[i].y, cyan);
+        for (int shade = 0; shade < LOD_SHADES; ++shade) {
+            Uint8 level = density_level(shade);
+            const Uint8 color[3] = {0x00, level, level};
+            for (int i = 0; i < tree->num_density_rects[shade]; ++i)
+                fill_rect_clipped(image, &clip, &tree->density_rects[shade][i], color);
+        }
+        if (query == NULL)
+            continue;
+        SDL_Rect user = {job->user_x - 2, job->user_y - 2, 4, 4};
+        fill_rect_clipped(image, &clip, &user, green);
+        for (int i = 0; i < query->num_object_rects; ++i)
+            draw_rect_clipped(image, &clip, &query->object_rects[i], yellow);
+        for (int i = 1; i < query->num_points; ++i)
+            draw_line_clipped(image, &clip, query->points[i - 1].x, query->points[i - 1].y, query->points[i].x, query->points[i].y, yellow);
+    }
+    return NULL;
+}
 
-void find_k_nearest_neighbors(NODE root, int user_x, int user_y, int K, OBJ* neighbors) {
-    OBJ nearest_neighbor;
-    double min_distance;
-
-    // Find the first nearest neighbor
-    nearest_neighbor = find_nearest_neighbor(root, user_x, user_y);
-    neighbors[0] = nearest_neighbor;
-    min_distance = euclidean_distance(user_x, user_y, nearest_neighbor->x, nearest_neighbor->y);
+static void free_render_batch(struct render_batch* batch) {
+    free(batch->node_rects);
+    free(batch->object_rects);
+    free(batch->points);
+    for (int shade = 0; shade < LOD_SHADES; ++shade)
+        free(batch->density_rects[shade]);
+}
 
-    // Find the remaining K-1 nearest neighbors
-    for (int i = 1; i < K; ++i) {
-        nearest_neighbor = NULL;
-        double current_min_distance = INFINITY;
+// Renders the tree, and the objects within radius of the user if radius is not negative, into a PPM image of the viewer's size;
+// returns 0, or -1 if the image cannot be written
+int render_r_tree_to_file(R_TREE r_tree, const char* path, int user_x, int user_y, double radius) {
+    struct framebuffer image = {SCREEN_WIDTH, SCREEN_HEIGHT, (unsigned char *)calloc((size_t)SCREEN_WIDTH * SCREEN_HEIGHT, 3)};
+    SDL_Rect viewport = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    struct render_batch tree, query;
+    memset(&tree, 0, sizeof(tree));
+    memset(&query, 0, sizeof(query));
+    batch_r_tree_node(&tree, &viewport, r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (radius >= 0) {
+        // Browse the neighbours in order of distance so that the number of results is not limited to MAX_OBJECTS
+        int rectSize = 10;
+        NN_ITER iter = nn_iter_open(r_tree, user_x, user_y);
+        OBJ object;
+        double distance;
+        batch_point(&query, user_x, user_y);
+        while ((object = nn_iter_next(iter, &distance)) != NULL && distance <= radius) {
+            SDL_Rect rect = {object->x - rectSize/2, object->y - rectSize/2, rectSize, rectSize};
+            batch_rect(&query.object_rects, &query.num_object_rects, &query.object_capacity, rect);
+            batch_point(&query, object->x, object->y);
+            batch_point(&query, user_x, user_y);
+        }
+        nn_iter_close(iter);
+    }
 
-        // Traverse the R-Tree and find the next nearest neighbor that is not already in the neighbors array
-        nearest_neighbor = search_next_nearest_neighbor(root, bounding_box(root), user_x, user_y, neighbors, i, &current_min_distance);
+    struct render_job job;
+    job.image = &image;
+    job.tree = &tree;
+    job.query = radius >= 0 ? &query : NULL;
+    job.user_x = user_x;
+    job.user_y = user_y;
+    job.num_tiles_x = (SCREEN_WIDTH + RENDER_TILE - 1) / RENDER_TILE;
+    job.num_tiles = job.num_tiles_x * ((SCREEN_HEIGHT + RENDER_TILE - 1) / RENDER_TILE);
+    job.next_tile = 0;
+    int num_threads = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cores < 1 ? 1 : (cores > RENDER_MAX_THREADS ? RENDER_MAX_THREADS : (int)cores);
+#endif
+    pthread_t threads[RENDER_MAX_THREADS];
+    for (int i = 1; i < num_threads; ++i)
+        pthread_create(&threads[i], NULL, render_tiles, &job);
+    render_tiles(&job);
+    for (int i = 1; i < num_threads; ++i)
+        pthread_join(threads[i], NULL);
+    free_render_batch(&tree);
+    free_render_batch(&query);
+
+    FILE* out = fopen(path, "wb");
+    bool written = out != NULL && fprintf(out, "P6\n%d %d\n255\n", image.width, image.height) > 0 &&
+                   fwrite(image.pixels, 3, (size_t)image.width * image.height, out) == (size_t)image.width * image.height;
+    if (out != NULL && fclose(out) != 0)
+        written = false;
+    free(image.pixels);
+    return written ? 0 : -1;
+}
 
-        // Store the found neighbor
-        neighbors[i] = nearest_neighbor;
-        min_distance = current_min_distance;
+// Renders the tree loaded from data_path, if any, to image_path; returns the process exit status
+int run_render_out(const char* image_path, const char* data_path, int user_x, int user_y, double radius) {
+    R_TREE r_tree = data_path != NULL ? load_r_tree(data_path) : create_new_r_tree();
+    if (r_tree == NULL) {
+        fprintf(stderr, "Cannot read %s\n", data_path);
+        return 1;
+    }
+    if (render_r_tree_to_file(r_tree, image_path, user_x, user_y, radius) < 0) {
+        fprintf(stderr, "Cannot write %s\n", image_path);
+        return 1;
     }
+    printf("Rendered %d objects to %s\n", subtree_count(r_tree->root), image_path);
+    return 0;
 }
 
+//******************************************************************************************************************************************************************
 
 
 
 
+int main(int argc, char *argv[])  {
 
+    // Benchmark mode: --bench [objects] [queries] runs without opening a window
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return run_benchmark(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000);
 
+    // Self test mode: --selftest [objects] [writers] stresses concurrent inserts and queries without opening a window
+    if (argc > 1 && strcmp(argv[1], "--selftest") == 0)
+        return run_selftest(argc > 2 ? atoi(argv[2]) : 80000, argc > 3 ? atoi(argv[3]) : 8);
 
-int main(int argc, char *argv[])  {
+    // Server mode: --serve ADDRESS [FILE] serves the index over a socket without opening a window
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+        return run_server(argv[2], argc > 3 ? argv[3] : NULL);
 
+    // Load generator mode: --loadgen ADDRESS [RATE] [SECONDS] [CONNECTIONS] [MIX] [FILE] drives a server started with --serve
+    if (argc > 2 && strcmp(argv[1], "--loadgen") == 0)
+        return run_loadgen(argv[2], argc > 3 ? atof(argv[3]) : 10000, argc > 4 ? atof(argv[4]) : 10, argc > 5 ? atoi(argv[5]) : 16,
+                           argc > 6 ? argv[6] : "knn:70,window:25,insert:5", argc > 7 ? argv[7] : NULL);
 
+    // Headless mode: --render-out IMAGE [FILE [X Y RADIUS]] writes the view to a PPM image without opening a window
+    if (argc > 2 && strcmp(argv[1], "--render-out") == 0)
+        return run_render_out(argv[2], argc > 3 ? argv[3] : NULL, argc > 6 ? atoi(argv[4]) : 0, argc > 6 ? atoi(argv[5]) : 0,
+                              argc > 6 ? atof(argv[6]) : -1);
 
     // Initialize SDL
     if (!init_sdl()) {
@@ -1207,7 +7821,8 @@ int main(int argc, char *argv[])  {
     SDL_Event e;
     // Create and initialize your R-tree
     R_TREE r_tree = create_new_r_tree();
-
+    // Let inserts record what they change so that frames redraw only those areas
+    track_dirty_regions = true;
 
 
     // Render the R-Tree visualization
@@ -1231,17 +7846,10 @@ int main(int argc, char *argv[])  {
                 char filename[100];
                 printf("Enter the file name: ");
                 scanf("%s", filename);
-                FILE *objects_file = fopen(filename, "r");
-                if (objects_file == NULL) {
+                if (load_objects_file(r_tree, filename) < 0) {
                     fprintf(stderr, "Error opening objects file!\n");
                     break;
                 }
-                int x, y;
-                char name[100];
-                while (fscanf(objects_file, "%d %d %s", &x, &y, name) != EOF) {
-                    insert_in_r_tree(r_tree, create_new_object(x, y, name));
-                }
-                fclose(objects_file);
                 printf("R-tree structure:\n");
                 pre_order_traversal(r_tree->root, 0);
 
@@ -1267,19 +7875,19 @@ int main(int argc, char *argv[])  {
 
 
 
-                // Render the user's coordinates as a point
+                // Render the user's coordinates as a point over the tree
+                render_r_tree_dirty(r_tree);
                 SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF); // Yellow color
                 SDL_RenderDrawPoint(renderer, user_x, user_y);
                 SDL_Rect rect = {user_x - 2, user_y - 2, 4, 4}; // Adjust the size as needed
                 SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF); // Green color
                 SDL_RenderFillRect(renderer, &rect);
-                SDL_RenderPresent(renderer);
 
                 // Search objects within the radius
                 OBJ found_objects[MAX_OBJECTS];
                 int num_found = 0;
                 RECT search_rect = create_new_rect(user_x - radius, user_y - radius, user_x + radius, user_y + radius);
-                search_in_r_tree(r_tree->root, search_rect , user_x, user_y, radius, found_objects, &num_found);
+                search_in_r_tree(r_tree->root, search_rect , user_x, user_y, radius, found_objects, MAX_OBJECTS, &num_found);
 
                 printf("%d - " , num_found);
 
@@ -1299,13 +7907,13 @@ int main(int argc, char *argv[])  {
                 printf("Enter user's coordinates (x y): ");
                 scanf("%d %d", &user_x, &user_y);
 
-                // Render the user's coordinates as a point
+                // Render the user's coordinates as a point over the tree
+                render_r_tree_dirty(r_tree);
                 SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF); // Yellow color
                 SDL_RenderDrawPoint(renderer, user_x, user_y);
                 SDL_Rect rect = {user_x - 2, user_y - 2, 4, 4}; // Adjust the size as needed
                 SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF); // Green color
                 SDL_RenderFillRect(renderer, &rect);
-                SDL_RenderPresent(renderer);
 
                 // Search for nearest neighbor
                 OBJ nearest_neighbor = NULL;
@@ -1316,14 +7924,13 @@ int main(int argc, char *argv[])  {
                 if (nearest_neighbor != NULL) {
                     SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF); // Red color
                     SDL_RenderDrawPoint(renderer, nearest_neighbor->x, nearest_neighbor->y);
-                    SDL_RenderPresent(renderer);
                     printf("Nearest Point - (%d , %d)\n" , nearest_neighbor->x, nearest_neighbor->y);
 
                     // Draw a line between the user's point and the nearest neighbor
                     SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF); // Green color for the line
                     SDL_RenderDrawLine(renderer, user_x, user_y, nearest_neighbor->x, nearest_neighbor->y);
-                    SDL_RenderPresent(renderer);
                 }
+                SDL_RenderPresent(renderer);
                 flag = 1;
                 break;
             }
@@ -1333,13 +7940,13 @@ int main(int argc, char *argv[])  {
                 printf("Enter user's coordinates (x y): ");
                 scanf("%d %d", &user_x, &user_y);
 
-                // Render the user's coordinates as a point
+                // Render the user's coordinates as a point over the tree
+                render_r_tree_dirty(r_tree);
                 SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF); // Yellow color
                 SDL_RenderDrawPoint(renderer, user_x, user_y);
                 SDL_Rect rect = {user_x - 2, user_y - 2, 4, 4}; // Adjust the size as needed
                 SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF); // Green color
                 SDL_RenderFillRect(renderer, &rect);
-                SDL_RenderPresent(renderer);
 
                 // Search for k-nearest neighbors
                 //PriorityQueue* pq = init_priority_queue(K_NEAREST_NEIGHBORS);
@@ -1354,12 +7961,10 @@ int main(int argc, char *argv[])  {
                         SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF); // Red color
                         SDL_RenderDrawPoint(renderer, nearest_neighbors[i]->x, nearest_neighbors[i]->y);
                         printf(" (%d ,%d)" ,  nearest_neighbors[i]->x, nearest_neighbors[i]->y);
-                        SDL_RenderPresent(renderer);
 
                         // Draw a line between the user's point and the nearest neighbor
                         SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF); // Green color for the line
                         SDL_RenderDrawLine(renderer, user_x, user_y, nearest_neighbors[i]->x, nearest_neighbors[i]->y);
-                        SDL_RenderPresent(renderer);
                     }
                 }
                 SDL_RenderPresent(renderer);
@@ -1376,10 +7981,8 @@ int main(int argc, char *argv[])  {
                 printf("Invalid choice!\n");
         }
         if(flag == 0) {
-        // Render the R-Tree visualization
-        SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
-        SDL_RenderClear(renderer);
-        render_r_tree_node(r_tree->root, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+        // Render the R-Tree visualization, redrawing only what the action changed
+        render_r_tree_dirty(r_tree);
         SDL_RenderPresent(renderer);
         }
 
@@ -1389,6 +7992,9 @@ int main(int argc, char *argv[])  {
                 // If the user closes the window, set quit to true
                 quit = true;
             }
+            // Render targets lose their contents on some backends, e.g. when the window is resized or the device is reset
+            if (e.type == SDL_RENDER_TARGETS_RESET)
+                tree_texture_valid = false;
         }
     }
 
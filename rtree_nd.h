@@ -0,0 +1,450 @@
+//******************************************************************************************************************************************************************
+// N-dimensional R-Tree variant.
+//
+// This file is a template: define RTREE_ND_DIMS before including it and it generates a complete R-Tree for that number of dimensions, e.g.
+//
+//     #define RTREE_ND_DIMS 3
+//     #include "rtree_nd.h"
+//
+// generates struct rtree3_rect, NODE3, R_TREE3, OBJ3, rtree3_insert(), rtree3_search_window(), rtree3_find_k_nearest_neighbors() and so on.
+// Every per-dimension loop runs to the constant RTREE_ND_DIMS, so the compiler unrolls ChooseSubtree, the quadratic split, MINDIST and the
+// intersection tests for each instantiation. It can be included several times with different values. It relies on m, M and MAX_TYPE_LEN
+// from rtree.c. Rectangles are stored inline in the nodes and areas are computed as doubles, because a product of four int extents
+// overflows long long.
+//******************************************************************************************************************************************************************
+
+#ifndef RTREE_ND_DIMS
+#error "Define RTREE_ND_DIMS before including rtree_nd.h"
+#endif
+
+#ifndef RTREE_ND_CAT
+#define RTREE_ND_CAT2(a, b, c) a##b##c
+#define RTREE_ND_CAT(a, b, c) RTREE_ND_CAT2(a, b, c)
+#endif
+
+// Names of the generated functions and types e.g. ND(insert) -> rtree3_insert, ND_TYPE(NODE) -> NODE3
+#define ND(name) RTREE_ND_CAT(rtree, RTREE_ND_DIMS, _##name)
+#define ND_TYPE(name) RTREE_ND_CAT(name, RTREE_ND_DIMS, )
+#define ND_FOR_EACH_DIM(d) for (int d = 0; d < RTREE_ND_DIMS; ++d)
+
+// Stores an N-dimensional object.
+struct ND(object)
+{
+    int coords[RTREE_ND_DIMS];
+    char type[MAX_TYPE_LEN];
+};
+typedef struct ND(object) * ND_TYPE(OBJ);
+
+// Stores an N-dimensional bounding rectangle.
+struct ND(rect)
+{
+    int min[RTREE_ND_DIMS];
+    int max[RTREE_ND_DIMS];
+};
+
+// Stores the details of a node of the N-dimensional R-Tree.
+struct ND(node)
+{
+    bool is_leaf;                              // Stores whether node is leaf or internal
+    int count;                                 // Stores the count of children or objects
+    struct ND(rect) regions[M];                // Stores the bounding box of children or objects
+    union
+    {
+        struct ND(node) * children[M];         // Stores the children of node if it is a internal node
+        ND_TYPE(OBJ) objects[M];               // Stores the objects stored if it is a leaf node
+    };
+};
+typedef struct ND(node) * ND_TYPE(NODE);
+
+// Stores the details of the N-dimensional R-Tree.
+struct ND(r_tree)
+{
+    int height;
+    ND_TYPE(NODE) root;
+};
+typedef struct ND(r_tree) * ND_TYPE(R_TREE);
+
+// Stores one entry while a node is being split, M existing entries plus the new one.
+struct ND(entry)
+{
+    struct ND(rect) rect;
+    void * ptr;                                // Child node or object
+};
+
+// Stores an entry of the best-first queue used by the nearest neighbour search.
+struct ND(nn_entry)
+{
+    double distance;
+    ND_TYPE(NODE) node;                        // Node still to be expanded, NULL if entry is an object
+    ND_TYPE(OBJ) object;
+};
+
+// Creates new N-dimensional object
+static inline ND_TYPE(OBJ) ND(create_object)(const int coords[], const char* type_name)
+{
+    ND_TYPE(OBJ) object = (ND_TYPE(OBJ)) malloc(sizeof(struct ND(object)));
+    ND_FOR_EACH_DIM(d)
+        object -> coords[d] = coords[d];
+    strncpy(object -> type, type_name, MAX_TYPE_LEN - 1);
+    object -> type[MAX_TYPE_LEN - 1] = '\0';
+    return object;
+}
+
+// Creates new node
+static inline ND_TYPE(NODE) ND(create_node)(bool is_leaf)
+{
+    ND_TYPE(NODE) node = (ND_TYPE(NODE)) calloc(1, sizeof(struct ND(node)));
+    node -> is_leaf = is_leaf;
+    return node;
+}
+
+// Creates new N-dimensional R-Tree
+static inline ND_TYPE(R_TREE) ND(create)(void)
+{
+    ND_TYPE(R_TREE) r_tree = (ND_TYPE(R_TREE)) malloc(sizeof(struct ND(r_tree)));
+    r_tree -> height = 0;
+    r_tree -> root = ND(create_node)(true);
+    return r_tree;
+}
+
+// Frees a node with its subtree and the objects stored in its leaves
+static void ND(free_node)(ND_TYPE(NODE) node)
+{
+    for (int i = 0; i < node -> count; ++i)
+    {
+        if (node -> is_leaf)
+            free(node -> objects[i]);
+        else
+            ND(free_node)(node -> children[i]);
+    }
+    free(node);
+}
+
+// Frees the N-dimensional R-Tree together with its objects
+static inline void ND(free)(ND_TYPE(R_TREE) r_tree)
+{
+    ND(free_node)(r_tree -> root);
+    free(r_tree);
+}
+
+// Calculates the volume of the rectangle
+static inline double ND(area)(const struct ND(rect)* rect)
+{
+    double area = 1.0;
+    ND_FOR_EACH_DIM(d)
+        area *= (double)rect -> max[d] - rect -> min[d];
+    return area;
+}
+
+// Extends rect1 so that it also covers rect2
+static inline void ND(extend)(struct ND(rect)* rect1, const struct ND(rect)* rect2)
+{
+    ND_FOR_EACH_DIM(d)
+    {
+        rect1 -> min[d] = rect1 -> min[d] <= rect2 -> min[d] ? rect1 -> min[d] : rect2 -> min[d];
+        rect1 -> max[d] = rect1 -> max[d] >= rect2 -> max[d] ? rect1 -> max[d] : rect2 -> max[d];
+    }
+}
+
+// Calculates the increase in volume of rect1 required to contain rect2 within itself
+static inline double ND(increase_in_area)(const struct ND(rect)* rect1, const struct ND(rect)* rect2)
+{
+    struct ND(rect) merged = *rect1;
+    ND(extend)(&merged, rect2);
+    return ND(area)(&merged) - ND(area)(rect1);
+}
+
+// Check if two rectangles intersect
+static inline bool ND(intersects)(const struct ND(rect)* rect1, const struct ND(rect)* rect2)
+{
+    bool intersects = true;
+    ND_FOR_EACH_DIM(d)
+        intersects &= rect2 -> min[d] <= rect1 -> max[d] && rect1 -> min[d] <= rect2 -> max[d];
+    return intersects;
+}
+
+// Calculates MINDIST i.e. the smallest distance from the point to any point of the rectangle
+static inline double ND(min_distance)(const struct ND(rect)* rect, const int point[])
+{
+    double sum = 0.0;
+    ND_FOR_EACH_DIM(d)
+    {
+        double delta = 0.0;
+        if (point[d] < rect -> min[d])
+            delta = (double)rect -> min[d] - point[d];
+        else if (point[d] > rect -> max[d])
+            delta = (double)point[d] - rect -> max[d];
+        sum += delta * delta;
+    }
+    return sqrt(sum);
+}
+
+// Creates the bounding box of a node
+static inline struct ND(rect) ND(bounding_box)(ND_TYPE(NODE) node)
+{
+    struct ND(rect) rect = node -> regions[0];
+    for (int i = 1; i < node -> count; ++i)
+        ND(extend)(&rect, &node -> regions[i]);
+    return rect;
+}
+
+// Selects the child which requires minimum enlargement to contain rect, ties broken by smaller volume
+static inline int ND(choose_subtree)(ND_TYPE(NODE) node, const struct ND(rect)* rect)
+{
+    int index = 0;
+    double min_enlargement = INFINITY;
+    double min_area = INFINITY;
+    for (int i = 0; i < node -> count; ++i)
+    {
+        double enlargement = ND(increase_in_area)(&node -> regions[i], rect);
+        double area = ND(area)(&node -> regions[i]);
+        if (enlargement < min_enlargement || (enlargement == min_enlargement && area < min_area))
+        {
+            min_enlargement = enlargement;
+            min_area = area;
+            index = i;
+        }
+    }
+    return index;
+}
+
+// Appends the entry to node
+static inline void ND(put_entry)(ND_TYPE(NODE) node, struct ND(entry)* entry)
+{
+    node -> regions[node -> count] = entry -> rect;
+    if (node -> is_leaf)
+        node -> objects[node -> count] = (ND_TYPE(OBJ)) entry -> ptr;
+    else
+        node -> children[node -> count] = (ND_TYPE(NODE)) entry -> ptr;
+    node -> count += 1;
+}
+
+// Quadratic split of a full node receiving one more entry; node keeps the first group and the returned sibling gets the second
+static ND_TYPE(NODE) ND(quadratic_split)(ND_TYPE(NODE) node, struct ND(entry)* extra)
+{
+    struct ND(entry) entries[M + 1];
+    bool assigned[M + 1] = {false};
+    for (int i = 0; i < M; ++i)
+    {
+        entries[i].rect = node -> regions[i];
+        entries[i].ptr = node -> is_leaf ? (void *) node -> objects[i] : (void *) node -> children[i];
+    }
+    entries[M] = *extra;
+
+    // QS1: Pick the two seeds that would waste the most volume if grouped together
+    int seed1 = 0, seed2 = 1;
+    double max_waste = -INFINITY;
+    for (int i = 0; i <= M; ++i)
+        for (int j = i + 1; j <= M; ++j)
+        {
+            struct ND(rect) merged = entries[i].rect;
+            ND(extend)(&merged, &entries[j].rect);
+            double waste = ND(area)(&merged) - ND(area)(&entries[i].rect) - ND(area)(&entries[j].rect);
+            if (waste > max_waste)
+            {
+                max_waste = waste;
+                seed1 = i;
+                seed2 = j;
+            }
+        }
+
+    ND_TYPE(NODE) sibling = ND(create_node)(node -> is_leaf);
+    node -> count = 0;
+    ND(put_entry)(node, &entries[seed1]);
+    ND(put_entry)(sibling, &entries[seed2]);
+    assigned[seed1] = assigned[seed2] = true;
+    struct ND(rect) bound1 = entries[seed1].rect;
+    struct ND(rect) bound2 = entries[seed2].rect;
+
+    for (int remaining = M - 1; remaining > 0; --remaining)
+    {
+        // QS2: If a group needs all remaining entries to reach m, assign them to it
+        ND_TYPE(NODE) target = NULL;
+        if (node -> count + remaining == m)
+            target = node;
+        else if (sibling -> count + remaining == m)
+            target = sibling;
+
+        // PN1, PN2: Pick the entry with the strongest preference for one group
+        int next = -1;
+        double max_difference = -1.0;
+        double d1 = 0.0, d2 = 0.0;
+        for (int i = 0; i <= M; ++i)
+        {
+            if (assigned[i])
+                continue;
+            double e1 = ND(increase_in_area)(&bound1, &entries[i].rect);
+            double e2 = ND(increase_in_area)(&bound2, &entries[i].rect);
+            double difference = fabs(e1 - e2);
+            if (difference > max_difference)
+            {
+                max_difference = difference;
+                next = i;
+                d1 = e1;
+                d2 = e2;
+            }
+        }
+
+        // QS3: Least enlargement, then smaller volume, then fewer entries
+        if (target == NULL)
+        {
+            if (d1 != d2)
+                target = d1 < d2 ? node : sibling;
+            else if (ND(area)(&bound1) != ND(area)(&bound2))
+                target = ND(area)(&bound1) < ND(area)(&bound2) ? node : sibling;
+            else
+                target = node -> count <= sibling -> count ? node : sibling;
+        }
+        ND(put_entry)(target, &entries[next]);
+        ND(extend)(target == node ? &bound1 : &bound2, &entries[next].rect);
+        assigned[next] = true;
+    }
+    return sibling;
+}
+
+// Inserts the entry below node; returns the new sibling if node had to be split, NULL otherwise
+static ND_TYPE(NODE) ND(insert_entry)(ND_TYPE(NODE) node, struct ND(entry)* entry)
+{
+    struct ND(entry) pending = *entry;
+    if (!node -> is_leaf)
+    {
+        // CL3: Descend into the subtree requiring least enlargement and adjust its MBR on the way back
+        int index = ND(choose_subtree)(node, &entry -> rect);
+        ND_TYPE(NODE) split = ND(insert_entry)(node -> children[index], entry);
+        node -> regions[index] = ND(bounding_box)(node -> children[index]);
+        if (split == NULL)
+            return NULL;
+        pending.rect = ND(bounding_box)(split);
+        pending.ptr = split;
+    }
+    if (node -> count < M)
+    {
+        ND(put_entry)(node, &pending);
+        return NULL;
+    }
+    return ND(quadratic_split)(node, &pending);
+}
+
+// Inserts a new object in the N-dimensional R-Tree
+static inline void ND(insert)(ND_TYPE(R_TREE) r_tree, ND_TYPE(OBJ) object)
+{
+    struct ND(entry) entry;
+    ND_FOR_EACH_DIM(d)
+        entry.rect.min[d] = entry.rect.max[d] = object -> coords[d];
+    entry.ptr = object;
+
+    ND_TYPE(NODE) split = ND(insert_entry)(r_tree -> root, &entry);
+    // Root was split, grow the tree by one level
+    if (split != NULL)
+    {
+        ND_TYPE(NODE) new_root = ND(create_node)(false);
+        struct ND(entry) left = {ND(bounding_box)(r_tree -> root), r_tree -> root};
+        struct ND(entry) right = {ND(bounding_box)(split), split};
+        ND(put_entry)(new_root, &left);
+        ND(put_entry)(new_root, &right);
+        r_tree -> root = new_root;
+        r_tree -> height += 1;
+    }
+}
+
+// Search for objects inside the window, storing at most max_found of them
+static void ND(search_node)(ND_TYPE(NODE) node, const struct ND(rect)* window, ND_TYPE(OBJ) found_objects[], int max_found, int* num_found)
+{
+    for (int i = 0; i < node -> count && *num_found < max_found; ++i)
+    {
+        if (!ND(intersects)(&node -> regions[i], window))
+            continue;
+        if (node -> is_leaf)
+            found_objects[(*num_found)++] = node -> objects[i];
+        else
+            ND(search_node)(node -> children[i], window, found_objects, max_found, num_found);
+    }
+}
+
+static inline void ND(search_window)(ND_TYPE(R_TREE) r_tree, const struct ND(rect)* window, ND_TYPE(OBJ) found_objects[], int max_found, int* num_found)
+{
+    ND(search_node)(r_tree -> root, window, found_objects, max_found, num_found);
+}
+
+// Pushes an entry into the min-heap of the nearest neighbour search
+static inline void ND(nn_push)(struct ND(nn_entry)** heap, int* size, int* capacity, ND_TYPE(NODE) node, ND_TYPE(OBJ) object, double distance)
+{
+    if (*size == *capacity)
+    {
+        *capacity *= 2;
+        *heap = (struct ND(nn_entry) *) realloc(*heap, sizeof(struct ND(nn_entry)) * *capacity);
+    }
+    struct ND(nn_entry)* h = *heap;
+    int i = (*size)++;
+    h[i].distance = distance;
+    h[i].node = node;
+    h[i].object = object;
+    while (i > 0 && h[i].distance < h[(i - 1) / 2].distance)
+    {
+        struct ND(nn_entry) temp = h[(i - 1) / 2];
+        h[(i - 1) / 2] = h[i];
+        h[i] = temp;
+        i = (i - 1) / 2;
+    }
+}
+
+// Removes the closest entry from the min-heap of the nearest neighbour search
+static inline struct ND(nn_entry) ND(nn_pop)(struct ND(nn_entry)* heap, int* size)
+{
+    struct ND(nn_entry) top = heap[0];
+    heap[0] = heap[--(*size)];
+    int i = 0;
+    while (true)
+    {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < *size && heap[left].distance < heap[smallest].distance)
+            smallest = left;
+        if (right < *size && heap[right].distance < heap[smallest].distance)
+            smallest = right;
+        if (smallest == i)
+            break;
+        struct ND(nn_entry) temp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = temp;
+        i = smallest;
+    }
+    return top;
+}
+
+// Finds the K nearest neighbours of the point, closest first; returns how many were found
+static inline int ND(find_k_nearest_neighbors)(ND_TYPE(R_TREE) r_tree, const int point[], int K, ND_TYPE(OBJ) neighbors[], double distances[])
+{
+    int size = 0, capacity = 4 * M, found = 0;
+    struct ND(nn_entry)* heap = (struct ND(nn_entry) *) malloc(sizeof(struct ND(nn_entry)) * capacity);
+    if (r_tree -> root -> count > 0)
+        ND(nn_push)(&heap, &size, &capacity, r_tree -> root, NULL, 0.0);
+
+    while (size > 0 && found < K)
+    {
+        struct ND(nn_entry) entry = ND(nn_pop)(heap, &size);
+        if (entry.node == NULL)
+        {
+            neighbors[found] = entry.object;
+            if (distances != NULL)
+                distances[found] = entry.distance;
+            ++found;
+            continue;
+        }
+        for (int i = 0; i < entry.node -> count; ++i)
+        {
+            double distance = ND(min_distance)(&entry.node -> regions[i], point);
+            if (entry.node -> is_leaf)
+                ND(nn_push)(&heap, &size, &capacity, NULL, entry.node -> objects[i], distance);
+            else
+                ND(nn_push)(&heap, &size, &capacity, entry.node -> children[i], NULL, distance);
+        }
+    }
+    free(heap);
+    return found;
+}
+
+#undef ND
+#undef ND_TYPE
+#undef ND_FOR_EACH_DIM
+#undef RTREE_ND_DIMS